@@ -16,6 +16,8 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <sys/resource.h>
 
@@ -270,14 +272,14 @@ struct Logger {
         /* User redefinable functions (methods) */
         VPrintf vprintf;
         FWritePrefix fwrite_prefix;
+
+        struct AsyncLog *async; // non-NULL for asynchronous loggers.
 };
 
-static void init_static_logger(Logger *lg)
-/* Idempotently ensures initialisation of builtin loggers before each use. */
-{
-        if(lg->nrefs)
-                return;
+int elm_log_level = ELM_LEVEL_DEBUG;
 
+static void init_one_static_logger(Logger *lg)
+{
         switch( (uintptr_t)lg->stream ) {
         case 0: break; /* leave NULL logs alone */
         case 1: lg->stream = stdout; break;
@@ -287,7 +289,24 @@ static void init_static_logger(Logger *lg)
                 break;
         }
 
-        lg->nrefs = -1;
+        __atomic_store_n(&lg->nrefs, -1, __ATOMIC_RELEASE);
+}
+
+static void init_static_loggers(void)
+{
+        init_one_static_logger(&_elm_null_log);
+        init_one_static_logger(&_elm_std_log);
+        init_one_static_logger(&_elm_err_log);
+        init_one_static_logger(&_elm_dbg_log);
+}
+
+static void init_static_logger(Logger *lg)
+/* Idempotently ensures initialisation of builtin loggers before each use. */
+{
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+        if(__atomic_load_n(&lg->nrefs, __ATOMIC_ACQUIRE))
+                return;
+        pthread_once(&once, init_static_loggers);
 }
 
 static int log_prefix(Logger *lg, LogMeta *meta)
@@ -328,14 +347,26 @@ no_write:
         return -1;
 }
 
+static int log_error_unlocked(Logger *lg, Error *err);
+
 int log_error(Logger *lg, Error *err)
 /* Convert an error to a string, then log it. Metadata come from the error. */
 {
         init_static_logger(lg);
         if(!lg->stream) // is this a null log?
                 return 0;
+        if(!lg->async)
+                return log_error_unlocked(lg, err);
 
+        // Errors are rare, so just keep the flusher off the stream meanwhile.
+        flockfile(lg->stream);
+        int n = log_error_unlocked(lg, err);
+        funlockfile(lg->stream);
+        return n;
+}
 
+static int log_error_unlocked(Logger *lg, Error *err)
+{
         // this has to be a special case, else LibC might do its own malloc
         ErrorType *etype = err->type;
         if(etype == nomem_error_type)
@@ -403,17 +434,231 @@ Logger _elm_null_log = {
 };
 
 
+// Asynchronous loggers ------.
+/*
+  Each thread that logs to an asynchronous logger gets its own fixed-size ring
+  of formatted messages, with that thread as the only producer and the
+  logger's flusher thread as the only consumer.  The producer publishes whole
+  lines by advancing `head`, so the flusher can copy bytes out without parsing
+  them.  If a ring is full, the message is counted as dropped rather than
+  making the caller wait.
+*/
+
+#define ASYNC_RING_BYTES (64 * 1024) // must be a power of two
+#define ASYNC_MAX_LINE 1024          // longer messages are truncated
+#define ASYNC_IDLE_NS 1000000        // flusher poll interval when idle
+
+typedef struct AsyncRing AsyncRing;
+struct AsyncRing {
+        AsyncRing *next;         // guarded by AsyncLog.lock
+        int orphaned;            // set once the producer thread has exited
+        unsigned long dropped;   // messages that did not fit
+        uint64_t head;           // bytes ever written, set by the producer
+        char pad[64];            // keep head and tail in separate cache lines
+        uint64_t tail;           // bytes ever flushed, set by the flusher
+        char buf[ASYNC_RING_BYTES];
+};
+
+typedef struct AsyncLog {
+        pthread_t flusher;
+        pthread_key_t key;       // this thread's AsyncRing
+        pthread_mutex_t lock;    // serialises flushing and guards .rings
+        AsyncRing *rings;
+        unsigned long dropped;   // from rings already freed
+        int stop;
+} AsyncLog;
+
+static int async_prefix(Logger *lg, LogMeta *meta, char *buf, size_t n)
+{
+        if(lg->fwrite_prefix == dbg_prefix)
+                return snprintf(buf, n, "%s (%s:%d in %s): ",
+                        lg->zname, meta->file, meta->line, meta->func);
+        return snprintf(buf, n, "%s: ", lg->zname);
+}
+
+static void async_orphan_ring(void *ring)
+/* pthread_key destructor, called as a thread using the logger exits. */
+{
+        AsyncRing *r = ring;
+        __atomic_store_n(&r->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static AsyncRing *async_ring(AsyncLog *al)
+/* Get (or create) the calling thread's ring for `al`. */
+{
+        AsyncRing *r = pthread_getspecific(al->key);
+        if(r)
+                return r;
+
+        r = MALLOC(sizeof *r);
+        r->orphaned = 0;
+        r->dropped = 0;
+        r->head = r->tail = 0;
+
+        pthread_mutex_lock(&al->lock);
+        r->next = al->rings;
+        al->rings = r;
+        pthread_mutex_unlock(&al->lock);
+
+        pthread_setspecific(al->key, r);
+        return r;
+}
+
+static int async_vprintf(Logger *lg, LogMeta *meta, const char *msg, va_list va)
+/* method: format a message vprintf style into this thread's ring. */
+{
+        char line[ASYNC_MAX_LINE];
+        const int max = sizeof line - 1; // leave room for the '\n'
+
+        int n = async_prefix(lg, meta, line, max + 1);
+        if(n >= 0 && n < max)
+                n += vsnprintf(line + n, max + 1 - n, msg, va);
+        if(n < 0)
+                return -1;
+        if(n > max)
+                n = max;
+        line[n++] = '\n';
+
+        AsyncRing *r = async_ring(lg->async);
+        uint64_t head = r->head;
+        uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if(ASYNC_RING_BYTES - (head - tail) < n) {
+                __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+                errno = ENOBUFS;
+                return -1;
+        }
+
+        size_t off = head % ASYNC_RING_BYTES;
+        size_t first = ASYNC_RING_BYTES - off;
+        if(first > n)
+                first = n;
+        memcpy(r->buf + off, line, first);
+        memcpy(r->buf, line + first, n - first);
+        __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+        return n;
+}
+
+static size_t async_drain(Logger *lg)
+/* Write out everything queued so far; returns the number of bytes written. */
+{
+        AsyncLog *al = lg->async;
+        size_t total = 0;
+
+        pthread_mutex_lock(&al->lock);
+        for(AsyncRing **pr = &al->rings; *pr; ) {
+                AsyncRing *r = *pr;
+                int orphaned = __atomic_load_n(&r->orphaned, __ATOMIC_ACQUIRE);
+                uint64_t tail = r->tail;
+                uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+                size_t n = head - tail, off = tail % ASYNC_RING_BYTES;
+                size_t first = ASYNC_RING_BYTES - off;
+                if(first > n)
+                        first = n;
+                fwrite(r->buf + off, 1, first, lg->stream);
+                fwrite(r->buf, 1, n - first, lg->stream);
+                __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+                total += n;
+
+                if(!orphaned) {
+                        pr = &r->next;
+                        continue;
+                }
+                // Its thread is gone, and we have everything it wrote.
+                *pr = r->next;
+                al->dropped += r->dropped;
+                free(r);
+        }
+        if(total)
+                fflush(lg->stream);
+        pthread_mutex_unlock(&al->lock);
+        return total;
+}
+
+static void *async_flusher(void *arg)
+{
+        Logger *lg = arg;
+        const struct timespec idle = { .tv_nsec = ASYNC_IDLE_NS };
+        for(;;) {
+                int stop = __atomic_load_n(&lg->async->stop, __ATOMIC_ACQUIRE);
+                size_t n = async_drain(lg);
+                if(stop)
+                        return NULL;
+                if(!n)
+                        nanosleep(&idle, NULL);
+        }
+}
+
+static void start_async(Logger *lg)
+{
+        AsyncLog *al = MALLOC(sizeof *al);
+        *al = (AsyncLog){0};
+        pthread_mutex_init(&al->lock, NULL);
+        int ern = pthread_key_create(&al->key, async_orphan_ring);
+        if(ern)
+                SYS_PANIC(ern, "Creating thread-key for async logger");
+
+        lg->async = al;
+        lg->vprintf = async_vprintf;
+        ern = pthread_create(&al->flusher, NULL, async_flusher, lg);
+        if(ern)
+                SYS_PANIC(ern, "Starting async logger thread");
+}
+
+static void stop_async(Logger *lg)
+{
+        AsyncLog *al = lg->async;
+        __atomic_store_n(&al->stop, 1, __ATOMIC_RELEASE);
+        pthread_join(al->flusher, NULL);
+
+        pthread_key_delete(al->key);
+        for(AsyncRing *r = al->rings, *next; r; r = next) {
+                next = r->next;
+                free(r);
+        }
+        pthread_mutex_destroy(&al->lock);
+        free(al);
+        lg->async = NULL;
+}
+
+unsigned long logger_dropped(Logger *lg)
+{
+        AsyncLog *al = lg->async;
+        if(!al)
+                return 0;
+
+        pthread_mutex_lock(&al->lock);
+        unsigned long n = al->dropped;
+        for(AsyncRing *r = al->rings; r; r = r->next)
+                n += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&al->lock);
+        return n;
+}
+
+int flush_logger(Logger *lg)
+{
+        init_static_logger(lg);
+        if(!lg->stream)
+                return 0;
+        if(lg->async)
+                async_drain(lg);
+        return fflush(lg->stream);
+}
+
+
 // User created loggers ------.
 
 Logger *new_logger(const char *zname, FILE *stream, const char *opts)
 /* Create a standard logger that writes to "stream". */
 {
         FWritePrefix fwp = log_prefix;
+        int async = 0;
 
         if(opts) {
                 int ch;
                 for(const char *o=opts; ch=*o; o++) switch(ch) {
                 case 'd': fwp = dbg_prefix; continue;
+                case 'a': async = 1; continue;
                 }
         }
 
@@ -427,8 +672,11 @@ Logger *new_logger(const char *zname, FILE *stream, const char *opts)
         lg->vprintf = log_vprintf;
         lg->fwrite_prefix = fwp;
         lg->zname = strdup(zname);
+        lg->async = NULL;
 
         lg->nrefs = 1;
+        if(async && stream)
+                start_async(lg);
         return lg;
 }
 
@@ -453,6 +701,8 @@ Error *destroy_logger(Logger *lg)
                 return NULL;
         }
 
+        if(lg->async)
+                stop_async(lg);
         free((char*)lg->zname);
         free(lg);
         return NULL;
@@ -514,7 +764,8 @@ static const ErrorType _nomem_error_type = {
 
 const ErrorType *const nomem_error_type = &_nomem_error_type;
 
-static Error nomem_error =  {
+// Each thread has its own, so that concurrent failures don't clobber metadata.
+static __thread Error nomem_error =  {
         .type = &_nomem_error_type,
         .meta = {
                 .line = -1,
@@ -525,7 +776,7 @@ static Error nomem_error =  {
 
 static int nomem_fwrite(Error *e, FILE *out)
 {
-        return emergency_message("NOMEM", &nomem_error.meta, "Out of virtual memory");
+        return emergency_message("NOMEM", &e->meta, "Out of virtual memory");
 }
 
 Error *error_nomem(const char* file, int line, const char *func)
@@ -562,7 +813,9 @@ void *malloc_or_die(const char* file, int line, const char *func, size_t n)
 
 // -- Panic ----------------------------
 
-static PanicReturn *_panic_return;
+// The innermost TRY of the calling thread.  Each thread has its own stack of
+// them, so a panic always unwinds to a TRY on its own thread.
+static __thread PanicReturn *_panic_return;
 
 Error *_panic_pop(PanicReturn *check)
 {
@@ -322,8 +322,12 @@ struct PanicReturn {
 #define NO_WORRIES(R) _panic_pop(&(R))
 
 /*
+   Each thread has its own stack of TRY blocks, so a panic on one thread is
+   only ever caught by a TRY on that thread.  A panic on a thread with no TRY
+   still ends the whole process.
+
    If you ever want to know whether or not you are inside a TRY/NO_WORRIES
-   pair, you can call
+   pair (on the calling thread), you can call
  */
 int panic_is_caught();
 
@@ -401,10 +405,22 @@ extern Logger *new_logger(const char *zname, FILE *stream, const char *opts);
   messages.
 
   You can modify the style of logging by setting "opts" to be non-NULL, this
-  string is just a list of option charactors, the only one defined so far is
-  'd' which causes the logger to print out the source location metadata (like
-  the debug logger).  All other option characters are ignored, in this version
-  of elm.  opts==NULL is equivalent to opts="".
+  string is just a list of option charactors:
+
+        'd'  print out the source location metadata (like the debug logger).
+        'a'  log asynchronously (see below).
+
+  All other option characters are ignored, in this version of elm.
+  opts==NULL is equivalent to opts="".
+
+  An asynchronous logger formats each message on the calling thread into a
+  fixed-size buffer belonging to that thread, and a background thread writes
+  them to "stream".  Callers never wait for I/O; if a thread's buffer is full
+  its message is dropped (LOG_F returns -1 with errno = ENOBUFS).  Messages
+  from one thread stay in order, but those from different threads might not.
+  Lines longer than about 1 KiB are truncated.  Don't write to "stream"
+  yourself while the logger exists, and don't destroy it while other threads
+  might still be using it.
 
   Loggers are reference counted, you can increment and decrement references
   using:
@@ -415,6 +431,16 @@ Error *destroy_logger(Logger *lg);
   (In spite of its name, `destroy_logger` only destroys the logger when
   the reference count drops to zero).  These function do nothing at all
   to the standard (statically allocated) loggers.
+
+  Destroying an asynchronous logger writes out everything it has queued.  You
+  can also do that without destroying it, and see how many messages it has
+  dropped, using:
+*/
+extern int flush_logger(Logger *lg);
+extern unsigned long logger_dropped(Logger *lg);
+/*
+  flush_logger returns the result of fflush() on the stream.  logger_dropped
+  is always zero for synchronous loggers.
 */
 
 /*
@@ -436,6 +462,63 @@ extern int log_f(Logger *lg,
            const char *fmt,
            ...) CHECK_FMT(5);
 
+/*
+  Log levels let you leave verbose logging in the code, but compile it out.
+  Messages can be sent at one of four levels using:
+
+        LOG_ERR_F(logger, fmt, ...)     at ELM_LEVEL_ERR
+        LOG_WARN_F(logger, fmt, ...)    at ELM_LEVEL_WARN
+        LOG_INFO_F(logger, fmt, ...)    at ELM_LEVEL_INFO
+        LOG_DEBUG_F(logger, fmt, ...)   at ELM_LEVEL_DEBUG
+
+  Messages above the compile-time level ELM_LOG_LEVEL expand to nothing at
+  all: no call is made and the arguments are not evaluated.  Define
+  ELM_LOG_LEVEL before including elm.h (e.g. -DELM_LOG_LEVEL=ELM_LEVEL_DEBUG)
+  to change it from the default of ELM_LEVEL_INFO.
+
+  The remaining messages are sent to LOG_F only if their level is also at or
+  below the run-time level `elm_log_level`, which defaults to ELM_LEVEL_DEBUG.
+  Unlike LOG_F, these macros are statements with no value.
+*/
+#define ELM_LEVEL_ERR   1
+#define ELM_LEVEL_WARN  2
+#define ELM_LEVEL_INFO  3
+#define ELM_LEVEL_DEBUG 4
+
+#ifndef ELM_LOG_LEVEL
+#define ELM_LOG_LEVEL ELM_LEVEL_INFO
+#endif
+
+extern int elm_log_level;
+
+#define LOG_LEVEL_F(LVL, L, ...) do {\
+                        if((LVL) <= elm_log_level) LOG_F(L, __VA_ARGS__); \
+               } while(0)
+
+#if ELM_LOG_LEVEL >= ELM_LEVEL_ERR
+#define LOG_ERR_F(L, ...) LOG_LEVEL_F(ELM_LEVEL_ERR, L, __VA_ARGS__)
+#else
+#define LOG_ERR_F(L, ...) ((void)0)
+#endif
+
+#if ELM_LOG_LEVEL >= ELM_LEVEL_WARN
+#define LOG_WARN_F(L, ...) LOG_LEVEL_F(ELM_LEVEL_WARN, L, __VA_ARGS__)
+#else
+#define LOG_WARN_F(L, ...) ((void)0)
+#endif
+
+#if ELM_LOG_LEVEL >= ELM_LEVEL_INFO
+#define LOG_INFO_F(L, ...) LOG_LEVEL_F(ELM_LEVEL_INFO, L, __VA_ARGS__)
+#else
+#define LOG_INFO_F(L, ...) ((void)0)
+#endif
+
+#if ELM_LOG_LEVEL >= ELM_LEVEL_DEBUG
+#define LOG_DEBUG_F(L, ...) LOG_LEVEL_F(ELM_LEVEL_DEBUG, L, __VA_ARGS__)
+#else
+#define LOG_DEBUG_F(L, ...) ((void)0)
+#endif
+
 /*
    You can also log an error using log_error.  The metadata (such as the line
    number) will come from the error, not from the location of the logging call.
@@ -15,10 +15,12 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <pthread.h>
 #include <sys/resource.h>
 
 #include "0unit.h"
@@ -427,6 +429,107 @@ static int test_debug_logger()
         PASS();
 }
 
+static int count_calls(int *pcalls)
+{
+        return ++*pcalls;
+}
+
+static int test_log_levels()
+{
+        static const char *expected_text =
+                "TEST: error 1\n"
+                "TEST: warning 2\n"
+                "TEST: info 3\n"
+                "TEST: error 4\n"
+                ;
+
+        size_t size;
+        char *buf;
+        int calls = 0;
+
+        FILE *mstream = open_memstream(&buf, &size);
+        CHK( mstream != NULL );
+        Logger *lg = new_logger("TEST", mstream, NULL);
+        CHK(lg);
+
+        // This file is compiled with the default ELM_LOG_LEVEL.
+        CHK( ELM_LOG_LEVEL == ELM_LEVEL_INFO );
+        CHK( elm_log_level == ELM_LEVEL_DEBUG );
+
+        LOG_ERR_F(lg, "error %d", count_calls(&calls));
+        LOG_WARN_F(lg, "warning %d", count_calls(&calls));
+        LOG_INFO_F(lg, "info %d", count_calls(&calls));
+        LOG_DEBUG_F(lg, "debug %d", count_calls(&calls));
+        CHK( calls == 3 ); // the debug message was compiled out
+
+        elm_log_level = ELM_LEVEL_ERR;
+        LOG_ERR_F(lg, "error %d", count_calls(&calls));
+        LOG_WARN_F(lg, "warning %d", count_calls(&calls));
+        LOG_INFO_F(lg, "info %d", count_calls(&calls));
+        elm_log_level = ELM_LEVEL_DEBUG;
+        CHK( calls == 4 ); // the others were suppressed at run-time
+
+        CHK( size == strlen(expected_text) );
+        CHK( !memcmp(buf, expected_text, size) );
+
+        destroy_logger(lg);
+        fclose(mstream);
+        free(buf);
+
+        PASS();
+}
+
+#define ASYNC_THREADS 4
+#define ASYNC_MESSAGES 2000
+
+static void *async_log_some(void *lg)
+{
+        for(int k = 0; k < ASYNC_MESSAGES; k++)
+                LOG_F(lg, "message %d of %d", k, ASYNC_MESSAGES);
+        return NULL;
+}
+
+static int test_async_logger()
+{
+        size_t size;
+        char *buf;
+
+        FILE *mstream = open_memstream(&buf, &size);
+        CHK( mstream != NULL );
+
+        Logger *lg = new_logger("ATEST", mstream, "a");
+        CHK(lg);
+
+        CHK( LOG_F(lg, "Hello %s!", "async") == 20 );
+        CHK( flush_logger(lg) == 0 );
+        CHK( size == 20 );
+        CHK( !memcmp(buf, "ATEST: Hello async!\n", size) );
+
+        pthread_t threads[ASYNC_THREADS];
+        for(int k = 0; k < ASYNC_THREADS; k++)
+                CHK( !pthread_create(threads + k, NULL, async_log_some, lg) );
+        async_log_some(lg);
+        for(int k = 0; k < ASYNC_THREADS; k++)
+                CHK( !pthread_join(threads[k], NULL) );
+
+        unsigned long dropped = logger_dropped(lg);
+        destroy_logger(lg); // writes out what is still queued.
+
+        // Every message is either written out whole, or counted as dropped.
+        int nlines = 0;
+        for(char *line = buf + 20, *end; (end = memchr(line, '\n',
+                                        buf + size - line)); line = end + 1) {
+                CHK( !memcmp(line, "ATEST: message ", 15) );
+                nlines++;
+        }
+        CHK( nlines + dropped == (ASYNC_THREADS + 1) * ASYNC_MESSAGES );
+
+        fclose(mstream);
+        free(buf);
+
+        PASS();
+}
+
 // ----------------------------------------------------------------------------
 
 static int test_malloc(int n)
@@ -555,7 +658,7 @@ static int chk_recursive_panic(int depth)
 {
         PanicReturn ret;
         Error *err;
-        static int catch_count = 0;
+        static __thread int catch_count = 0;
 
         assert( depth >= 0 && depth <= 10 );
         if(depth == 10)
@@ -627,6 +730,51 @@ static int test_try_panic()
         PASS();
 }
 
+#define PANIC_THREADS 8
+
+static void *panic_in_thread(void *parg)
+/* Catch panics thrown at several depths; returns non-NULL on success. */
+{
+        intptr_t id = (intptr_t)parg;
+        for(int k = 0; k < 1000; k++) {
+                PanicReturn ret;
+                Error *err;
+                if(err = TRY(ret)) {
+                        int ok = !panic_is_caught() &&
+                                 err->type == error_type &&
+                                 atoi(err->data) == id + k;
+                        destroy_error(err);
+                        if(!ok)
+                                return NULL;
+                        continue;
+                }
+                if(!panic_is_caught())
+                        return NULL;
+                if(!chk_recursive_panic(0))
+                        return NULL;
+                PANIC("%d", (int)id + k);
+                NO_WORRIES(ret);
+                return NULL;
+        }
+        return panic_is_caught() ? NULL : parg;
+}
+
+static int test_threaded_panic()
+{
+        pthread_t threads[PANIC_THREADS];
+        for(intptr_t k = 0; k < PANIC_THREADS; k++) {
+                CHK( !pthread_create(threads + k, NULL, panic_in_thread,
+                        (void*)(k + 1)) );
+        }
+        for(intptr_t k = 0; k < PANIC_THREADS; k++) {
+                void *ret;
+                CHK( !pthread_join(threads[k], &ret) );
+                CHK( ret == (void*)(k + 1) );
+        }
+        CHK( !panic_is_caught() );
+        PASS();
+}
+
 static int test_panic_if()
 {
         PanicReturn ret;
@@ -681,12 +829,15 @@ int main(int argc, const char **argv)
 
         test_logging();
         test_debug_logger();
+        test_log_levels();
+        test_async_logger();
         LOG_F(null_log, "EEEK!  I'm invisible!  Don't look!");
         test_logger_refcounts();
         test_static_logger_refcounts();
 
         test_try_panic();
         test_recursive_panic();
+        test_threaded_panic();
         if( argc > 1 && !strcmp(argv[1], "--panic") )
                 PANIC("The slithy toves!"); //FIX
         if( argc > 1 && !strncmp(argv[1], "--panic=", 8) ) {
@@ -19,17 +19,55 @@
 
 #include "readtree.h"
 
+// USDT probes for perf, bpftrace, systemtap etc. (see readtree_latency.bt).  An
+// unattached probe is a single nop.  They are built in whenever <sys/sdt.h>
+// exists, unless you compile with -DREADTREE_USDT=0.
+#ifndef READTREE_USDT
+# ifdef __has_include
+#  if __has_include(<sys/sdt.h>)
+#   define READTREE_USDT 1
+#  endif
+# endif
+#endif
+
+#if READTREE_USDT
+#include <sys/sdt.h>
+#define PROBE1(NAME, A) DTRACE_PROBE1(readtree, NAME, A)
+#define PROBE2(NAME, A, B) DTRACE_PROBE2(readtree, NAME, A, B)
+#else
+#define PROBE1(NAME, A) ((void)0)
+#define PROBE2(NAME, A, B) ((void)0)
+#endif
+
+// ReadTreeConf.decompress needs zlib.  It is built in whenever <zlib.h>
+// exists, unless you compile with -DREADTREE_ZLIB=0.
+#ifndef READTREE_ZLIB
+# ifdef __has_include
+#  if __has_include(<zlib.h>)
+#   define READTREE_ZLIB 1
+#  endif
+# endif
+#endif
+
+#if READTREE_ZLIB
+#include <zlib.h>
+#endif
+
 #define MAX_IN_DIR 1000000
 
 #define MIN_READ 16184
 #define MIN_READ_DIR 128
 
-#define LOG_ERR(...) LOG_F(err_log, __VA_ARGS__);
-#if 1
-#define LOG_DBG(...) LOG_F(null_log, __VA_ARGS__);
-#else
-#define LOG_DBG(...) LOG_F(dbg_log, __VA_ARGS__);
-#endif
+// How much compressed content to read at a time when decompressing.
+#define INFLATE_READ (64 << 10)
+
+// Approximate size of each block of memory carved up into FileChunks.
+#define CHUNK_SLAB_BYTES (4 << 20)
+
+// Debug messages are compiled out unless you build with
+// -DELM_LOG_LEVEL=ELM_LEVEL_DEBUG.
+#define LOG_ERR(...) LOG_ERR_F(err_log, __VA_ARGS__);
+#define LOG_DBG(...) LOG_DEBUG_F(dbg_log, __VA_ARGS__);
 
 bool read_tree_accept_suffix_(const void *arg, const char *path, const char *fname)
 {
@@ -47,6 +85,61 @@ bool read_tree_accept_all_(const void *arg, const char *path, const char *name)
         return true;
 }
 
+// State shared by every step of a single read_tree().
+typedef struct {
+        const ReadTreeConf *conf;
+        unsigned root_len; // precomputed strlen(conf->root_path)
+        struct ChunkPool *pool; // NULL unless conf->chunk_size is set.
+        ReadTreeStats *stats;   // NULL unless the caller wants them.
+        unsigned max_depth;     // directories this deep are not expanded
+        Error **errorv;         // errors tolerated in conf->keep_going mode
+        unsigned nerror;
+        struct InoSet *visited; // nodes read, by (dev, ino), if sharing them
+        const FileNode *top;    // the node read_tree_() started at
+        dev_t dev;              // of top, with conf->one_file_system
+        bool dropped;           // from_stub_() left its node out of the tree
+        size_t resident;        // content kept with conf->content_budget
+} Reader_;
+
+// -- Statistics -------------------------------------------------------
+//
+// STAT_START() / STAT_STOP() bracket an operation to count it and time it
+// into the ReadTreeStats fields NAME_count and NAME_ns.  With READTREE_STATS
+// set to 0 they (and the other STAT_ macros) compile to nothing.
+
+#ifndef READTREE_STATS
+#define READTREE_STATS 1
+#endif
+
+#if READTREE_STATS
+static unsigned long long stat_clock_ns_(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#define STAT_START(RD) ((RD)->stats ? stat_clock_ns_() : 0)
+#define STAT_STOP(RD, NAME, T0) do { \
+        if((RD)->stats) { \
+                (RD)->stats->NAME##_count++; \
+                (RD)->stats->NAME##_ns += stat_clock_ns_() - (T0); \
+        }} while(0)
+#define STAT_ADD(RD, FIELD, N) do { \
+        if((RD)->stats) \
+                (RD)->stats->FIELD += (N); \
+        } while(0)
+#define STAT_MAX(RD, FIELD, V) do { \
+        if((RD)->stats && (RD)->stats->FIELD < (V)) \
+                (RD)->stats->FIELD = (V); \
+        } while(0)
+#else
+#define STAT_START(RD) 0
+#define STAT_STOP(RD, NAME, T0) ((void)(T0))
+#define STAT_ADD(RD, FIELD, N) ((void)0)
+#define STAT_MAX(RD, FIELD, V) ((void)0)
+#endif
+
 // Internal representation of a directory entry which have not read yet.
 typedef struct
 {
@@ -55,37 +148,78 @@ typedef struct
         // The final component of `path`
         const char *name;
         // The file-type as in a struct dirent (see readdir(1) or <dirent.h>),
-        // except that it never contains DT_UNKNOWN or DT_LINK.  If the real
-        // dirent contained one of those values, we will have used stat() to
-        // find out the truth.
+        // except that it never contains DT_UNKNOWN.  If the real dirent
+        // contained that or DT_LNK, we will have used stat() to find out the
+        // truth.  It is DT_LNK only for a symlink the conf says not to follow.
         int de_type;
 } Stub_;
 
+// In conf->keep_going mode, adds `err` to the list of errors and returns true.
+// Otherwise returns false, and the caller should fail with `err`.
+static bool tolerate_(Reader_ *rd, Error *err)
+{
+        assert(err);
+        if(!rd->conf->keep_going)
+                return false;
+        LOG_DBG("Tolerating error number %u", rd->nerror);
+        // Grow the list whenever its size reaches a power of 2.
+        if(!(rd->nerror & (rd->nerror - 1))) {
+                size_t n = rd->nerror ? 2 * rd->nerror : 1;
+                rd->errorv = realloc(rd->errorv, n * sizeof rd->errorv[0]);
+                if(!rd->errorv)
+                        PANIC_NOMEM();
+        }
+        rd->errorv[rd->nerror++] = err;
+        return true;
+}
+
+// Fires the `error` probe for a new IO_ERROR() about `path`, then returns it.
+static Error *probe_error_(Error *err, const char *path)
+{
+        PROBE2(error, path, sys_error(err, NULL, NULL));
+        return err;
+}
+#define IO_ERROR_PROBED(F, N, ...) \
+        probe_error_(IO_ERROR(F, N, __VA_ARGS__), (F))
+
 // Use stat() to get the Stub_.de_type corresponding to a deirent.
 //
-// This function always calls stat() but returns a value as if it was a dirent
-// d_type (which is also Stub_.de_type).  We only need to call this if our
-// dirent doesn't give us the info we need.
-static int de_type_from_stat_(const char *full_path)
+// This function always calls stat() (or lstat() unless `follow`) but returns a
+// value as if it was a dirent d_type (which is also Stub_.de_type).  We only
+// need to call this if our dirent doesn't give us the info we need.
+static int de_type_from_stat_(Reader_ *rd, const char *full_path, bool follow)
 {
         struct stat st;
-        if(0 >  stat(full_path, &st))
+        unsigned long long t0 = STAT_START(rd);
+        int ret = follow ? stat(full_path, &st) : lstat(full_path, &st);
+        STAT_STOP(rd, stat, t0);
+        if(0 > ret)
                 return -errno;
         LOG_DBG("stat(%s) returns mode %0x", full_path, S_IFBLK);
         switch(st.st_mode  & S_IFMT) {
         case S_IFDIR: return DT_DIR;
         case S_IFREG: return DT_REG;
         case S_IFLNK:
+                if(!follow)
+                        return DT_LNK;
                 PANIC("stat of %s returned S_IFLINK!", full_path);
         default:
-                LOG_ERR("Unknown filetype %x from stat() of %s!",
-                        (unsigned)(st.st_mode  & S_IFMT), full_path);
+                // The caller gets the error; only log it here if it isn't
+                // just tolerated.
+                if(rd->conf->keep_going) {
+                        LOG_DBG("Unknown filetype %x from stat() of %s",
+                                (unsigned)(st.st_mode  & S_IFMT), full_path);
+                } else {
+                        LOG_ERR("Unknown filetype %x from stat() of %s!",
+                                (unsigned)(st.st_mode  & S_IFMT), full_path);
+                }
                 return -EINVAL;
         }
 }
 
 // Convert a directory + dirent into a Stub_
 static Error *stub_from_de_(
+        Reader_ *rd,
         const char *full_dir_path,
         const struct dirent *de,
         Stub_ *pret)
@@ -104,11 +238,20 @@ static Error *stub_from_de_(
         memcpy(name, de_fname, nf + 1);
 
         int de_type = de->d_type;
-        if(de_type != DT_REG && de_type != DT_DIR) {
-                de_type = de_type_from_stat_(full_path);
+        ReadTreeSymlinks links = rd->conf->symlinks;
+        if(de_type == DT_UNKNOWN && links != READ_TREE_SYMLINKS_FOLLOW)
+                de_type = de_type_from_stat_(rd, full_path, false);
+        if(de_type == DT_LNK && links == READ_TREE_SYMLINKS_SKIP) {
+                // Leave it for next_stub_() to drop.
+        } else if(de_type != DT_REG && de_type != DT_DIR && de_type >= 0) {
+                bool is_link = de_type == DT_LNK;
+                de_type = de_type_from_stat_(rd, full_path, true);
+                if(is_link && de_type == DT_DIR &&
+                   links == READ_TREE_SYMLINKS_FILES)
+                        de_type = DT_LNK;
         }
         if(de_type < 0) {
-                Error *err = IO_ERROR(full_path, -de_type,
+                Error *err = IO_ERROR_PROBED(full_path, -de_type,
                         "While getting file-type of directory entry");
                 free(full_path);
                 return err;
@@ -123,11 +266,11 @@ static Error *stub_from_de_(
         return NULL;
 }
 
-static Error *stub_from_path_(const char *full_path, Stub_ *pret)
+static Error *stub_from_path_(Reader_ *rd, const char *full_path, Stub_ *pret)
 {
-        int de_type = de_type_from_stat_(full_path);
+        int de_type = de_type_from_stat_(rd, full_path, true);
         if(de_type < 0) {
-                return IO_ERROR(full_path, -de_type,
+                return IO_ERROR_PROBED(full_path, -de_type,
                         "While getting file-type of '%s'", full_path);
         }
 
@@ -143,32 +286,373 @@ static Error *stub_from_path_(const char *full_path, Stub_ *pret)
         return NULL;
 }
 
-static FileNode *read_tree_(const ReadTreeConf*, const char*, unsigned*, Error**);
+// A pool of FileChunks, carved out of big slabs and recycled via a free-list.
+typedef struct ChunkPool {
+        size_t chunk_size;  // bytes of content per chunk
+        size_t stride;      // bytes of memory per chunk, including header
+        unsigned per_slab;  // chunks per slab
+        unsigned slab_used; // chunks handed out from the newest slab
+        struct ChunkSlab_ *slabs;
+        FileChunk *free;
+} ChunkPool;
+
+typedef struct ChunkSlab_ {
+        struct ChunkSlab_ *next;
+        char *mem;
+} ChunkSlab_;
+
+static ChunkPool *new_chunk_pool_(unsigned chunk_size)
+{
+        assert(chunk_size);
+        ChunkPool *pool = MALLOC(sizeof *pool);
+        size_t align = sizeof(void*);
+        size_t stride = sizeof(FileChunk) + chunk_size + 1;
+        stride = (stride + align - 1) / align * align;
+        size_t per_slab = CHUNK_SLAB_BYTES / stride;
+        *pool = (ChunkPool) {
+                .chunk_size = chunk_size,
+                .stride = stride,
+                .per_slab = per_slab ? per_slab : 1,
+        };
+        pool->slab_used = pool->per_slab;
+        return pool;
+}
 
-// Reads the content of a file into a buffer you can free().
-static char *read_file_(const char *full_path, unsigned *psize, Error **perr)
+static void destroy_chunk_pool_(ChunkPool *pool)
+{
+        if(!pool)
+                return;
+        ChunkSlab_ *slab = pool->slabs;
+        while(slab) {
+                ChunkSlab_ *next = slab->next;
+                free(slab->mem);
+                free(slab);
+                slab = next;
+        }
+        free(pool);
+}
+
+// Take an empty chunk from `pool`, re-using a freed one if there is any.
+static FileChunk *get_chunk_(ChunkPool *pool)
+{
+        FileChunk *c = pool->free;
+        if(c) {
+                pool->free = c->next;
+        } else {
+                if(pool->slab_used == pool->per_slab) {
+                        ChunkSlab_ *slab = MALLOC(sizeof *slab);
+                        slab->mem = MALLOC(pool->stride * pool->per_slab);
+                        slab->next = pool->slabs;
+                        pool->slabs = slab;
+                        pool->slab_used = 0;
+                }
+                c = (FileChunk*)(pool->slabs->mem +
+                        pool->stride * pool->slab_used++);
+        }
+        c->next = NULL;
+        c->size = 0;
+        return c;
+}
+
+// Give a list of chunks back to `pool` for re-use.
+static void put_chunks_(ChunkPool *pool, FileChunk *c)
+{
+        while(c) {
+                FileChunk *next = c->next;
+                c->next = pool->free;
+                pool->free = c;
+                c = next;
+        }
+}
+
+// A set of FileNodes keyed by the (st_dev, st_ino) of what they were read from.
+//
+// Entries are kept in the order they were added, in `v`, and found through an
+// open-addressed hash table of indices into `v`.
+typedef struct {
+        dev_t dev;
+        ino_t ino;
+        FileNode *node;
+} InoEntry_;
+
+typedef struct InoSet {
+        InoEntry_ *v;
+        unsigned n, alloc;
+        unsigned *slots; // 1 + an index into v, or 0 if empty
+        unsigned nslot;  // a power of 2, at least twice `n`
+} InoSet;
+
+static unsigned ino_hash_(dev_t dev, ino_t ino)
+{
+        unsigned long long h = (ino ^ (unsigned long long)dev << 40);
+        h *= 0x9E3779B97F4A7C15ull;
+        return h >> 32;
+}
+
+// The slot in which (dev, ino) is, or should go.
+static unsigned *ino_slot_(InoSet *set, dev_t dev, ino_t ino)
+{
+        unsigned mask = set->nslot - 1;
+        for(unsigned k = ino_hash_(dev, ino); ; k++) {
+                unsigned *slot = set->slots + (k & mask);
+                if(!*slot)
+                        return slot;
+                InoEntry_ *e = set->v + *slot - 1;
+                if(e->dev == dev && e->ino == ino)
+                        return slot;
+        }
+}
+
+// Re-builds the hash table for the first `n` entries, forgetting the rest.
+static void ino_rehash_(InoSet *set, unsigned n, unsigned nslot)
+{
+        free(set->slots);
+        set->slots = calloc(nslot, sizeof *set->slots);
+        if(!set->slots)
+                PANIC_NOMEM();
+        set->nslot = nslot;
+        set->n = n;
+        for(unsigned k = 0; k < n; k++)
+                *ino_slot_(set, set->v[k].dev, set->v[k].ino) = k + 1;
+}
+
+static InoSet *new_ino_set_(void)
+{
+        InoSet *set = MALLOC(sizeof *set);
+        *set = (InoSet){0};
+        ino_rehash_(set, 0, 64);
+        return set;
+}
+
+static void destroy_ino_set_(InoSet *set)
+{
+        if(!set)
+                return;
+        free(set->v);
+        free(set->slots);
+        free(set);
+}
+
+// The node read from (dev, ino), or NULL.
+static FileNode *ino_find_(InoSet *set, dev_t dev, ino_t ino)
+{
+        unsigned *slot = ino_slot_(set, dev, ino);
+        return *slot ? set->v[*slot - 1].node : NULL;
+}
+
+// Records that `node` was read from (dev, ino), which must not be in the set.
+static void ino_add_(InoSet *set, dev_t dev, ino_t ino, FileNode *node)
+{
+        unsigned *slot = ino_slot_(set, dev, ino);
+        assert(!*slot);
+        if(set->n == set->alloc) {
+                set->alloc = set->alloc ? 2 * set->alloc : 64;
+                set->v = realloc(set->v, set->alloc * sizeof *set->v);
+                if(!set->v)
+                        PANIC_NOMEM();
+        }
+        set->v[set->n] = (InoEntry_){ .dev = dev, .ino = ino, .node = node };
+        *slot = ++set->n;
+        if(2 * set->n > set->nslot)
+                ino_rehash_(set, set->n, 2 * set->nslot);
+}
+
+// Opens a file for reading, counting it in the stats.
+static int open_file_(Reader_ *rd, const char *full_path)
 {
-        errno = 0;
-        size_t used = 0, block_size = MIN_READ + 1;
-        char *block = NULL;
         assert(full_path);
+        PROBE1(file_open, full_path);
+        unsigned long long t0 = STAT_START(rd);
         int fd = open(full_path, O_RDONLY);
-        if(fd < 0) {
-                *perr = IO_ERROR(full_path, errno, "Opening file");
-                return NULL;
+        STAT_STOP(rd, open, t0);
+        return fd;
+}
+
+// Reads from a file, counting it in the stats.
+static ssize_t read_some_(Reader_ *rd, int fd, char *buf, size_t n)
+{
+        unsigned long long t0 = STAT_START(rd);
+        ssize_t ret = read(fd, buf, n);
+        STAT_STOP(rd, read, t0);
+        if(ret > 0)
+                STAT_ADD(rd, bytes_read, ret);
+        return ret;
+}
+
+// -- Sources of content -----------------------------------------------
+//
+// read_file_() and read_file_chunked_() get the content of a file from a
+// Source_, which either reads it as it is, or with conf->decompress, inflates
+// it if its first bytes say it is gzipped.  Only INFLATE_READ compressed bytes
+// are held at a time.
+
+typedef struct {
+        Reader_ *rd;
+        int fd;
+        bool sniffed;   // the first bytes have been checked for compression
+        bool compressed;
+        unsigned long long disk_size; // bytes read from fd
+#if READTREE_ZLIB
+        z_stream *z;
+        unsigned char *in; // compressed bytes not yet inflated
+        size_t in_alloc;
+        bool in_eof;       // all of the file is in `in` or inflated
+        bool at_end;       // the last byte in was the end of a gzip member
+#endif
+} Source_;
+
+#if READTREE_ZLIB
+// If the `n` bytes just read into `buf` start a gzip stream, switch `src` to
+// inflating them.
+static void sniff_(Source_ *src, const char *buf, size_t n)
+{
+        const unsigned char *u = (const unsigned char*)buf;
+        if(n < 2 || u[0] != 0x1f || u[1] != 0x8b)
+                return;
+
+        src->compressed = true;
+        src->z = MALLOC(sizeof *src->z);
+        *src->z = (z_stream){0};
+        // 32 lets zlib take the gzip header.
+        if(Z_OK != inflateInit2(src->z, 15 + 32))
+                PANIC_NOMEM();
+        src->in_alloc = n > INFLATE_READ ? n : INFLATE_READ;
+        src->in = MALLOC(src->in_alloc);
+        memcpy(src->in, buf, n);
+        src->z->next_in = src->in;
+        src->z->avail_in = n;
+}
+
+// Inflates up to `n` bytes into `buf`, reading more of the file as needed.
+// Returns 0 at the end, or -1 with errno set.
+static ssize_t inflate_some_(Source_ *src, char *buf, size_t n)
+{
+        z_stream *z = src->z;
+        z->next_out = (unsigned char*)buf;
+        z->avail_out = n;
+        while(z->avail_out) {
+                if(!z->avail_in && !src->in_eof) {
+                        ssize_t got = read_some_(src->rd, src->fd,
+                                (char*)src->in, src->in_alloc);
+                        if(got < 0)
+                                return -1;
+                        src->disk_size += got;
+                        src->in_eof = !got;
+                        z->next_in = src->in;
+                        z->avail_in = got;
+                }
+                if(!z->avail_in) {
+                        if(src->at_end)
+                                break;
+                        errno = EBADMSG; // truncated
+                        return -1;
+                }
+                int ret = inflate(z, Z_NO_FLUSH);
+                if(ret == Z_STREAM_END) {
+                        // A gzip file can have several members back to back.
+                        inflateReset(z);
+                        src->at_end = true;
+                } else if(ret == Z_OK) {
+                        src->at_end = false;
+                } else if(ret == Z_MEM_ERROR) {
+                        PANIC_NOMEM();
+                } else {
+                        errno = EBADMSG;
+                        return -1;
+                }
         }
+        return n - z->avail_out;
+}
+#endif
+
+// Like read_some_(), but from `src`.
+static ssize_t read_content_(Source_ *src, char *buf, size_t n)
+{
+#if READTREE_ZLIB
+        if(src->z)
+                return inflate_some_(src, buf, n);
+#endif
+        ssize_t got = read_some_(src->rd, src->fd, buf, n);
+        if(got > 0)
+                src->disk_size += got;
+        if(got <= 0 || src->sniffed)
+                return got;
+        src->sniffed = true;
+#if READTREE_ZLIB
+        sniff_(src, buf, got);
+        if(src->z)
+                return inflate_some_(src, buf, n);
+#endif
+        return got;
+}
 
-        block = malloc(block_size);
+// Closes the file of `src`, leaving errno as close() does.
+static void close_source_(Source_ *src)
+{
+#if READTREE_ZLIB
+        if(src->z) {
+                inflateEnd(src->z);
+                free(src->z);
+                free(src->in);
+                src->z = NULL;
+        }
+#endif
+        do close(src->fd); while(errno == EINTR);
+}
+
+// True if the classifier `c` has found a binary file that the policy says to
+// stop reading.
+static bool stop_binary_(Reader_ *rd, const ReadTreeClassifier_ *c)
+{
+        return c->kind == FILE_KIND_BINARY &&
+                rd->conf->binary != READ_TREE_BINARY_KEEP;
+}
+
+// Closes `src`, a binary file which is not to be read after the first `used`
+// bytes, and sets *psize to its full size (or `used`, if compressed).
+static void close_binary_(Source_ *src, size_t used, unsigned *psize)
+{
+        struct stat st;
+        int ret = -1;
+        if(!src->compressed) {
+                unsigned long long t0 = STAT_START(src->rd);
+                ret = fstat(src->fd, &st);
+                STAT_STOP(src->rd, stat, t0);
+        }
+        *psize = ret || st.st_size > UINT_MAX ? used : st.st_size;
+        close_source_(src);
+        errno = 0;
+}
+
+// Reads the content of `src` into a buffer you can free(), and closes it.
+//
+// If `pkind` is set, it classifies the content as it goes into *pkind.  If the
+// file is binary and conf->binary says not to read it, it stops after the
+// first block and returns NULL with *perr unset.
+static char *read_file_(
+        Reader_ *rd,
+        const char *full_path,
+        Source_ *src,
+        unsigned *psize,
+        FileKind *pkind,
+        Error **perr)
+{
+        ReadTreeClassifier_ cl = {0};
+        errno = 0;
+        size_t used = 0, block_size = MIN_READ + 1;
+        char *block = malloc(block_size);
         for(;;) {
                 if(!block) {
-                        close(fd);
+                        close_source_(src);
                         PANIC_NOMEM();
                 }
 
                 assert(block_size - used > 1);
-                ssize_t n = read(fd, block + used, block_size - used - 1);
+                ssize_t n = read_content_(src, block + used,
+                        block_size - used - 1);
                 if(n < 0) {
-                        *perr = IO_ERROR(full_path, errno, "Reading file");
+                        *perr = IO_ERROR_PROBED(full_path, errno,
+                                "Reading file");
                         goto error;
                 }
                 LOG_DBG("Read %ld bytes from %s", n, full_path);
@@ -177,133 +661,211 @@ static char *read_file_(const char *full_path, unsigned *psize, Error **perr)
                 }
 
                 used += n;
+                if(pkind) {
+                        read_tree_classify_(&cl, block + used - n, n);
+                        if(stop_binary_(rd, &cl)) {
+                                *pkind = cl.kind;
+                                close_binary_(src, used, psize);
+                                free(block);
+                                return NULL;
+                        }
+                }
                 if(block_size - used >= (1 + MIN_READ)) {
                         continue;
                 }
 
                 if((block_size *= 2) > UINT_MAX) {
-                        *perr = IO_ERROR(full_path, EINVAL,
+                        *perr = IO_ERROR_PROBED(full_path, EINVAL,
                                 "Reading too big a file");
                         goto error;
                 }
 
                 block = realloc(block, block_size *= 2);
+                STAT_ADD(rd, realloc_count, 1);
         };
 
 eof:
+        if(pkind)
+                *pkind = read_tree_classify_end_(&cl);
         block = realloc(block, used + 1);
         block[used] = 0;
-        do close(fd); while(errno == EINTR);
+        close_source_(src);
         if(errno) {
-                *perr = IO_ERROR(full_path, errno, "Closing file");
+                *perr = IO_ERROR_PROBED(full_path, errno, "Closing file");
                 free(block);
                 return NULL;
         }
         *psize = used;
         LOG_DBG("Successfully read file %s (%u bytes).", full_path, *psize);
+        PROBE2(file_done, full_path, *psize);
         return block;
 
 error:
-        assert(fd >= 0);
-        do close(fd); while(errno == EINTR);
+        close_source_(src);
         free(block);
         return NULL;
 }
 
-// Read the content of a Stub_
+// Reads the content of `src` into chunks from `pool`, and closes it.
 //
-// * For a file, this means read the bytes into pret->content.
-// * For a directory, this means recursively read it into pr->sub.
-// * Any other kind of file-system node results in an error.
-static Error *from_stub_(
-        const ReadTreeConf *conf,
-        unsigned root_len, // precomputed strlen(conf->root)
-        FileNode *pr,
-        const Stub_ stub)
+// If the whole file fits in one chunk it is copied into a buffer you can
+// free(), the chunk goes back to the pool and *pchunks is set to NULL.
+// Otherwise this returns NULL and the content is left in *pchunks.  `pkind` is
+// as for read_file_(); a binary file that is not read leaves *pchunks alone.
+static char *read_file_chunked_(
+        Reader_ *rd,
+        const char *full_path,
+        Source_ *src,
+        unsigned *psize,
+        FileChunk **pchunks,
+        FileKind *pkind,
+        Error **perr)
 {
-        assert(pr);
-        const char *name = stub.name;
-        if(!name)
-                PANIC("NULL name from scandir of %s!", stub.full_path);
+        ChunkPool *pool = rd->pool;
+        ReadTreeClassifier_ cl = {0};
+        errno = 0;
 
-        assert(stub.full_path[root_len] == '/' || !stub.full_path[root_len]);
-        FileNode r = {
-                .full_path = stub.full_path,
-                .path = stub.full_path + root_len,
-        };
-        while(*r.path == '/') {
-                r.path++;
+        size_t used = 0;
+        FileChunk *head = get_chunk_(pool), *c = head;
+        for(;;) {
+                if(c->size == pool->chunk_size) {
+                        c->data[c->size] = 0;
+                        c = c->next = get_chunk_(pool);
+                }
+
+                ssize_t n = read_content_(src, c->data + c->size,
+                        pool->chunk_size - c->size);
+                if(n < 0) {
+                        *perr = IO_ERROR_PROBED(full_path, errno,
+                                "Reading file");
+                        goto error;
+                }
+                LOG_DBG("Read %ld bytes from %s", n, full_path);
+                if(n == 0) {
+                        break;
+                }
+
+                c->size += n;
+                if(pkind) {
+                        read_tree_classify_(&cl, c->data + c->size - n, n);
+                        if(stop_binary_(rd, &cl)) {
+                                *pkind = cl.kind;
+                                close_binary_(src, used + n, psize);
+                                put_chunks_(pool, head);
+                                return NULL;
+                        }
+                }
+                if((used += n) > UINT_MAX) {
+                        *perr = IO_ERROR_PROBED(full_path, EINVAL,
+                                "Reading too big a file");
+                        goto error;
+                }
         }
-        Error *err = NULL;
+        c->data[c->size] = 0;
+        if(pkind)
+                *pkind = read_tree_classify_end_(&cl);
 
-        switch(stub.de_type) {
-        case DT_DIR:
-                r.subv = read_tree_(conf, r.full_path, &r.nsub, &err);
-                assert(err || r.subv);
-                break;
-        case DT_REG:
-                r.content = read_file_(r.full_path, &r.size, &err);
-                break;
-        default:
-                return IO_ERROR(r.full_path, EINVAL,
-                "Reading something that is neither a file nor directory.");
+        close_source_(src);
+        if(errno) {
+                *perr = IO_ERROR_PROBED(full_path, errno, "Closing file");
+                put_chunks_(pool, head);
+                return NULL;
+        }
+        *psize = used;
+        LOG_DBG("Successfully read file %s (%u bytes).", full_path, *psize);
+        PROBE2(file_done, full_path, *psize);
+
+        if(head->next && !c->size) {
+                // The file was an exact number of chunks; drop the empty one.
+                FileChunk *last = head;
+                while(last->next != c)
+                        last = last->next;
+                last->next = NULL;
+                put_chunks_(pool, c);
+        }
+        if(head->next) {
+                *pchunks = head;
+                return NULL;
         }
 
-        if(err)
-                return err;
-        *pr = r;
+        char *content = MALLOC(used + 1);
+        memcpy(content, head->data, used + 1);
+        put_chunks_(pool, head);
+        *pchunks = NULL;
+        return content;
+
+error:
+        close_source_(src);
+        put_chunks_(pool, head);
         return NULL;
 }
 
 // Filter stubs, use hard-coded dot-file exclusion and the configured acceptor.
-static bool accept_stub_(const ReadTreeConf *conf, Stub_ stub)
+static bool accept_stub_(Reader_ *rd, Stub_ stub)
 {
         assert(stub.name && stub.full_path);
         // We must exclude at least '.' and '..'; here we exclude all dotfiles.
-        if(stub.name[0] == '.')
+        if(stub.name[0] == '.') {
+                STAT_ADD(rd, rejected, 1);
                 return false;
+        }
 
         AcceptClosure closure;
         switch(stub.de_type) {
-        case DT_DIR: closure = conf->accept_dir; break;
-        case DT_REG: closure = conf->accept_file; break;
+        case DT_DIR: closure = rd->conf->accept_dir; break;
+        case DT_REG: closure = rd->conf->accept_file; break;
         default:
                 PANIC("accept_stub() called with bad filetype %d", stub.de_type);
         }
-        return closure.fun(closure.arg, stub.full_path, stub.name);
+
+        unsigned long long t0 = STAT_START(rd);
+        bool accepted = closure.fun(closure.arg, stub.full_path, stub.name);
+        STAT_STOP(rd, accept, t0);
+        if(accepted) {
+                STAT_ADD(rd, accepted, 1);
+        } else {
+                STAT_ADD(rd, rejected, 1);
+        }
+        return accepted;
 }
 
 // Iterate the dirstream `dir` to the next non-ignored object (Stub_).
 static Error *next_stub_(
-        const ReadTreeConf *conf,
+        Reader_ *rd,
         Stub_ *pstub,
         const char *full_dir_path,
         DIR *dir)
 {
-        struct dirent *de;
-        if(!(de = readdir(dir))) {
-                if(!errno) {
-                        *pstub = (Stub_){0};
-                        return NULL;
+        for(;;) {
+                struct dirent *de;
+                unsigned long long t0 = STAT_START(rd);
+                de = readdir(dir);
+                STAT_STOP(rd, readdir, t0);
+                if(!de) {
+                        if(!errno) {
+                                *pstub = (Stub_){0};
+                                return NULL;
+                        }
+                        IO_PANIC(full_dir_path, errno,
+                                "readdir() failed after opendir()");
                 }
-                IO_PANIC(full_dir_path, errno,
-                        "readdir() failed after opendir()");
-        }
 
-        Stub_ tde;
-        Error *err = stub_from_de_(full_dir_path, de, &tde);
-        if(err) {
-                *pstub = (Stub_){0};
-                return err;
-        }
+                Stub_ tde;
+                Error *err = stub_from_de_(rd, full_dir_path, de, &tde);
+                if(err) {
+                        *pstub = (Stub_){0};
+                        return err;
+                }
 
-        if(accept_stub_(conf, tde)) {
-                *pstub = tde;
-                return NULL;
+                if(tde.de_type == DT_LNK) {
+                        // A symlink we are not following.
+                        STAT_ADD(rd, rejected, 1);
+                } else if(accept_stub_(rd, tde)) {
+                        *pstub = tde;
+                        return NULL;
+                }
+                free(tde.full_path);
         }
-
-        free(tde.full_path);
-        return next_stub_(conf, pstub, full_dir_path, dir);
 }
 
 static int qsort_stub_cmp_(const void *va, const void *vb, void *arg)
@@ -316,16 +878,20 @@ static int qsort_stub_cmp_(const void *va, const void *vb, void *arg)
 
 // Non-recursively a read directory into a sorted array of Stub_s.
 static Error *load_stubv_(
-        const ReadTreeConf *conf,
+        Reader_ *rd,
         const char *full_dir_path,
         unsigned *pnstub,
         Stub_ **pstubv)
 {
         assert(full_dir_path);
         errno = 0;
+        PROBE1(dir_open, full_dir_path);
+        unsigned long long t0 = STAT_START(rd);
         DIR *dir = opendir(full_dir_path);
+        STAT_STOP(rd, opendir, t0);
         if(!dir) {
-                return IO_ERROR(full_dir_path, errno, "read_tree opening dir");
+                return IO_ERROR_PROBED(full_dir_path, errno,
+                        "read_tree opening dir");
         }
 
         Stub_ *stubv = NULL;
@@ -340,10 +906,16 @@ static Error *load_stubv_(
                         if(!stubv) {
                                 PANIC_NOMEM();
                         }
+                        STAT_ADD(rd, realloc_count, 1);
                 }
 
                 Stub_ stub;
-                err = next_stub_(conf, &stub, full_dir_path, dir);
+                err = next_stub_(rd, &stub, full_dir_path, dir);
+                if(err && tolerate_(rd, err)) {
+                        // Skip the bad entry, but carry on with the rest.
+                        err = NULL;
+                        continue;
+                }
                 if(!stub.full_path)
                         break;
 
@@ -368,79 +940,377 @@ static Error *load_stubv_(
                 LOG_DBG("nothing found in drectory, return NULL");
         }
 
+        t0 = STAT_START(rd);
         qsort_r(stubv, used, sizeof stubv[0], qsort_stub_cmp_, NULL);
+        STAT_STOP(rd, sort, t0);
         *pstubv = stubv;
         *pnstub = used;
         closedir(dir);
+        PROBE2(dir_close, full_dir_path, used);
         return err;
 }
 
-// Destroy the *content* of `t`.  Recurses over all sub-nodes.
+// A directory whose sub-nodes are being read or destroyed, as a frame of an
+// explicit stack.  These are kept small: 32 bytes on LP64, so that two fit in
+// a cache line.
+typedef struct {
+        FileNode *node;  // The directory.  Its .nsub counts the sub-nodes done.
+        Stub_ *stubv;    // Sorted entries of the directory; NULL in destroy.
+        unsigned nstub;  // The number of entries.
+        unsigned next;   // Index of the next entry to read.
+        unsigned depth;  // Of the entries; the children of the root are at 1.
+} Frame_;
+#ifdef __LP64__
+typedef char frame_size_[sizeof(Frame_) == 32 ? 1 : -1];
+#endif
+
+// The Frame_s still to be done, as a stack (for depth-first) or as a queue
+// (for breadth-first).  Either way new frames are pushed onto the end.
+typedef struct {
+        Frame_ *v;
+        unsigned first;  // Index of the oldest frame in use.
+        unsigned n;      // Index after the newest frame in use.
+        unsigned alloc;
+} Frames_;
+
+static void push_frame_(Frames_ *fs, Frame_ f)
+{
+        if(fs->n == fs->alloc && fs->first) {
+                // Reclaim the space left at the start by a queue.
+                fs->n -= fs->first;
+                memmove(fs->v, fs->v + fs->first, fs->n * sizeof f);
+                fs->first = 0;
+        }
+        if(fs->n == fs->alloc) {
+                fs->alloc = fs->alloc ? 2 * fs->alloc : 16;
+                fs->v = realloc(fs->v, fs->alloc * sizeof f);
+                if(!fs->v)
+                        PANIC_NOMEM();
+        }
+        fs->v[fs->n++] = f;
+}
+
+// Destroy the *content* of `t`, including all sub-nodes.
 //
 // This is in internal helper, both used by the (root-only) public interface
-// destroy_tree() and to clean up after errors in read_tree_().
+// destroy_tree() and to clean up after errors in read_tree_().  It ignores
+// .chunks, which are freed along with the ChunkPool they came from.
 static void destroy_tree_(FileNode t)
 {
+        Frames_ fs = {0};
         free(t.full_path);
         free(t.content);
-        for(unsigned k = 0; k < t.nsub; k++) {
-                destroy_tree_(t.subv[k]);
+        free(t.lines);
+        free(t.packed);
+        if(t.subv)
+                push_frame_(&fs, (Frame_){ .node = &t });
+        while(fs.n) {
+                Frame_ *top = fs.v + fs.n - 1;
+                FileNode *dir = top->node;
+                if(top->next == dir->nsub) {
+                        free(dir->subv);
+                        fs.n--;
+                        continue;
+                }
+                FileNode *sub = dir->subv + top->next++;
+                free(sub->full_path);
+                free(sub->content);
+                free(sub->lines);
+                free(sub->packed);
+                if(sub->subv)
+                        push_frame_(&fs, (Frame_){ .node = sub });
         }
-        free(t.subv);
+        free(fs.v);
 }
 
-// Recursively read read a directory into a sorted array of FileNodes.
-static FileNode *read_tree_(
-        const ReadTreeConf *conf,
-        const char *full_dir_path,
-        unsigned *pnsub,
-        Error **perr)
+// Replaces the content of the file `r` with packed content, if that saves
+// enough memory.
+static void pack_(Reader_ *rd, FileNode *r)
 {
-        // Read it as stubs.
-        Stub_ *stub;
-        unsigned n;
-        Error * err = load_stubv_(conf, full_dir_path, &n, &stub);
-        if(err) {
-                *perr = err;
-                return NULL;
+        unsigned zsize;
+        unsigned long long t0 = STAT_START(rd);
+        r->packed = read_tree_pack_(r->content, r->size, &zsize);
+        STAT_STOP(rd, pack, t0);
+        if(!r->packed)
+                return;
+        STAT_ADD(rd, pack_in_bytes, r->size);
+        STAT_ADD(rd, pack_out_bytes, zsize);
+        free(r->content);
+        r->content = NULL;
+}
+
+// With .content_budget, marks the file `r` as cached, keeping the content
+// just read for the tree's cache only while it fits in the budget.
+static void budget_(Reader_ *rd, FileNode *r)
+{
+        r->cached = true;
+        if(rd->resident + r->size <= rd->conf->content_budget) {
+                rd->resident += r->size;
+                return;
         }
-        assert(stub || !n);
-
-        // Recursively expand each stub.
-        struct FileNode *subv = MALLOC(sizeof(FileNode)*(n+1));
-        subv[n] = (FileNode){0};
-        int nconverted;
-        unsigned root_len = strlen(conf->root_path);
-        for(nconverted = 0; nconverted < n; nconverted++) {
-                err = from_stub_(
-                        conf,
-                        root_len,
-                        subv + nconverted,
-                        stub[nconverted]);
+        free(r->content);
+        r->content = NULL;
+}
+
+// Hands the content read for the cached files under `node` to `cache`.
+static void adopt_(struct ContentCache *cache, FileNode *node)
+{
+        if(node->cached && node->content) {
+                read_tree_cache_put_(cache, node, node->content);
+                node->content = NULL;
+        }
+        for(unsigned k = 0; k < node->nsub; k++)
+                adopt_(cache, node->subv + k);
+}
+
+// Read the content of a Stub_ at `depth` into *pr.
+//
+// * For a file, this means read the bytes into pr->content.  A binary file
+//   may be dropped instead (see ReadTreeBinary), which sets rd->dropped and
+//   leaves *pr and stub.full_path as on failure.
+// * For a directory, this means list it into *pframe (a frame for pr, ready
+//   for read_tree_() to read the sub-nodes into pr->subv).  But if it is as
+//   deep as rd->max_depth, it is only marked as unexpanded.
+// * Any other kind of file-system node results in an error.
+//
+// On success, *pframe.node is NULL unless there are sub-nodes to read.  On
+// failure *pr is untouched, and stub.full_path is not freed.
+static Error *from_stub_(
+        Reader_ *rd,
+        FileNode *pr,
+        const Stub_ stub,
+        unsigned depth,
+        Frame_ *pframe)
+{
+        unsigned root_len = rd->root_len;
+        assert(pr);
+        const char *name = stub.name;
+        if(!name)
+                PANIC("NULL name from scandir of %s!", stub.full_path);
+
+        assert(stub.full_path[root_len] == '/' || !stub.full_path[root_len]);
+        FileNode r = {
+                .full_path = stub.full_path,
+                .path = stub.full_path + root_len,
+        };
+        while(*r.path == '/') {
+                r.path++;
+        }
+        Error *err = NULL;
+        *pframe = (Frame_){0};
+        const ReadTreeConf *conf = rd->conf;
+        struct stat st;
+        bool visiting = false; // Add `pr` to rd->visited if all goes well?
+        int fd, ret;
+
+        switch(stub.de_type) {
+        case DT_DIR:
+                if(conf->symlinks == READ_TREE_SYMLINKS_SHARE ||
+                   conf->one_file_system) {
+                        unsigned long long t0 = STAT_START(rd);
+                        ret = stat(r.full_path, &st);
+                        STAT_STOP(rd, stat, t0);
+                        if(ret) {
+                                err = IO_ERROR_PROBED(r.full_path, errno,
+                                        "Identifying directory");
+                                break;
+                        }
+                }
+                // With a visited set, only the first node for a directory is
+                // read, the rest are aliases of it.  Since this comes before
+                // read_tree_() reads the sub-nodes, links to a directory
+                // above themselves are aliases too.
+                if(conf->symlinks == READ_TREE_SYMLINKS_SHARE) {
+                        r.alias = ino_find_(rd->visited, st.st_dev, st.st_ino);
+                        visiting = !r.alias;
+                        if(r.alias == pr) {
+                                // expand_node() is re-reading this node.
+                                r.alias = NULL;
+                                visiting = false;
+                        }
+                        if(r.alias)
+                                break;
+                }
+                if(conf->one_file_system) {
+                        if(pr == rd->top)
+                                rd->dev = st.st_dev;
+                        if(st.st_dev != rd->dev) {
+                                LOG_DBG("Not crossing into %s", r.full_path);
+                                r.unexpanded = true;
+                                break;
+                        }
+                }
+                if(rd->max_depth && depth >= rd->max_depth) {
+                        r.unexpanded = true;
+                        break;
+                }
+                err = load_stubv_(rd, r.full_path, &pframe->nstub,
+                        &pframe->stubv);
                 if(err)
                         break;
+                unsigned n = pframe->nstub, limit = rd->conf->depth_limit;
+                if(n && limit && depth >= limit) {
+                        for(unsigned k = 0; k < n; k++)
+                                free(pframe->stubv[k].full_path);
+                        free(pframe->stubv);
+                        *pframe = (Frame_){0};
+                        return ERROR("%s is nested deeper than the "
+                                "depth_limit of %u", r.full_path, limit);
+                }
+                if(n)
+                        STAT_MAX(rd, max_depth, depth + 1);
+                r.subv = MALLOC(sizeof(FileNode)*(n+1));
+                r.subv[0] = (FileNode){0};
+                pframe->node = pr;
+                pframe->depth = depth + 1;
+                break;
+        case DT_REG:
+                fd = open_file_(rd, r.full_path);
+                if(fd < 0) {
+                        err = IO_ERROR_PROBED(r.full_path, errno,
+                                "Opening file");
+                        break;
+                }
+                // A file with several hard links is only read for the first.
+                if(conf->share_hardlinks) {
+                        unsigned long long t0 = STAT_START(rd);
+                        ret = fstat(fd, &st);
+                        STAT_STOP(rd, stat, t0);
+                        if(!ret && st.st_nlink > 1) {
+                                r.alias = ino_find_(rd->visited, st.st_dev,
+                                        st.st_ino);
+                                visiting = !r.alias;
+                        }
+                        if(r.alias) {
+                                close(fd);
+                                r.size = r.alias->size;
+                                r.hash = r.alias->hash;
+                                break;
+                        }
+                }
+                FileKind *pkind = conf->classify || conf->binary ?
+                        &r.kind : NULL;
+                Source_ src = {
+                        .rd = rd,
+                        .fd = fd,
+                        .sniffed = !conf->decompress,
+                };
+                if(rd->pool) {
+                        r.content = read_file_chunked_(rd, r.full_path, &src,
+                                &r.size, &r.chunks, pkind, &err);
+                } else {
+                        r.content = read_file_(rd, r.full_path, &src, &r.size,
+                                pkind, &err);
+                }
+                if(src.compressed)
+                        r.disk_size = src.disk_size;
+                if(conf->hash_content && !err)
+                        r.hash = read_tree_hash_file_(&r);
+                if(r.content && conf->pack_content)
+                        pack_(rd, &r);
+                if(r.content && conf->content_budget)
+                        budget_(rd, &r);
+                if(r.content && !r.cached && conf->index_lines)
+                        r.lines = read_tree_index_lines_(r.content, r.size);
+                break;
+        default:
+                return IO_ERROR_PROBED(r.full_path, EINVAL,
+                "Reading something that is neither a file nor directory.");
         }
 
-        // Clean up.
-        assert(n >= 0);
-        if(!err) {
-                // Happy path: just return the subv.
-                *pnsub = (unsigned)n;
-        } else {
-                // Sad path: clean up stubs and already-converted trees.
-                for(int k = 0; k < n; k++) {
-                        free(stub[k].full_path);
+        if(err)
+                return err;
+        if(r.kind == FILE_KIND_BINARY &&
+           conf->binary == READ_TREE_BINARY_DROP && pr != rd->top) {
+                LOG_DBG("Dropping binary file %s", r.full_path);
+                rd->dropped = true;
+                return NULL;
+        }
+        if(visiting)
+                ino_add_(rd->visited, st.st_dev, st.st_ino, pr);
+        *pr = r;
+        return NULL;
+}
+
+// Read the tree under `stub`, which is at `depth`, into *pr.
+//
+// Rather than recursing, this keeps one Frame_ for each directory that has
+// been listed but whose entries are not all read.  Depth-first, these are the
+// directories between the root and the node being read and form a stack.
+// Breadth-first (conf->breadth_first), they are a queue and each directory is
+// finished before the next one starts.  Both ways give the same tree.
+static Error *read_tree_(
+        Reader_ *rd,
+        FileNode *pr,
+        const Stub_ stub,
+        unsigned depth)
+{
+        Frames_ fs = {0};
+        Frame_ f;
+        bool bfs = rd->conf->breadth_first;
+        rd->top = pr;
+        Error *err = from_stub_(rd, pr, stub, depth, &f);
+        if(err) {
+                free(stub.full_path);
+                return err;
+        }
+
+        for(;;) {
+                if(f.node)
+                        push_frame_(&fs, f);
+                if(fs.first == fs.n)
+                        break;
+
+                Frame_ *cur = fs.v + (bfs ? fs.first : fs.n - 1);
+                FileNode *dir = cur->node;
+                if(cur->next == cur->nstub) {
+                        // Done with this directory.
+                        dir->subv[dir->nsub] = (FileNode){0};
+                        free(cur->stubv);
+                        if(bfs)
+                                fs.first++;
+                        else
+                                fs.n--;
+                        f.node = NULL;
+                        continue;
                 }
-                for(int k = 0; k < nconverted; k++) {
-                        destroy_tree_(subv[k]);
+
+                Stub_ sub = cur->stubv[cur->next++];
+                err = from_stub_(rd, dir->subv + dir->nsub, sub, cur->depth,
+                        &f);
+                if(!err && rd->dropped) {
+                        rd->dropped = false;
+                        free(sub.full_path);
+                        STAT_ADD(rd, accepted, -1);
+                        STAT_ADD(rd, rejected, 1);
+                        continue;
+                }
+                if(!err) {
+                        dir->nsub++;
+                        continue;
                 }
-                free(subv);
-                subv = NULL;
+                free(sub.full_path);
+                f.node = NULL;
+                if(!tolerate_(rd, err))
+                        break;
+                err = NULL;
         }
 
-        free(stub);
-        *perr = err;
-        return subv;
+        if(err) {
+                // Sad path: clean up the remaining stubs, then everything
+                // converted so far.  Each .nsub counts only converted nodes.
+                // N.B. chunks held by the tree still belong to the pool.
+                for(unsigned k = fs.first; k < fs.n; k++) {
+                        Frame_ *fk = fs.v + k;
+                        for(unsigned j = fk->next; j < fk->nstub; j++)
+                                free(fk->stubv[j].full_path);
+                        free(fk->stubv);
+                }
+                destroy_tree_(*pr);
+                *pr = (FileNode){0};
+        }
+        free(fs.v);
+        return err;
 }
 
 // Modify a conf in-place to make it ready for use (expans out defaults etc).
@@ -474,6 +1344,34 @@ char *trimmed_path_copy(const char *path)
         return dest;
 }
 
+// See read_tree.h?read_tree_load_
+char *read_tree_load_(const FileTree *tree, const FileNode *node)
+{
+        assert(tree && node && node->cached);
+        Reader_ rd = { .conf = &tree->conf };
+        int fd = open_file_(&rd, node->full_path);
+        if(fd < 0)
+                return NULL;
+        Source_ src = {
+                .rd = &rd,
+                .fd = fd,
+                .sniffed = !tree->conf.decompress,
+        };
+        Error *err = NULL;
+        unsigned size;
+        char *content = read_file_(&rd, node->full_path, &src, &size, NULL,
+                &err);
+        if(err) {
+                destroy_error(err);
+                return NULL;
+        }
+        if(size != node->size) {
+                free(content);
+                return NULL;
+        }
+        return content;
+}
+
 // -- Public -----------------------------------------------------------
 
 // See read_tree.h?read_tree
@@ -487,6 +1385,7 @@ Error *read_tree(FileTree *ptree)
                 PANIC("Configured ReadTree 'root_path' is null");
 
         fill_out_config_(pconf);
+        PROBE1(tree_start, pconf->root_path);
         // Keep a private copy of the root, owned by to (root) FileNode object.
 
         // FIX: a file-as-root is allowed even if the incoming root-path ends in '/'.
@@ -494,30 +1393,111 @@ Error *read_tree(FileTree *ptree)
         LOG_DBG("timmed path trimmage = %s -> %s", pconf->root_path, root_path);
         pconf->root_path = root_path;
 
-        FileNode t = {
-                .full_path = root_path,
-                .path = root_path + strlen(root_path),
-        };
-        if(!t.full_path) {
-                PANIC_NOMEM();
-        }
+        // Read straight into ptree->root, since aliases may point at it.
+        ptree->root = (FileNode){0};
         Error *err = NULL;
+        Reader_ rd = {
+                .conf = pconf,
+                .root_len = strlen(root_path),
+                .pool = pconf->chunk_size && !pconf->content_budget ?
+                        new_chunk_pool_(pconf->chunk_size) : NULL,
+                .stats = READTREE_STATS ? ptree->stats : NULL,
+                .max_depth = pconf->max_depth,
+                .visited = pconf->symlinks == READ_TREE_SYMLINKS_SHARE ||
+                        pconf->share_hardlinks ? new_ino_set_() : NULL,
+        };
+        if(ptree->stats)
+                *ptree->stats = (ReadTreeStats){0};
 
         Stub_ root_stub;
-        err = stub_from_path_(root_path, &root_stub);
+        err = stub_from_path_(&rd, root_path, &root_stub);
         if(!err) {
-                err = from_stub_(pconf, strlen(root_path), &t, root_stub);
+                err = read_tree_(&rd, &ptree->root, root_stub, 0);
         }
-        if(!err && !accept_stub_(pconf, root_stub)) {
+        if(!err && !accept_stub_(&rd, root_stub)) {
                 err = ERROR("ReadTree root is dropped");
         }
+        PROBE2(tree_done, root_path, !err);
         if(err) {
                 free(root_path);
+                destroy_chunk_pool_(rd.pool);
+                for(unsigned k = 0; k < rd.nerror; k++)
+                        destroy_error(rd.errorv[k]);
+                free(rd.errorv);
+                destroy_ino_set_(rd.visited);
                 *ptree = (FileTree){0};
                 return err;
         }
 
-        ptree->root = t;
+        ptree->chunk_pool = rd.pool;
+        ptree->visited = rd.visited;
+        if(pconf->hash_content)
+                read_tree_hash_dirs_(&ptree->root);
+        ptree->cache = NULL;
+        if(pconf->pack_content || pconf->content_budget) {
+                ptree->cache = read_tree_new_cache_(pconf->unpacked_cache,
+                        pconf->content_budget);
+                adopt_(ptree->cache, &ptree->root);
+        }
+        ptree->errorv = rd.errorv;
+        ptree->nerror = rd.nerror;
+        return NULL;
+}
+
+// See read_tree.h?expand_node
+Error *expand_node(FileTree *tree, FileNode *node, unsigned levels)
+{
+        if(!tree || !node)
+                PANIC("'tree' or 'node' is null");
+        if(!node->unexpanded)
+                return NULL;
+
+        // Count the depth of `node` from its path.
+        unsigned depth = *node->path ? 1 : 0;
+        for(const char *c = node->path; *c; c++)
+                depth += *c == '/';
+
+        Reader_ rd = {
+                .conf = &tree->conf,
+                .root_len = strlen(tree->conf.root_path),
+                .pool = tree->chunk_pool,
+                .stats = READTREE_STATS ? tree->stats : NULL,
+                .max_depth = levels ? depth + levels : 0,
+                .errorv = tree->errorv,
+                .nerror = tree->nerror,
+                .visited = tree->visited,
+                .resident = content_cache_stats(tree).bytes,
+        };
+        unsigned nvisited = rd.visited ? rd.visited->n : 0;
+
+        // read_tree_() takes ownership of the stub's full_path; only give up
+        // the old one if it succeeds.
+        FileNode old = *node;
+        char *full_path = strdup(old.full_path);
+        if(!full_path)
+                PANIC_NOMEM();
+        const char *last_slash = strrchr(full_path, '/');
+        Stub_ stub = {
+                .full_path = full_path,
+                .name = last_slash ? last_slash + 1 : full_path,
+                .de_type = DT_DIR,
+        };
+        Error *err = read_tree_(&rd, node, stub, depth);
+        tree->errorv = rd.errorv;
+        tree->nerror = rd.nerror;
+        if(err) {
+                // Forget the directories just read, which are now freed.
+                if(rd.visited)
+                        ino_rehash_(rd.visited, nvisited, rd.visited->nslot);
+                *node = old;
+                return err;
+        }
+        free(old.full_path);
+        // The hashes of all the directories above `node` change too.
+        if(tree->conf.hash_content)
+                read_tree_hash_dirs_(&tree->root);
+        if(tree->cache)
+                adopt_(tree->cache, node);
         return NULL;
 }
 
@@ -527,5 +1507,67 @@ void destroy_tree(FileTree *tree)
         if(!tree)
                 return;
         destroy_tree_(tree->root);
+        destroy_chunk_pool_(tree->chunk_pool);
+        tree->chunk_pool = NULL;
+        for(unsigned k = 0; k < tree->nerror; k++)
+                destroy_error(tree->errorv[k]);
+        free(tree->errorv);
+        tree->errorv = NULL;
+        tree->nerror = 0;
+        destroy_ino_set_(tree->visited);
+        tree->visited = NULL;
+        read_tree_destroy_cache_(tree->cache);
+        tree->cache = NULL;
+}
+
+// See read_tree.h?file_chunks
+FileChunkIter file_chunks(const FileNode *node)
+{
+        assert(node);
+        if(node->alias)
+                node = node->alias;
+        if(node->chunks)
+                return (FileChunkIter){ .next = node->chunks };
+        return (FileChunkIter){
+                .data = node->content,
+                .size = node->size,
+        };
+}
+
+// See read_tree.h?file_chunk_next
+bool file_chunk_next(FileChunkIter *it, const char **pdata, unsigned *psize)
+{
+        assert(it);
+        if(!it->data) {
+                if(!it->next)
+                        return false;
+                it->data = it->next->data;
+                it->size = it->next->size;
+                it->next = it->next->next;
+        }
+        *pdata = it->data;
+        *psize = it->size;
+        it->data = NULL;
+        return true;
+}
+
+// See read_tree.h?release_file_content
+void release_file_content(FileTree *tree, FileNode *node)
+{
+        assert(tree && node);
+        if(node->chunks) {
+                assert(tree->chunk_pool);
+                put_chunks_(tree->chunk_pool, node->chunks);
+        }
+        if(tree->cache)
+                read_tree_cache_drop_(tree->cache, node);
+        free(node->content);
+        free(node->lines);
+        free(node->packed);
+        node->content = NULL;
+        node->chunks = NULL;
+        node->lines = NULL;
+        node->packed = NULL;
+        node->cached = false;
 }
 
@@ -4,6 +4,31 @@
 #include <stdbool.h>
 #include "elm0/elm.h"
 
+// A fixed-size piece of the content of a file read in chunked mode (see
+// ReadTreeConf.chunk_size).  Use file_chunks() to iterate over them.
+typedef struct FileChunk {
+        // The next chunk of the same file, or NULL if this is the last.
+        struct FileChunk *next;
+        // The number of bytes in `data`.  Only the last chunk of a file can
+        // be less than ReadTreeConf.chunk_size.
+        unsigned size;
+        // `size` bytes of content followed by a single 0 (NUL) byte.
+        char data[];
+} FileChunk;
+
+// What the content of a file looks like (see ReadTreeConf.classify).
+typedef enum {
+        // Not classified, or a directory.
+        FILE_KIND_UNKNOWN = 0,
+        // Valid UTF-8 (which includes plain ASCII).
+        FILE_KIND_TEXT,
+        // Text, but not valid UTF-8 (e.g. Latin-1, or truncated).
+        FILE_KIND_BAD_UTF8,
+        // The first block read has a NUL, or more than one byte in 32 is a
+        // control character other than whitespace, \b and ESC.
+        FILE_KIND_BINARY,
+} FileKind;
+
 // ReadTree recursively reads a directory tree into an in-memory FileNode.
 typedef struct FileNode {
         // Full path to the this node.  This can be an absolute path or it can
@@ -17,12 +42,50 @@ typedef struct FileNode {
         // (NUL) byte. For a directory .size = 0, .content = NULL.
         unsigned size;
         char *content;
+        // In chunked mode, files bigger than one chunk have .content = NULL
+        // and their content in this list instead.  Otherwise it is NULL.
+        FileChunk *chunks;
 
         // The sub-nodes node of this one, followed by an empty (default
         // initalized) "sentry" node.  For a file directory .nsub = 0, .sub =
         // NULL.
         unsigned nsub;
         struct FileNode *subv;
+
+        // True for a directory that was not read because it is at the
+        // ReadTreeConf.max_depth, or on another file-system with
+        // .one_file_system.  It has .nsub = 0 and .subv = NULL until it is
+        // read by expand_node().
+        bool unexpanded;
+        // With READ_TREE_SYMLINKS_SHARE, a directory which was already read
+        // as another node of the tree (e.g. it is reached through a symlink)
+        // points to that node instead of being read again.  It has .nsub = 0
+        // and .subv = NULL; use alias->subv.  Likewise with .share_hardlinks,
+        // a file already read through another hard link has .size but no
+        // .content or .chunks; file_chunks() gives those of the alias.
+        // Otherwise this is NULL.
+        const struct FileNode *alias;
+        // What the content looks like, if ReadTreeConf.classify is set.
+        FileKind kind;
+        // With ReadTreeConf.decompress, the size on disk of a file whose
+        // content was decompressed; .size is that of the content.  Otherwise
+        // it is 0.
+        unsigned disk_size;
+        // With ReadTreeConf.hash_content, a 64-bit hash of the content of a
+        // file, or for a directory, of the names and hashes of its sub-nodes
+        // (a Merkle hash).  So nodes with the same hash almost certainly have
+        // the same content, or subtrees that are the same.  Otherwise 0.
+        unsigned long long hash;
+
+        // Private: the line index of a file read with .index_lines (see
+        // file_node_line()), or NULL.
+        struct LineIndex *lines;
+        // Private: the compressed content of a file read with .pack_content,
+        // which then has .content = NULL.  See file_content().
+        struct PackedContent *packed;
+        // Private: with .content_budget, the content of this file is loaded
+        // from disk by file_content() as needed, and it has .content = NULL.
+        bool cached;
 } FileNode;
 
 
@@ -38,6 +101,34 @@ typedef struct {
         void *arg;
 } AcceptClosure;
 
+// What read_tree() does with symlinks below the root.  The root itself is
+// always followed.
+typedef enum {
+        // Read every symlink as if it were its target.  A link to a directory
+        // above itself is read over and over until the path is too long.
+        READ_TREE_SYMLINKS_FOLLOW = 0,
+        // Leave symlinks out of the tree.
+        READ_TREE_SYMLINKS_SKIP,
+        // Follow symlinks to files, but leave out symlinks to directories.
+        READ_TREE_SYMLINKS_FILES,
+        // Follow all symlinks, but read each directory only once; any other
+        // node for the same directory is an alias (see FileNode.alias).  This
+        // costs a stat() per directory.
+        READ_TREE_SYMLINKS_SHARE,
+} ReadTreeSymlinks;
+
+// What read_tree() does with files classified as FILE_KIND_BINARY.
+typedef enum {
+        // Read them like any other file.
+        READ_TREE_BINARY_KEEP = 0,
+        // Stop reading them after the first block.  They are left in the tree
+        // with their .size but without .content or .chunks.
+        READ_TREE_BINARY_SKIP,
+        // Stop reading them after the first block and leave them out of the
+        // tree.  A binary root is skipped instead.
+        READ_TREE_BINARY_DROP,
+} ReadTreeBinary;
+
 // The configuration controlling ReadTree().
 typedef struct {
         // Path to the root of the tree.  Can be an absolute path or realtive
@@ -54,13 +145,157 @@ typedef struct {
         // AcceptClosure for choosing directories.  The default accepts all files.
         AcceptClosure accept_dir;
         const void *accept_dir_arg, *accept_file_arg;
+
+        // If non-zero, read files in chunks of this many bytes taken from a
+        // pool owned by the FileTree, instead of into one growing buffer.
+        // Files that fit in one chunk still get a contiguous .content.
+        unsigned chunk_size;
+
+        // If true, failing to read something below the root (an unreadable
+        // file, a FIFO, a broken symlink ...) does not fail read_tree().
+        // Instead that node is left out of the tree and the error is added
+        // to FileTree.errorv.  Errors about the root itself still fail.
+        bool keep_going;
+
+        // If non-zero, read_tree() fails (as if on an unreadable directory)
+        // when a node would be more than this many levels below the root.
+        // Children of the root are at depth 1.
+        unsigned depth_limit;
+
+        // If non-zero, directories this many levels below the root are not
+        // read, but are left in the tree marked as .unexpanded.  Use this to
+        // see the top of a huge tree quickly.
+        unsigned max_depth;
+        // If true, read the tree level by level, finishing every directory at
+        // one depth before starting the next, instead of depth-first.  The
+        // result is the same, but the I/O happens in a different order;
+        // except that with READ_TREE_SYMLINKS_SHARE or .share_hardlinks, the
+        // node met first for a directory or file is the one read, and the
+        // others are its aliases, so which is which can differ.
+        bool breadth_first;
+
+        // How to treat symlinks, see ReadTreeSymlinks.
+        ReadTreeSymlinks symlinks;
+        // If true, don't read directories on a different file-system (i.e.
+        // st_dev) from the root.  They are left in the tree, unexpanded.
+        // This costs a stat() per directory.
+        bool one_file_system;
+        // If true, read files with several hard links once; any other node for
+        // the same file is an alias (see FileNode.alias).  This costs an
+        // fstat() per file.
+        bool share_hardlinks;
+
+        // If true, index the lines of each file read into one buffer (i.e.
+        // not in chunks) as it is read, for file_node_line().
+        bool index_lines;
+
+        // If true, set FileNode.kind for each file from its content as it is
+        // read.  Binary files are told apart by their first block; the rest
+        // are checked for valid UTF-8 a block at a time.
+        bool classify;
+        // What to do with binary files.  Anything but READ_TREE_BINARY_KEEP
+        // implies .classify.
+        ReadTreeBinary binary;
+
+        // If true, files that start like a gzip stream are decompressed as
+        // they are read, so .content is the uncompressed data.  Only a small
+        // buffer of compressed data is held at a time.  This needs
+        // libreadtree to be built with zlib (see READTREE_ZLIB in readtree.c),
+        // and programs using it to link with -lz.
+        bool decompress;
+
+        // If true, keep the content of each file read into one buffer
+        // compressed in memory (with zlib at its fastest level) when that
+        // saves at least an eighth of it, and leave its .content NULL.  Read
+        // it with file_content(), which keeps the last few files it
+        // decompressed in an LRU cache.  Files whose content is packed have
+        // no line index.
+        bool pack_content;
+        // How many decompressed files file_content() keeps.  The default is 8,
+        // or no limit but .content_budget if that is set.
+        unsigned unpacked_cache;
+
+        // If non-zero, files are read as usual (so their .size, .kind and so
+        // on are set) but their content is left to file_content(), which
+        // loads it from disk again when it is not in memory.  At most this
+        // many bytes of content are kept loaded, the least recently used
+        // making way for the rest, starting with what read_tree() read.
+        // This implies reading files into one buffer, whatever .chunk_size,
+        // and such files have no line index.
+        size_t content_budget;
+
+        // If true, set FileNode.hash for every node, hashing the content of
+        // files as they are read, for diff_trees().  A file whose content is
+        // not read (see READ_TREE_BINARY_SKIP) has only its size hashed.
+        bool hash_content;
 } ReadTreeConf;
 
+// Counters filled in by read_tree() when FileTree.stats is set.  Times are
+// cumulative CLOCK_MONOTONIC nanoseconds.  If libreadtree is compiled with
+// -DREADTREE_STATS=0 the instrumentation is removed and these stay zero.
+typedef struct {
+        // Calls to opendir() and readdir() (including the final NULL).
+        unsigned long long opendir_count, opendir_ns;
+        unsigned long long readdir_count, readdir_ns;
+        // Calls to stat(), needed for the root, symlinks and any file-system
+        // that does not give file types in its directory entries.
+        unsigned long long stat_count, stat_ns;
+        // Calls to open() and read() on files, and the bytes they read.
+        unsigned long long open_count, open_ns;
+        unsigned long long read_count, read_ns;
+        unsigned long long bytes_read;
+        // Times a file or directory-listing buffer was grown by realloc().
+        unsigned long long realloc_count;
+        // With .pack_content, the files considered for packing, and the bytes
+        // of content in and out for those that were kept compressed.
+        unsigned long long pack_count, pack_ns;
+        unsigned long long pack_in_bytes, pack_out_bytes;
+        // Sorting of directory listings.
+        unsigned long long sort_count, sort_ns;
+        // Calls to the AcceptClosures (not counting dotfiles).
+        unsigned long long accept_count, accept_ns;
+        // Candidate nodes kept or dropped (including dotfiles, '.' and '..').
+        unsigned long long accepted, rejected;
+        // The depth of the deepest node kept.  Children of the root are at 1.
+        unsigned max_depth;
+} ReadTreeStats;
+
 typedef struct {
         ReadTreeConf conf;
         FileNode root;
+
+        // If non-NULL, read_tree() resets *stats, then fills it out.
+        ReadTreeStats *stats;
+
+        // In .conf.keep_going mode, the errors for nodes left out of the tree,
+        // in the order they happened.  Freed by destroy_tree().
+        unsigned nerror;
+        Error **errorv;
+
+        // Private: recycles the FileChunks of a tree read in chunked mode.
+        struct ChunkPool *chunk_pool;
+        // Private: the nodes read, for READ_TREE_SYMLINKS_SHARE and
+        // .share_hardlinks.
+        struct InoSet *visited;
+        // Private: recently unpacked or loaded content, for file_content().
+        struct ContentCache *cache;
 } FileTree;
 
+// Counters for the content that file_content() keeps loaded (see
+// ReadTreeConf.content_budget and .pack_content).
+typedef struct {
+        // Calls to file_content() for packed or cached files, which found
+        // the content loaded or had to load it.
+        unsigned long long hits, misses;
+        // Files let go to stay within the budget.
+        unsigned long long evictions;
+        // Loads that failed, because the file could no longer be read or no
+        // longer had the same size.
+        unsigned long long failures;
+        // The files and bytes of content loaded now, and the most bytes ever.
+        unsigned long long files, bytes, peak_bytes;
+} ContentCacheStats;
+
 // Read recursively tree reads a directory tree into memory as a FileTree.
 //
 // Allocate a FileTree object and set the `.conf` field as desired.  This
@@ -70,6 +305,481 @@ extern Error *read_tree(FileTree *ptree);
 // Cleans up internal data structures in *tree, but does no delete it.
 extern void destroy_tree(FileTree *tree);
 
+// Reads the unexpanded directory `node` of `tree` (see ReadTreeConf.max_depth)
+// in place, down to `levels` levels below it, or all the way if `levels` is 0.
+// Directories at that depth are again left unexpanded.  The tree's .conf is
+// used as it was for read_tree(); new keep_going errors are appended to
+// .errorv and any .stats are added to.  Does nothing if `node` is already
+// expanded.  On error `node` is left unexpanded.
+extern Error *expand_node(FileTree *tree, FileNode *node, unsigned levels);
+
+// An iterator over the content of a file, one contiguous piece at a time.
+typedef struct {
+        const char *data;
+        unsigned size;
+        const FileChunk *next;
+} FileChunkIter;
+
+// Starts iterating over the content of `node`.  A file read into a single
+// buffer yields one piece; a chunked file yields each of its chunks in order; a
+// directory yields nothing.
+extern FileChunkIter file_chunks(const FileNode *node);
+// Sets *pdata and *psize to the next piece of content and returns true, or
+// returns false if there are no more pieces.
+extern bool file_chunk_next(
+        FileChunkIter *it,
+        const char **pdata,
+        unsigned *psize);
+
+// Frees the content of the file `node` in `tree`, returning any chunks to the
+// tree's pool for re-use, and lets go of any loaded by file_content(), which
+// must not be in use.  The node keeps its .size, but afterwards has .content
+// = NULL and .chunks = NULL.  So do any aliases of it.
+extern void release_file_content(FileTree *tree, FileNode *node);
+
+// The content of the file `node` of `tree`, followed by a NUL, like .content.
+// Packed content (see ReadTreeConf.pack_content) is decompressed, and with
+// .content_budget content is read from disk, into a cache owned by `tree`.
+// Returns NULL for directories, chunked files, released content and files
+// that can no longer be read.
+//
+// Call file_content_done() when finished with content that isn't NULL.  Until
+// then it stays valid, and the cache doesn't let it go to make room for
+// others; so file_content() can be used from several threads at once, e.g.
+// under tree_parallel_for_each().
+extern const char *file_content(const FileTree *tree, const FileNode *node);
+// Lets the cache of `tree` have back the content of `node` from one call to
+// file_content().  Nothing happens for content that wasn't cached.
+extern void file_content_done(const FileTree *tree, const FileNode *node);
+// The counters of the cache behind file_content(), all 0 if `tree` has none.
+extern ContentCacheStats content_cache_stats(const FileTree *tree);
+
+// The number of lines in `node`, if it was read with .index_lines; else 0.
+// The last line need not end in a newline, so "a\nb" has two lines.
+extern unsigned file_node_nlines(const FileNode *node);
+// The start of line `n` (from 0) of `node`, with its length (not counting the
+// newline) in *plen; or NULL if there is no such line or no line index.  This
+// costs a few dozen byte loads however long the file is.
+extern const char *file_node_line(
+        const FileNode *node,
+        unsigned n,
+        unsigned *plen);
+
+// Internal: a line index for the `size` bytes at `content`, or NULL if it has
+// no lines.  Free it with free().
+extern struct LineIndex *read_tree_index_lines_(
+        const char *content,
+        unsigned size);
+
+// Internal: compresses `size` bytes of content for FileNode.packed, setting
+// *pzsize to its size, or returns NULL if that isn't worth it.  Free it with
+// free().
+extern struct PackedContent *read_tree_pack_(
+        const char *content,
+        unsigned size,
+        unsigned *pzsize);
+// Internal: decompresses the packed content of `node` into `dest`, which has
+// room for node->size + 1 bytes, and adds the NUL.
+extern void read_tree_unpack_(const FileNode *node, char *dest);
+// Internal: reads the content of the cached file `node` of `tree` again into a
+// buffer you can free(), or returns NULL if it cannot be read or has changed
+// size.
+extern char *read_tree_load_(const FileTree *tree, const FileNode *node);
+
+// Internal: a cache for file_content() of up to `max` files and `budget` bytes
+// of content (0 for no limit).  A `max` of 0 means the default unless there is
+// a budget.
+extern struct ContentCache *read_tree_new_cache_(unsigned max, size_t budget);
+extern void read_tree_destroy_cache_(struct ContentCache *cache);
+// Internal: hands the content of the cached file `node` to `cache`, as if it
+// had just been loaded.
+extern void read_tree_cache_put_(
+        struct ContentCache *cache,
+        const FileNode *node,
+        char *content);
+// Internal: frees any content of `node` held by `cache`.
+extern void read_tree_cache_drop_(
+        struct ContentCache *cache,
+        const FileNode *node);
+
+// Internal: the state of read_tree_classify_() for one file.
+typedef struct {
+        FileKind kind;
+        bool sampled;         // the first block has been seen
+        unsigned need;        // continuation bytes of a UTF-8 sequence to come
+        unsigned char lo, hi; // the range of the next continuation byte
+} ReadTreeClassifier_;
+// Internal: classifies the next `n` bytes of a file, which start at `data`.
+// Once the kind is FILE_KIND_BINARY it does not change.
+extern void read_tree_classify_(
+        ReadTreeClassifier_ *c,
+        const char *data,
+        size_t n);
+// Internal: the kind of a file whose bytes have all gone to c.
+extern FileKind read_tree_classify_end_(ReadTreeClassifier_ *c);
+
+// -- Forests ----------------------------------------------------------------
+
+// The result of reading one root of a FileForest.
+typedef struct {
+        // The tree read for this root.  Its .root is only filled in if the
+        // root was read in its own right (i.e. .shared_with < 0).
+        FileTree tree;
+        // The root node for this root, or NULL if it could not be read.  It is
+        // either &tree.root or, if the root was shared, a node inside the tree
+        // of another root.  In the latter case the .path of it and of its
+        // sub-nodes are relative to that other root.
+        const FileNode *root;
+        // The index of the root whose tree this one was found in, or -1.
+        int shared_with;
+        // Why this root could not be read, or NULL.
+        Error *error;
+} ForestRoot;
+
+// A set of independent trees read together by read_forest().
+typedef struct {
+        // The maximum number of threads to read with; 0 means one per online
+        // CPU.  No more threads are started than there are roots to read.
+        unsigned nthreads;
+
+        // Filled in by read_forest(): one result for each ReadTreeConf.
+        unsigned nroot;
+        ForestRoot *rootv;
+} FileForest;
+
+// Reads the trees described by `nconf` configurations concurrently.
+//
+// Set `forest->nthreads` as desired, the rest is filled out by this function.
+// Every root gets a ForestRoot in `forest->rootv`, even if it fails.  A root
+// which is the same as, or lies inside, another root with the same
+// accept-closures and other options (and no max_depth or depth_limit) is not
+// read twice; instead its .root points into the tree of the other root.
+//
+// Returns NULL if every root was read, otherwise an error saying how many
+// failed; the individual errors are in the ForestRoots.  Panics in the reading
+// threads are re-raised in the calling thread.
+extern Error *read_forest(
+        FileForest *forest,
+        const ReadTreeConf *confv,
+        unsigned nconf);
+// Cleans up every tree and error in *forest, but does not delete it.
+extern void destroy_forest(FileForest *forest);
+
+// -- Flat views -------------------------------------------------------------
+
+// Bits of TreeView.flags.
+#define TREE_VIEW_DIR 1         // a directory (possibly unexpanded or an alias)
+#define TREE_VIEW_ALIAS 2       // FileNode.alias is set
+#define TREE_VIEW_UNEXPANDED 4  // FileNode.unexpanded is set
+
+// A flattened, read-only copy of the shape of a FileTree, for fast scans.
+//
+// There is one entry per node, in preorder: node 0 is the root, and the
+// subtree of node k is nodes k .. end[k]-1.  Each field is a separate array,
+// so that a scan touching only one of them (e.g. summing .size) is a linear,
+// vectorisable pass over contiguous memory.  Aliases are leaves.  The view
+// points into the tree, which must outlive it and not change.
+typedef struct {
+        unsigned n;
+        // The index of each node's parent.  parent[0] = 0.
+        unsigned *parent;
+        // The index just after each node's subtree.
+        unsigned *end;
+        // FileNode.size, i.e. 0 for a directory.
+        unsigned *size;
+        // The offset in `names` of each node's name (the last component of
+        // its .path, or "" for the root).
+        unsigned *name;
+        // TREE_VIEW_* bits.
+        unsigned char *flags;
+        // FileNode.content, following any alias.  NULL for directories and
+        // for files held in chunks.
+        const char **content;
+        // The FileNode itself, for anything else.
+        const FileNode **node;
+        // All the names, each followed by a NUL.
+        char *names;
+} TreeView;
+
+// Iterates over the indices K of the children of node I of view V.
+#define TREE_VIEW_FOR_CHILDREN(V, I, K) \
+        for(unsigned K = (I) + 1; K < (V)->end[I]; K = (V)->end[K])
+
+// Makes a TreeView of `tree`.
+extern TreeView *new_tree_view(const FileTree *tree);
+// Frees a TreeView (but not the tree).
+extern void destroy_tree_view(TreeView *view);
+
+// Reduces a TreeView in parallel.
+//
+// The nodes are split into contiguous ranges of indices, and for each range
+// `scan(view, begin, end, part, arg)` accumulates into `part`, which starts
+// as a copy of the `acc_size` bytes at `acc`.  Then `merge(acc, part, arg)` is
+// called for each part, in order of the ranges, on the calling thread.  Uses
+// up to `nthreads` threads, or one per CPU if `nthreads` is 0.
+extern void tree_view_reduce(
+        const TreeView *view,
+        unsigned nthreads,
+        void (*scan)(const TreeView *view, unsigned begin, unsigned end,
+                void *part, void *arg),
+        void (*merge)(void *acc, const void *part, void *arg),
+        void *acc,
+        size_t acc_size,
+        void *arg);
+
+// Totals over a whole TreeView, from tree_view_totals().
+typedef struct {
+        unsigned long long files, dirs, bytes;
+        // The index of the largest file, or 0 if no file has any bytes.
+        unsigned largest;
+} TreeViewTotals;
+
+// Counts the files, directories and bytes in `view`, in parallel.  A file
+// with several hard links read with .share_hardlinks counts as a file for each
+// link, but its bytes count once.
+extern TreeViewTotals tree_view_totals(const TreeView *view, unsigned nthreads);
+
+// -- Parallel processing ----------------------------------------------------
+
+// Calls `fun(node, arg)` for every file node of `tree` (i.e. every node
+// without sub-nodes that isn't an unexpanded or aliased directory), on up to
+// `nthreads` threads, or one per CPU if `nthreads` is 0.
+//
+// The files are split, in tree order, into chunks of about the same number
+// of bytes, which are shared out among the threads; a thread that runs out
+// steals half of the remaining chunks of another.  `fun` may be called for
+// different nodes at once, and must not panic().  It may read content with
+// file_content(), as long as it calls file_content_done() after.
+extern void tree_parallel_for_each(
+        const FileTree *tree,
+        unsigned nthreads,
+        void (*fun)(const FileNode *node, void *arg),
+        void *arg);
+
+// Folds every file node of `tree` in parallel, as tree_parallel_for_each().
+//
+// Each chunk of files has its own `part`, which starts as a copy of the
+// `acc_size` bytes at `acc`, and `fold(part, node, arg)` is called for each
+// of the chunk's files in order.  Then `merge(acc, part, arg)` is called for
+// each part, in tree order, on the calling thread; so the result doesn't
+// depend on the scheduling as long as `merge` is associative.
+extern void tree_reduce(
+        const FileTree *tree,
+        unsigned nthreads,
+        void (*fold)(void *part, const FileNode *node, void *arg),
+        void (*merge)(void *acc, const void *part, void *arg),
+        void *acc,
+        size_t acc_size,
+        void *arg);
+
+// -- Searching --------------------------------------------------------------
+
+// Where search_tree() found a literal.
+typedef struct {
+        const FileNode *node;
+        // The byte offset of the match in the node's content.
+        size_t offset;
+        // The index of the literal in `literalv`.
+        unsigned literal;
+} TreeMatch;
+
+typedef struct {
+        unsigned n;
+        // Sorted by node, in tree order, then by offset and literal.
+        TreeMatch *v;
+} TreeMatches;
+
+// Finds every occurrence of each of the `nliteral` non-empty strings in
+// `literalv` in the content of the files of `tree`, including overlapping
+// ones.  Files are searched in parallel as by tree_parallel_for_each().  Each
+// file is scanned once for all the literals: positions whose first two bytes
+// begin any literal are found with a table lookup (by AVX2 or SSSE3, or SSE2
+// for a single literal, where the CPU has them), and only the literals they
+// could begin are compared there.  Chunked files are searched across chunk
+// boundaries; files whose content was released are skipped.
+extern TreeMatches search_tree(
+        const FileTree *tree,
+        const char *const *literalv,
+        unsigned nliteral,
+        unsigned nthreads);
+// Frees the matches found by search_tree().
+extern void destroy_tree_matches(TreeMatches *matches);
+
+// -- Diffing ----------------------------------------------------------------
+
+// How a node differs between two trees, for diff_trees().
+typedef enum {
+        // Only in the second tree.
+        TREE_DIFF_ADDED = 1,
+        // Only in the first tree.
+        TREE_DIFF_REMOVED,
+        // In both, but a file with other content, or a file in one and a
+        // directory in the other, or an alias of a different directory.
+        TREE_DIFF_MODIFIED,
+} TreeDiff;
+
+// Compares the trees `a` and `b`, calling `fun(diff, na, nb, arg)` for each
+// node that differs (unless `fun` is NULL), and returns how many did.  `na`
+// is the node in `a` and `nb` that in `b`; one of them is NULL if the node is
+// only in the other tree.  Nodes are matched by their path below the roots,
+// and reported in tree order.  A directory only in one tree is reported, but
+// not its sub-nodes.
+//
+// Since sub-nodes are sorted by name, this is one merge pass over both trees.
+// If both were read with .hash_content, files are compared by size and hash
+// and subtrees with the same hash are skipped; otherwise by size, then by
+// content.  The content of files that is not in memory (released, say) is
+// read from disk as it is now, by .full_path; files that can't be read, or
+// have changed size there, are reported as TREE_DIFF_MODIFIED.
+// Unexpanded directories are not looked into.
+extern unsigned diff_trees(
+        const FileTree *a,
+        const FileTree *b,
+        void (*fun)(TreeDiff diff, const FileNode *na, const FileNode *nb,
+                void *arg),
+        void *arg);
+
+// -- Writing ----------------------------------------------------------------
+
+// Writes `tree` out as `dest`, a directory (or a file, if the root is one),
+// which may already exist.  Files are written from their content in memory;
+// files without it (e.g. with .content_budget) are copied from where they
+// were read, with copy_file_range() so that file systems which can share
+// extents do.  Directories that are aliases become symlinks to wherever their
+// alias was written, and unexpanded directories are left empty.  Files with
+// several hard links are written as separate copies.
+//
+// The tree is written a level at a time, the directories of each level in
+// parallel on up to `nthreads` threads (or one per CPU if 0), each making its
+// files and sub-directories with openat() and mkdirat().  If anything fails,
+// it stops after that level and returns an error for the first failure in
+// tree order, leaving what was written so far.
+extern Error *write_tree(
+        const FileTree *tree,
+        const char *dest,
+        unsigned nthreads);
+
+// Writes `tree` to `fd` as a POSIX tar stream: an entry for every node under
+// the root (or just the root, if it is a file, under its own name), in tree
+// order, then the end-of-archive blocks.  Paths too long for ustar get pax
+// headers.  Directories that are aliases become symlinks as with write_tree(),
+// and files with several hard links separate copies.  There being no modes,
+// owners or times in the tree, entries have modes 0644 or 0755, owner 0 and
+// time 0.  Content in memory goes out with writev(), without being copied;
+// files without it are copied from where they were read with sendfile().
+extern Error *write_tree_tar(const FileTree *tree, int fd);
+
+// -- Shared memory ----------------------------------------------------------
+
+// A node of a SharedTree.  Strings and content are byte offsets from the
+// start of the segment (see SHARED_TREE_STR()), so they mean the same in every
+// process, wherever it maps the segment.
+typedef struct {
+        // FileNode.path, followed by a NUL.
+        unsigned long long path;
+        // The content of a file followed by a NUL, or 0 if it wasn't in the
+        // tree (e.g. it was released).
+        unsigned long long content;
+        // For a directory that is an alias, the .path of its alias, otherwise
+        // 0.
+        unsigned long long alias;
+        // FileNode.hash.
+        unsigned long long hash;
+        // FileNode.size.
+        unsigned size;
+        // The sub-nodes are nodev[subv] .. nodev[subv + nsub - 1], in the
+        // same order as FileNode.subv.
+        unsigned nsub, subv;
+        // TREE_VIEW_* bits.
+        unsigned flags;
+        // FileNode.kind.
+        FileKind kind;
+} SharedNode;
+
+// A tree in shared memory, mapped read-only by attach_tree().
+typedef struct {
+        // The whole mapped segment.
+        const char *base;
+        size_t size;
+        // Which publish_tree() of the name this is, counting from 1; or 0
+        // for a tree from publish_tree_fd().
+        unsigned long long generation;
+        // Every node, breadth first: nodev[0] is the root.
+        unsigned nnode;
+        const SharedNode *nodev;
+        // Private: the name's current generation, for shared_tree_stale().
+        const struct SharedControl *control;
+} SharedTree;
+
+// The string at offset OFF of the SharedTree T, or NULL if OFF is 0.
+#define SHARED_TREE_STR(T, OFF) ((OFF) ? (T)->base + (OFF) : (const char*)0)
+
+// Publishes a copy of `tree` in POSIX shared memory as `name` (which starts
+// with a '/', see shm_open()), for any number of processes to attach_tree().
+//
+// The copy is one segment with every node, path and file content, using
+// offsets instead of pointers.  Content is copied whether it is in memory,
+// packed or cached, and files with several hard links get a copy each.  Each
+// call makes a new generation of `name`: the segment is built in full under
+// its own name, and only then does the generation counter in the segment
+// `name` move on to it, so an attach_tree() sees either the old tree or the
+// new one, never part of one.  The old segment is unlinked; processes which
+// have it attached keep it until they detach_tree().  Publishers of the same
+// name take turns, holding a lock on the segment `name` (see flock()).
+// Fails with ESTALE, publishing nothing, if the content of a file that has
+// to be loaded from disk again (see .content_budget) has changed size.
+//
+// Sets *pgeneration (unless it is NULL) to the generation published.
+extern Error *publish_tree(
+        const FileTree *tree,
+        const char *name,
+        unsigned long long *pgeneration);
+// Publishes `tree` as publish_tree() does, but in an anonymous memfd instead,
+// sealed against any change, and sets *pfd to it.  Hand it on to other
+// processes (e.g. over a Unix socket, or to children; it is close-on-exec)
+// to attach_tree_fd().
+extern Error *publish_tree_fd(const FileTree *tree, int *pfd);
+// Unlinks the current generation of `name` and `name` itself, making
+// attached trees stale.
+extern Error *unpublish_tree(const char *name);
+
+// Maps the current generation of the tree published as `name`, read-only,
+// into *shared.  Every offset in it is checked first.
+extern Error *attach_tree(SharedTree *shared, const char *name);
+// Maps the tree in `fd`, from publish_tree_fd(), into *shared.  `fd` can be
+// closed afterwards.
+extern Error *attach_tree_fd(SharedTree *shared, int fd);
+// True if `shared` was attached by name and a newer generation has since
+// been published (or it was unpublished).  Detach and attach again to move
+// on.
+extern bool shared_tree_stale(const SharedTree *shared);
+// Unmaps a tree attached by attach_tree() or attach_tree_fd().
+extern void detach_tree(SharedTree *shared);
+
+// Internal: the FileNode.hash of the file `node`, from its content.
+extern unsigned long long read_tree_hash_file_(const FileNode *node);
+// Internal: sets FileNode.hash for the directories under `node`, whose files
+// are already hashed.
+extern void read_tree_hash_dirs_(FileNode *node);
+
+// Internal: limits search_tree() to the kernel `level` (0 for plain C, 1 for
+// SSE2, or SSSE3 for several literals, 2 for AVX2) or below, and returns the
+// previous limit.  For testing.
+extern unsigned read_tree_search_level_(unsigned level);
+
+// Internal: `nthreads`, or the number of CPUs (within reason) if it is 0.
+extern unsigned read_tree_nthreads_(unsigned nthreads);
+
+// Internal: calls fun(arg, k) for every k < ntask, using up to `nthreads`
+// threads (or one per CPU if 0), including the caller's, and returns once they
+// are all done.  `fun` must not panic(), since a panic on the calling thread
+// would skip the joins.
+extern void read_tree_run_batch_(
+        unsigned nthreads,
+        unsigned ntask,
+        void (*fun)(void *arg, unsigned k),
+        void *arg);
+
 // Internal back-end for RAD_TREE_ACCEPT_SUFFIX, do no use directly.
 extern bool read_tree_accept_all_(
         const void *arg,
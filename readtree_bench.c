@@ -0,0 +1,382 @@
+// readtree_bench: times read_tree() over a synthetic tree and reports JSON.
+//
+// Usage: readtree_bench [--depth N] [--fanout N] [--files N]
+//                       [--min-size BYTES] [--max-size BYTES]
+//                       [--dotfiles RATIO] [--symlinks RATIO]
+//                       [--runs N] [--seed N] [--dir PATH]
+//
+// Each directory down to --depth has --fanout sub-directories and --files
+// files.  File sizes are log-uniformly distributed between --min-size and
+// --max-size.  A --dotfiles fraction of the names begin with '.' (so
+// read_tree() skips them) and a --symlinks fraction of the files are symlinks
+// to a sibling file.  The tree is generated under --dir, which defaults to
+// the current directory, in a directory named after all of the above (and
+// --seed); files already there with the right size are left as they are, so
+// later runs with the same options don't write (and dirty) the tree again.
+// The cold runs are skipped if --dir is on tmpfs, which has no page cache to
+// evict.
+//
+// For meaningful numbers, build with optimisation in a separate build dir
+// (without -Werror, as gcc's -O2 -Wmaybe-uninitialized is not reliable):
+//
+//      make bench B=$PWD/b-bench CFLAGS="-std=c99 -Wall -O2 -fcommon"
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/magic.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/vfs.h>
+
+#include "readtree.h"
+
+typedef struct {
+        unsigned depth, fanout, files;
+        unsigned min_size, max_size;
+        double dotfiles, symlinks;
+        unsigned runs;
+        unsigned seed;
+        const char *dir;
+} BenchConf;
+
+// What one read_tree() + destroy_tree() cost.
+typedef struct {
+        double read_sec, destroy_sec;
+        unsigned long long read_syscalls, write_syscalls;
+} Sample;
+
+// What read_tree() found, to compute rates.
+typedef struct {
+        unsigned long long files, dirs, bytes;
+} Census;
+
+static double now_sec_(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+// The number of read-like and write-like syscalls made by this process so
+// far, or 0 if the kernel doesn't tell us.  Other syscalls (open, getdents,
+// stat ...) aren't counted anywhere.
+static void syscalls_(unsigned long long *psyscr, unsigned long long *psyscw)
+{
+        *psyscr = *psyscw = 0;
+        FILE *f = fopen("/proc/self/io", "r");
+        if(!f)
+                return;
+        char line[128];
+        while(fgets(line, sizeof line, f)) {
+                sscanf(line, "syscr: %llu", psyscr);
+                sscanf(line, "syscw: %llu", psyscw);
+        }
+        fclose(f);
+}
+
+static long peak_rss_kib_(void)
+{
+        struct rusage ru;
+        if(getrusage(RUSAGE_SELF, &ru))
+                return -1;
+        return ru.ru_maxrss;
+}
+
+// -- Generating a tree ------------------------------------------------------
+
+static double uniform_(unsigned *seed)
+{
+        return rand_r(seed) / (RAND_MAX + 1.0);
+}
+
+static unsigned file_size_(const BenchConf *bc, unsigned *seed)
+{
+        if(bc->max_size <= bc->min_size)
+                return bc->min_size;
+        double lo = bc->min_size ? bc->min_size : 1;
+        double x = lo * exp2(uniform_(seed) * log2(bc->max_size / lo));
+        return bc->min_size ? (unsigned)x : (unsigned)x - 1;
+}
+
+// Writes a file of `size` random bytes at `path`, unless there already is
+// one of that size from an earlier run.  `seed` moves on the same either way.
+static Error *write_file_(const char *path, unsigned size, unsigned *seed)
+{
+        char buf[4096];
+        for(size_t k = 0; k < sizeof buf; k++)
+                buf[k] = 'a' + rand_r(seed) % 26;
+        struct stat st;
+        if(!lstat(path, &st) && S_ISREG(st.st_mode) && st.st_size == size)
+                return NULL;
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0)
+                return IO_ERROR(path, errno, "Creating bench file");
+        while(size) {
+                unsigned n = size < sizeof buf ? size : sizeof buf;
+                ssize_t w = write(fd, buf, n);
+                if(w < 0) {
+                        close(fd);
+                        return IO_ERROR(path, errno, "Writing bench file");
+                }
+                size -= w;
+        }
+        if(close(fd))
+                return IO_ERROR(path, errno, "Closing bench file");
+        return NULL;
+}
+
+static Error *make_bench_dir_(
+        const BenchConf *bc,
+        const char *path,
+        unsigned depth,
+        unsigned *seed)
+{
+        if(mkdir(path, 0755) && errno != EEXIST)
+                return IO_ERROR(path, errno, "Creating bench dir");
+
+        Error *err = NULL;
+        char *sub = NULL, *first_file = NULL;
+        for(unsigned k = 0; !err && k < bc->files; k++) {
+                const char *dot = uniform_(seed) < bc->dotfiles ? "." : "";
+                if(0 > asprintf(&sub, "%s/%sfile%u", path, dot, k))
+                        PANIC_NOMEM();
+                if(first_file && uniform_(seed) < bc->symlinks) {
+                        const char *tgt = strrchr(first_file, '/') + 1;
+                        if(symlink(tgt, sub) && errno != EEXIST)
+                                err = IO_ERROR(sub, errno,
+                                        "Creating bench symlink");
+                        free(sub);
+                        continue;
+                }
+                err = write_file_(sub, file_size_(bc, seed), seed);
+                if(!first_file && !*dot)
+                        first_file = sub;
+                else
+                        free(sub);
+        }
+        free(first_file);
+
+        for(unsigned k = 0; !err && depth && k < bc->fanout; k++) {
+                const char *dot = uniform_(seed) < bc->dotfiles ? "." : "";
+                if(0 > asprintf(&sub, "%s/%sdir%u", path, dot, k))
+                        PANIC_NOMEM();
+                err = make_bench_dir_(bc, sub, depth - 1, seed);
+                free(sub);
+        }
+        return err;
+}
+
+// -- Measuring --------------------------------------------------------------
+
+static void census_(const FileNode *node, Census *c)
+{
+        if(node->subv) {
+                c->dirs++;
+                for(unsigned k = 0; k < node->nsub; k++)
+                        census_(node->subv + k, c);
+        } else {
+                c->files++;
+                c->bytes += node->size;
+        }
+}
+
+// True if `path` is on tmpfs, where evict_() can't make anything cold.
+static bool on_tmpfs_(const char *path)
+{
+        struct statfs sf;
+        return !statfs(path, &sf) && sf.f_type == TMPFS_MAGIC;
+}
+
+// Ask the kernel to drop its cached pages for every file in the tree.
+static void evict_(const FileNode *node)
+{
+        if(node->subv) {
+                for(unsigned k = 0; k < node->nsub; k++)
+                        evict_(node->subv + k);
+                return;
+        }
+        int fd = open(node->full_path, O_RDONLY);
+        if(fd < 0)
+                return;
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+}
+
+static Error *sample_(const char *root, Sample *ps, Census *pc, bool cold)
+{
+        FileTree tree = { .conf = { .root_path = root } };
+        if(cold) {
+                Error *err = read_tree(&tree);
+                if(err)
+                        return err;
+                evict_(&tree.root);
+                destroy_tree(&tree);
+                tree = (FileTree){ .conf = { .root_path = root } };
+        }
+
+        unsigned long long syscr, syscw, syscr1, syscw1;
+        syscalls_(&syscr, &syscw);
+        double t0 = now_sec_();
+        Error *err = read_tree(&tree);
+        double t1 = now_sec_();
+        if(err)
+                return err;
+        syscalls_(&syscr1, &syscw1);
+        ps->read_syscalls = syscr1 - syscr;
+        ps->write_syscalls = syscw1 - syscw;
+
+        *pc = (Census){0};
+        census_(&tree.root, pc);
+
+        double t2 = now_sec_();
+        destroy_tree(&tree);
+        double t3 = now_sec_();
+
+        ps->read_sec = t1 - t0;
+        ps->destroy_sec = t3 - t2;
+        return NULL;
+}
+
+static int cmp_double_(const void *va, const void *vb)
+{
+        double a = *(const double*)va, b = *(const double*)vb;
+        return (a > b) - (a < b);
+}
+
+static Error *report_(
+        const char *key,
+        const char *root,
+        const BenchConf *bc,
+        bool cold,
+        const char *sep)
+{
+        Sample s = {0};
+        Census c = {0};
+        double *read_sec = MALLOC(bc->runs * sizeof *read_sec);
+        double *destroy_sec = MALLOC(bc->runs * sizeof *destroy_sec);
+
+        Error *err = NULL;
+        for(unsigned k = 0; k < bc->runs; k++) {
+                if((err = sample_(root, &s, &c, cold)))
+                        break;
+                read_sec[k] = s.read_sec;
+                destroy_sec[k] = s.destroy_sec;
+        }
+        if(!err) {
+                qsort(read_sec, bc->runs, sizeof *read_sec, cmp_double_);
+                qsort(destroy_sec, bc->runs, sizeof *destroy_sec, cmp_double_);
+                double med = read_sec[bc->runs / 2];
+                printf("  \"%s\": {\n"
+                       "    \"read_sec_min\": %.6f,\n"
+                       "    \"read_sec_median\": %.6f,\n"
+                       "    \"destroy_sec_median\": %.6f,\n"
+                       "    \"files_per_sec\": %.1f,\n"
+                       "    \"mb_per_sec\": %.3f,\n"
+                       "    \"read_syscalls\": %llu,\n"
+                       "    \"write_syscalls\": %llu\n"
+                       "  }%s\n",
+                       key, read_sec[0], med, destroy_sec[bc->runs / 2],
+                       c.files / med, c.bytes / med / 1e6,
+                       s.read_syscalls, s.write_syscalls, sep);
+        }
+
+        free(read_sec);
+        free(destroy_sec);
+        return err;
+}
+
+// -- Main -------------------------------------------------------------------
+
+static bool parse_args_(int argc, char **argv, BenchConf *bc)
+{
+        for(int k = 1; k < argc; k++) {
+                const char *opt = argv[k], *val = argv[k + 1];
+                if(!val)
+                        return false;
+                k++;
+                if(!strcmp(opt, "--depth")) bc->depth = atoi(val);
+                else if(!strcmp(opt, "--fanout")) bc->fanout = atoi(val);
+                else if(!strcmp(opt, "--files")) bc->files = atoi(val);
+                else if(!strcmp(opt, "--min-size")) bc->min_size = atoi(val);
+                else if(!strcmp(opt, "--max-size")) bc->max_size = atoi(val);
+                else if(!strcmp(opt, "--dotfiles")) bc->dotfiles = atof(val);
+                else if(!strcmp(opt, "--symlinks")) bc->symlinks = atof(val);
+                else if(!strcmp(opt, "--runs")) bc->runs = atoi(val);
+                else if(!strcmp(opt, "--seed")) bc->seed = atoi(val);
+                else if(!strcmp(opt, "--dir")) bc->dir = val;
+                else return false;
+        }
+        return bc->runs > 0;
+}
+
+int main(int argc, char **argv)
+{
+        BenchConf bc = {
+                .depth = 3,
+                .fanout = 4,
+                .files = 20,
+                .min_size = 0,
+                .max_size = 64 << 10,
+                .dotfiles = 0.05,
+                .symlinks = 0.05,
+                .runs = 5,
+                .seed = 1,
+                .dir = ".",
+        };
+        if(!parse_args_(argc, argv, &bc)) {
+                fprintf(stderr, "usage: see the comment at the top of %s\n",
+                        __FILE__);
+                return 2;
+        }
+
+        char *root;
+        if(0 > asprintf(&root,
+                        "%s/readtree_bench_d%u_f%u_n%u_s%u-%u_h%g_l%g_%u",
+                        bc.dir, bc.depth, bc.fanout, bc.files,
+                        bc.min_size, bc.max_size, bc.dotfiles, bc.symlinks,
+                        bc.seed))
+                PANIC_NOMEM();
+
+        unsigned seed = bc.seed;
+        double t0 = now_sec_();
+        panic_if(make_bench_dir_(&bc, root, bc.depth, &seed));
+        double gen_sec = now_sec_() - t0;
+
+        printf("{\n"
+               "  \"root\": \"%s\",\n"
+               "  \"depth\": %u, \"fanout\": %u, \"files_per_dir\": %u,\n"
+               "  \"min_size\": %u, \"max_size\": %u,\n"
+               "  \"dotfile_ratio\": %g, \"symlink_ratio\": %g,\n"
+               "  \"runs\": %u, \"generate_sec\": %.3f,\n",
+               root, bc.depth, bc.fanout, bc.files,
+               bc.min_size, bc.max_size, bc.dotfiles, bc.symlinks,
+               bc.runs, gen_sec);
+
+        Census c = {0};
+        Sample s = {0};
+        panic_if(sample_(root, &s, &c, false));
+        printf("  \"files\": %llu, \"dirs\": %llu, \"bytes\": %llu,\n",
+                c.files, c.dirs, c.bytes);
+
+        panic_if(report_("warm", root, &bc, false, ","));
+        if(on_tmpfs_(root))
+                printf("  \"cold\": null,\n");
+        else
+                panic_if(report_("cold", root, &bc, true, ","));
+        printf("  \"peak_rss_kib\": %ld\n}\n", peak_rss_kib_());
+
+        free(root);
+        return 0;
+}
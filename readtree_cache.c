@@ -0,0 +1,301 @@
+// The cache behind file_content(): the unpacked content of packed files, and
+// with .content_budget, content loaded from disk.
+#define _GNU_SOURCE
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "readtree.h"
+
+// The default ReadTreeConf.unpacked_cache, without a .content_budget.
+#define DEFAULT_UNPACKED_CACHE 8
+// The fewest hash buckets a cache has.
+#define MIN_BUCKETS 16
+
+typedef struct CacheEntry_ {
+        const FileNode *node;
+        char *data;
+        // Calls to file_content() for it not yet matched by
+        // file_content_done().  Entries in use aren't evicted.
+        unsigned pins;
+        struct CacheEntry_ *prev, *next; // by use, most recent first
+        struct CacheEntry_ *hnext;       // in the same hash bucket
+} CacheEntry_;
+
+// Loaded content in least recently used order, and hashed by node so that
+// finding it costs the same however many files are loaded.
+struct ContentCache {
+        pthread_mutex_t lock;
+        unsigned max;  // files, or 0 for no limit
+        size_t budget; // bytes, or 0 for no limit
+        CacheEntry_ *head, *tail;
+        CacheEntry_ **bucketv;
+        size_t nbucket; // a power of 2
+        ContentCacheStats stats;
+};
+
+// See read_tree.h?read_tree_new_cache_
+struct ContentCache *read_tree_new_cache_(unsigned max, size_t budget)
+{
+        struct ContentCache *cache = MALLOC(sizeof *cache);
+        *cache = (struct ContentCache){
+                .max = max || budget ? max : DEFAULT_UNPACKED_CACHE,
+                .budget = budget,
+                .bucketv = calloc(MIN_BUCKETS, sizeof *cache->bucketv),
+                .nbucket = MIN_BUCKETS,
+        };
+        if(!cache->bucketv)
+                PANIC_NOMEM();
+        pthread_mutex_init(&cache->lock, NULL);
+        return cache;
+}
+
+// See read_tree.h?read_tree_destroy_cache_
+void read_tree_destroy_cache_(struct ContentCache *cache)
+{
+        if(!cache)
+                return;
+        for(CacheEntry_ *e = cache->head, *next; e; e = next) {
+                next = e->next;
+                free(e->data);
+                free(e);
+        }
+        free(cache->bucketv);
+        pthread_mutex_destroy(&cache->lock);
+        free(cache);
+}
+
+static size_t hash_(const FileNode *node, size_t nbucket)
+{
+        uint64_t h = (uintptr_t)node * 0x9e3779b97f4a7c15ull;
+        return (h >> 32) & (nbucket - 1);
+}
+
+// The link pointing at the entry for `node`, or at NULL if there is none.
+static CacheEntry_ **find_(struct ContentCache *cache, const FileNode *node)
+{
+        CacheEntry_ **pe = cache->bucketv + hash_(node, cache->nbucket);
+        while(*pe && (*pe)->node != node)
+                pe = &(*pe)->hnext;
+        return pe;
+}
+
+// Doubles the buckets, once there are more entries than them.  This is done
+// with the lock held, so without memory it just leaves the buckets longer
+// rather than panic.
+static void grow_(struct ContentCache *cache)
+{
+        size_t n = 2 * cache->nbucket;
+        CacheEntry_ **bucketv = calloc(n, sizeof *bucketv);
+        if(!bucketv)
+                return;
+        for(CacheEntry_ *e = cache->head; e; e = e->next) {
+                CacheEntry_ **pb = bucketv + hash_(e->node, n);
+                e->hnext = *pb;
+                *pb = e;
+        }
+        free(cache->bucketv);
+        cache->bucketv = bucketv;
+        cache->nbucket = n;
+}
+
+static void unlink_(struct ContentCache *cache, CacheEntry_ *e)
+{
+        *(e->prev ? &e->prev->next : &cache->head) = e->next;
+        *(e->next ? &e->next->prev : &cache->tail) = e->prev;
+}
+
+static void push_front_(struct ContentCache *cache, CacheEntry_ *e)
+{
+        e->prev = NULL;
+        e->next = cache->head;
+        *(cache->head ? &cache->head->prev : &cache->tail) = e;
+        cache->head = e;
+}
+
+static void remove_(struct ContentCache *cache, CacheEntry_ *e)
+{
+        unlink_(cache, e);
+        *find_(cache, e->node) = e->hnext;
+        cache->stats.files--;
+        cache->stats.bytes -= e->node->size;
+        free(e->data);
+        free(e);
+}
+
+static bool over_(const struct ContentCache *cache)
+{
+        const ContentCacheStats *st = &cache->stats;
+        return (cache->max && st->files > cache->max) ||
+               (cache->budget && st->bytes > cache->budget);
+}
+
+// Lets go of the least recently used entries, other than `keep` and those in
+// use, until the cache is within its limits again (or only those are left).
+static void trim_(struct ContentCache *cache, const CacheEntry_ *keep)
+{
+        for(CacheEntry_ *e = cache->tail, *prev; e && over_(cache); e = prev) {
+                prev = e->prev;
+                if(e == keep || e->pins)
+                        continue;
+                remove_(cache, e);
+                cache->stats.evictions++;
+        }
+}
+
+// Adds the new entry `e` for `data`, the content of `node`, as the most
+// recently used and with `pins` users; then trim_()s the rest.  The new entry
+// stays even if it is over the budget by itself.
+static const char *insert_(struct ContentCache *cache, CacheEntry_ *e,
+        const FileNode *node, char *data, unsigned pins)
+{
+        assert(!*find_(cache, node));
+        if(cache->stats.files >= cache->nbucket)
+                grow_(cache);
+        CacheEntry_ **pb = cache->bucketv + hash_(node, cache->nbucket);
+        *e = (CacheEntry_){
+                .node = node,
+                .data = data,
+                .pins = pins,
+                .hnext = *pb,
+        };
+        *pb = e;
+        push_front_(cache, e);
+
+        ContentCacheStats *st = &cache->stats;
+        st->files++;
+        st->bytes += node->size;
+        trim_(cache, e);
+        if(st->peak_bytes < st->bytes)
+                st->peak_bytes = st->bytes;
+        return data;
+}
+
+// The entry for `node` if there is one, pinned for one more user and made
+// the most recently used.
+static CacheEntry_ *hit_(struct ContentCache *cache, const FileNode *node)
+{
+        CacheEntry_ *e = *find_(cache, node);
+        if(e) {
+                e->pins++;
+                unlink_(cache, e);
+                push_front_(cache, e);
+        }
+        return e;
+}
+
+// See read_tree.h?read_tree_cache_put_
+void read_tree_cache_put_(
+        struct ContentCache *cache,
+        const FileNode *node,
+        char *content)
+{
+        assert(cache && node && content);
+        CacheEntry_ *e = MALLOC(sizeof *e);
+        pthread_mutex_lock(&cache->lock);
+        insert_(cache, e, node, content, 0);
+        pthread_mutex_unlock(&cache->lock);
+}
+
+// See read_tree.h?read_tree_cache_drop_
+void read_tree_cache_drop_(struct ContentCache *cache, const FileNode *node)
+{
+        assert(cache && node);
+        pthread_mutex_lock(&cache->lock);
+        CacheEntry_ *e = *find_(cache, node);
+        if(e && e->pins) {
+                pthread_mutex_unlock(&cache->lock);
+                PANIC("Content of %s is released while in use",
+                        node->full_path);
+        }
+        if(e)
+                remove_(cache, e);
+        pthread_mutex_unlock(&cache->lock);
+}
+
+// -- Public -----------------------------------------------------------
+
+// See read_tree.h?file_content
+const char *file_content(const FileTree *tree, const FileNode *node)
+{
+        assert(tree && node);
+        if(node->alias)
+                node = node->alias;
+        if(!node->packed && !node->cached)
+                return node->content;
+        if(!tree->cache)
+                PANIC("%s is cached, but not by this tree", node->full_path);
+
+        struct ContentCache *cache = tree->cache;
+        pthread_mutex_lock(&cache->lock);
+        CacheEntry_ *e = hit_(cache, node);
+        if(e)
+                cache->stats.hits++;
+        else
+                cache->stats.misses++;
+        pthread_mutex_unlock(&cache->lock);
+        if(e)
+                return e->data;
+
+        // Loaded or unpacked without the lock, so that other threads aren't
+        // held up by it, nor is the lock left held if it panics.
+        char *data = NULL;
+        if(node->packed) {
+                data = MALLOC(node->size + 1);
+                read_tree_unpack_(node, data);
+        } else {
+                data = read_tree_load_(tree, node);
+        }
+        e = data ? MALLOC(sizeof *e) : NULL;
+
+        pthread_mutex_lock(&cache->lock);
+        CacheEntry_ *other = data ? hit_(cache, node) : NULL;
+        const char *ret = other ? other->data : data;
+        // Unless another thread got there first.
+        if(!other && data)
+                insert_(cache, e, node, data, 1);
+        else if(!data)
+                cache->stats.failures++;
+        pthread_mutex_unlock(&cache->lock);
+        if(other) {
+                free(data);
+                free(e);
+        }
+        return ret;
+}
+
+// See read_tree.h?file_content_done
+void file_content_done(const FileTree *tree, const FileNode *node)
+{
+        assert(tree && node);
+        if(node->alias)
+                node = node->alias;
+        if(!node->packed && !node->cached)
+                return;
+        struct ContentCache *cache = tree->cache;
+        pthread_mutex_lock(&cache->lock);
+        CacheEntry_ *e = *find_(cache, node);
+        if(!e || !e->pins) {
+                pthread_mutex_unlock(&cache->lock);
+                PANIC("file_content_done() of %s without file_content()",
+                        node->full_path);
+        }
+        // As after insert_(), the most recently used entry stays.
+        if(!--e->pins)
+                trim_(cache, cache->head);
+        pthread_mutex_unlock(&cache->lock);
+}
+
+// See read_tree.h?content_cache_stats
+ContentCacheStats content_cache_stats(const FileTree *tree)
+{
+        assert(tree);
+        if(!tree->cache)
+                return (ContentCacheStats){0};
+        pthread_mutex_lock(&tree->cache->lock);
+        ContentCacheStats stats = tree->cache->stats;
+        pthread_mutex_unlock(&tree->cache->lock);
+        return stats;
+}
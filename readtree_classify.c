@@ -0,0 +1,136 @@
+// Classifying file content as text or binary, and validating UTF-8, as it is
+// read.
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "readtree.h"
+
+// The first block is binary if it has a NUL, or if more than one byte in
+// this many is a control character other than the usual whitespace, \b and
+// ESC.
+#define CONTROL_RATIO 32
+
+// True for the bytes that mark binary content.
+static bool is_control_(unsigned char b)
+{
+        return (b < 0x20 && !(b >= '\b' && b <= '\r') && b != 0x1b) ||
+                b == 0x7f;
+}
+
+static bool looks_binary_(const unsigned char *p, size_t n)
+{
+        size_t ncontrol = 0;
+        for(size_t k = 0; k < n; k++) {
+                if(!p[k])
+                        return true;
+                ncontrol += is_control_(p[k]);
+        }
+        return ncontrol * CONTROL_RATIO > n;
+}
+
+// The length of a run of ASCII bytes at the start of `p`, rounded down to a
+// whole number of vectors.
+static size_t skip_ascii_(const unsigned char *p, size_t n)
+{
+        size_t k = 0;
+#ifdef __SSE2__
+        for(; k + 16 <= n; k += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i*)(p + k));
+                if(_mm_movemask_epi8(v))
+                        break;
+        }
+#else
+        for(; k + 8 <= n; k += 8) {
+                uint64_t w;
+                memcpy(&w, p + k, sizeof w);
+                if(w & 0x8080808080808080ull)
+                        break;
+        }
+#endif
+        return k;
+}
+
+// Checks `n` more bytes of UTF-8, carrying a partial character over from the
+// last call in `c`.  Returns false on the first invalid byte.
+static bool check_utf8_(ReadTreeClassifier_ *c, const unsigned char *p,
+        size_t n)
+{
+        unsigned need = c->need;
+        unsigned char lo = c->lo, hi = c->hi;
+        for(size_t k = 0; k < n; k++) {
+                unsigned char b = p[k];
+                if(need) {
+                        if(b < lo || b > hi)
+                                return false;
+                        need--;
+                        lo = 0x80;
+                        hi = 0xbf;
+                        continue;
+                }
+                if(b < 0x80) {
+                        size_t run = skip_ascii_(p + k, n - k);
+                        if(run)
+                                k += run - 1;
+                        continue;
+                }
+                // The first byte limits the second, to rule out overlong
+                // forms, surrogates and code points past U+10FFFF.
+                lo = 0x80;
+                hi = 0xbf;
+                if(b >= 0xc2 && b <= 0xdf) {
+                        need = 1;
+                } else if(b >= 0xe0 && b <= 0xef) {
+                        need = 2;
+                        if(b == 0xe0)
+                                lo = 0xa0;
+                        else if(b == 0xed)
+                                hi = 0x9f;
+                } else if(b >= 0xf0 && b <= 0xf4) {
+                        need = 3;
+                        if(b == 0xf0)
+                                lo = 0x90;
+                        else if(b == 0xf4)
+                                hi = 0x8f;
+                } else {
+                        return false;
+                }
+        }
+        c->need = need;
+        c->lo = lo;
+        c->hi = hi;
+        return true;
+}
+
+// See read_tree.h?read_tree_classify_
+void read_tree_classify_(ReadTreeClassifier_ *c, const char *data, size_t n)
+{
+        assert(c && (data || !n));
+        const unsigned char *p = (const unsigned char*)data;
+        if(!c->sampled) {
+                c->sampled = true;
+                if(looks_binary_(p, n)) {
+                        c->kind = FILE_KIND_BINARY;
+                        return;
+                }
+                c->kind = FILE_KIND_TEXT;
+        }
+        if(c->kind == FILE_KIND_TEXT && !check_utf8_(c, p, n))
+                c->kind = FILE_KIND_BAD_UTF8;
+}
+
+// See read_tree.h?read_tree_classify_end_
+FileKind read_tree_classify_end_(ReadTreeClassifier_ *c)
+{
+        assert(c);
+        if(!c->sampled)
+                return FILE_KIND_TEXT;
+        if(c->kind == FILE_KIND_TEXT && c->need)
+                return FILE_KIND_BAD_UTF8;
+        return c->kind;
+}
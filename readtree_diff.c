@@ -0,0 +1,423 @@
+// Content hashes and diff_trees(): comparing two trees in one merge pass.
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "readtree.h"
+
+// -- Hashing ----------------------------------------------------------
+//
+// Content is hashed 32 bytes at a time in four independent lanes, so that the
+// multiplies overlap.  Bytes are buffered across pieces, so a file hashes the
+// same whether it was read in chunks or not.
+
+#define K1 0x9e3779b97f4a7c15ull
+#define K2 0xc2b2ae3d27d4eb4full
+
+// Seeds keeping the hashes of different sorts of node apart.
+#define SEED_FILE 0x46494c45ull
+#define SEED_DIR 0x444952ull
+#define SEED_ALIAS 0x414c494173ull
+#define SEED_UNEXPANDED 0x554e4558ull
+
+typedef struct {
+        uint64_t lane[4];
+        unsigned char buf[32];
+        unsigned nbuf;
+        uint64_t len;
+} Hasher_;
+
+static uint64_t mix_(uint64_t h, uint64_t w)
+{
+        h ^= w * K2;
+        h = (h << 31 | h >> 33) * K1;
+        return h;
+}
+
+static void hasher_init_(Hasher_ *hs, uint64_t seed)
+{
+        *hs = (Hasher_){ .lane = { seed, seed + K1, seed + K2, seed - K1 } };
+}
+
+static void hash_block_(Hasher_ *hs, const unsigned char *p)
+{
+        for(unsigned k = 0; k < 4; k++) {
+                uint64_t w;
+                memcpy(&w, p + 8 * k, sizeof w);
+                hs->lane[k] = mix_(hs->lane[k], w);
+        }
+}
+
+static void hash_bytes_(Hasher_ *hs, const void *data, size_t n)
+{
+        const unsigned char *p = data;
+        hs->len += n;
+        if(hs->nbuf) {
+                size_t take = n < 32 - hs->nbuf ? n : 32 - hs->nbuf;
+                memcpy(hs->buf + hs->nbuf, p, take);
+                hs->nbuf += take;
+                p += take;
+                n -= take;
+                if(hs->nbuf < 32)
+                        return;
+                hash_block_(hs, hs->buf);
+                hs->nbuf = 0;
+        }
+        for(; n >= 32; p += 32, n -= 32)
+                hash_block_(hs, p);
+        memcpy(hs->buf, p, n);
+        hs->nbuf = n;
+}
+
+static uint64_t hash_end_(Hasher_ *hs)
+{
+        if(hs->nbuf) {
+                memset(hs->buf + hs->nbuf, 0, 32 - hs->nbuf);
+                hash_block_(hs, hs->buf);
+        }
+        uint64_t h = hs->len;
+        for(unsigned k = 0; k < 4; k++)
+                h = mix_(h, hs->lane[k]);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h;
+}
+
+// The last component of the path of `node`, or "" for the root.
+static const char *name_(const FileNode *node)
+{
+        const char *slash = strrchr(node->path, '/');
+        return slash ? slash + 1 : node->path;
+}
+
+// True if `node` is a directory, whether read, unexpanded or an alias.
+static bool is_dir_(const FileNode *node)
+{
+        if(node->alias)
+                node = node->alias;
+        return node->subv || node->unexpanded;
+}
+
+// See read_tree.h?read_tree_hash_file_
+unsigned long long read_tree_hash_file_(const FileNode *node)
+{
+        assert(node && !node->alias);
+        Hasher_ hs;
+        hasher_init_(&hs, SEED_FILE ^ node->size);
+        const char *data;
+        unsigned size;
+        FileChunkIter it = file_chunks(node);
+        while(file_chunk_next(&it, &data, &size))
+                hash_bytes_(&hs, data, size);
+        return hash_end_(&hs);
+}
+
+// The hash of the directory `node`, from those of its sub-nodes.
+static uint64_t hash_dir_(const FileNode *node)
+{
+        Hasher_ hs;
+        hasher_init_(&hs, SEED_DIR);
+        for(unsigned k = 0; k < node->nsub; k++) {
+                const FileNode *sub = node->subv + k;
+                const char *name = name_(sub);
+                hash_bytes_(&hs, name, strlen(name) + 1);
+                uint64_t h = sub->hash;
+                hash_bytes_(&hs, &h, sizeof h);
+        }
+        return hash_end_(&hs);
+}
+
+// Sets the hash of `node` if it is a directory that is an alias or
+// unexpanded, returning true if it is read instead, and still to be hashed.
+static bool hash_leaf_(FileNode *node)
+{
+        Hasher_ hs;
+        if(node->alias) {
+                if(!is_dir_(node))
+                        return false;
+                // The alias may be above this node, and not hashed yet.
+                hasher_init_(&hs, SEED_ALIAS);
+                hash_bytes_(&hs, node->alias->path,
+                        strlen(node->alias->path));
+        } else if(node->unexpanded) {
+                hasher_init_(&hs, SEED_UNEXPANDED);
+        } else {
+                return node->subv;
+        }
+        node->hash = hash_end_(&hs);
+        return false;
+}
+
+// A directory being hashed, and the next of its sub-nodes to look at.
+typedef struct {
+        FileNode *node;
+        unsigned next;
+} HashFrame_;
+
+// See read_tree.h?read_tree_hash_dirs_
+void read_tree_hash_dirs_(FileNode *node)
+{
+        assert(node);
+        if(!hash_leaf_(node))
+                return;
+        // A directory is hashed once all of its sub-nodes are, without
+        // recursion, however deep the tree.
+        unsigned alloc = 16, n = 0;
+        HashFrame_ *stack = MALLOC(alloc * sizeof *stack);
+        stack[n++] = (HashFrame_){ .node = node };
+        while(n) {
+                HashFrame_ *top = stack + n - 1;
+                FileNode *dir = top->node;
+                if(top->next == dir->nsub) {
+                        dir->hash = hash_dir_(dir);
+                        n--;
+                        continue;
+                }
+                FileNode *sub = dir->subv + top->next++;
+                if(!hash_leaf_(sub))
+                        continue;
+                if(n == alloc) {
+                        stack = realloc(stack, (alloc *= 2) * sizeof *stack);
+                        if(!stack)
+                                PANIC_NOMEM();
+                }
+                stack[n++] = (HashFrame_){ .node = sub };
+        }
+        free(stack);
+}
+
+// -- Diffing ----------------------------------------------------------
+
+typedef struct {
+        const FileTree *ta, *tb;
+        bool hashed; // both trees have .hash_content
+        void (*fun)(TreeDiff diff, const FileNode *a, const FileNode *b,
+                void *arg);
+        void *arg;
+        unsigned n;
+} Diff_;
+
+static void report_(Diff_ *d, TreeDiff diff, const FileNode *a,
+        const FileNode *b)
+{
+        d->n++;
+        if(d->fun)
+                d->fun(diff, a, b, d->arg);
+}
+
+// Bytes read at a time from files with no content in memory.
+#define DISK_BUF (64 << 10)
+
+// The content of one side of a comparison: from memory, through file_content()
+// if it is packed or cached, or else read from disk as it is now.
+typedef struct {
+        const FileTree *tree;
+        const FileNode *node;
+        FileChunkIter it;
+        bool done;   // file_content_done() is owed
+        int fd;      // reading from disk if not -1
+        char *buf;
+        bool failed; // couldn't be read in full
+} Side_;
+
+static void open_side_(Side_ *s, const FileTree *tree, const FileNode *node)
+{
+        if(node->alias)
+                node = node->alias;
+        *s = (Side_){ .tree = tree, .node = node, .fd = -1 };
+        if(node->packed || node->cached) {
+                const char *data = file_content(tree, node);
+                s->done = data;
+                s->failed = !data;
+                s->it = (FileChunkIter){
+                        .data = data,
+                        .size = data ? node->size : 0,
+                };
+                return;
+        }
+        if(node->content || node->chunks) {
+                s->it = file_chunks(node);
+                return;
+        }
+        // Released: what is on disk must be the same size, at least.
+        struct stat st;
+        s->fd = open(node->full_path, O_RDONLY | O_CLOEXEC);
+        if(s->fd < 0 || fstat(s->fd, &st) || st.st_size != node->size) {
+                s->failed = true;
+                return;
+        }
+        s->buf = MALLOC(DISK_BUF);
+}
+
+static bool side_next_(Side_ *s, const char **pdata, unsigned *psize)
+{
+        if(s->failed)
+                return false;
+        if(s->fd < 0)
+                return file_chunk_next(&s->it, pdata, psize);
+        ssize_t got;
+        do got = read(s->fd, s->buf, DISK_BUF);
+        while(got < 0 && errno == EINTR);
+        if(got <= 0) {
+                s->failed = got < 0;
+                return false;
+        }
+        *pdata = s->buf;
+        *psize = got;
+        return true;
+}
+
+static void close_side_(Side_ *s)
+{
+        if(s->done)
+                file_content_done(s->tree, s->node);
+        if(s->fd >= 0)
+                close(s->fd);
+        free(s->buf);
+}
+
+// True if the files `a` and `b` have the same content.  A file that can't be
+// read counts as different.
+static bool same_file_(Diff_ *d, const FileNode *a, const FileNode *b)
+{
+        if(a->size != b->size)
+                return false;
+        if(d->hashed)
+                return a->hash == b->hash;
+
+        Side_ sa, sb;
+        open_side_(&sa, d->ta, a);
+        open_side_(&sb, d->tb, b);
+        const char *pa = NULL, *pb = NULL;
+        unsigned na = 0, nb = 0;
+        bool same = true;
+        for(;;) {
+                if(!na && !side_next_(&sa, &pa, &na))
+                        break;
+                if(!nb && !side_next_(&sb, &pb, &nb))
+                        break;
+                unsigned n = na < nb ? na : nb;
+                if(memcmp(pa, pb, n)) {
+                        same = false;
+                        break;
+                }
+                pa += n, na -= n;
+                pb += n, nb -= n;
+        }
+        same = same && !na && !nb && !sa.failed && !sb.failed;
+        close_side_(&sa);
+        close_side_(&sb);
+        return same;
+}
+
+// Compares the nodes `a` and `b`, which have the same path, reporting them
+// if they differ.  Returns true if they are both directories that were read,
+// whose sub-nodes are still to be compared.
+static bool diff_node_(Diff_ *d, const FileNode *a, const FileNode *b)
+{
+        if(a == b)
+                return false;
+        bool dir = is_dir_(a);
+        if(dir != is_dir_(b)) {
+                report_(d, TREE_DIFF_MODIFIED, a, b);
+                return false;
+        }
+        if(!dir) {
+                if(!same_file_(d, a, b))
+                        report_(d, TREE_DIFF_MODIFIED, a, b);
+                return false;
+        }
+        // Equal Merkle hashes mean equal subtrees.
+        if(d->hashed && a->hash == b->hash)
+                return false;
+        if(a->alias || b->alias) {
+                if(!a->alias || !b->alias ||
+                   strcmp(a->alias->path, b->alias->path))
+                        report_(d, TREE_DIFF_MODIFIED, a, b);
+                return false;
+        }
+        return !a->unexpanded && !b->unexpanded;
+}
+
+// Two directories being compared, and the next sub-nodes of each to pair up.
+typedef struct {
+        const FileNode *sa, *ea;
+        const FileNode *sb, *eb;
+} DiffFrame_;
+
+// Compares the trees under `a` and `b` depth first, with a stack of the
+// directories on the way down instead of recursion.
+static void diff_tree_(Diff_ *d, const FileNode *a, const FileNode *b)
+{
+        if(!diff_node_(d, a, b))
+                return;
+        unsigned alloc = 16, n = 0;
+        DiffFrame_ *stack = MALLOC(alloc * sizeof *stack);
+        stack[n++] = (DiffFrame_){
+                a->subv, a->subv + a->nsub, b->subv, b->subv + b->nsub,
+        };
+        while(n) {
+                // Both lists of sub-nodes are sorted by name, as read_tree()
+                // left them, so one pass over each pairs them up.
+                DiffFrame_ *top = stack + n - 1;
+                if(top->sa == top->ea && top->sb == top->eb) {
+                        n--;
+                        continue;
+                }
+                int cmp = top->sa == top->ea ? 1 : top->sb == top->eb ? -1 :
+                        strcmp(name_(top->sa), name_(top->sb));
+                if(cmp < 0) {
+                        report_(d, TREE_DIFF_REMOVED, top->sa++, NULL);
+                        continue;
+                }
+                if(cmp > 0) {
+                        report_(d, TREE_DIFF_ADDED, NULL, top->sb++);
+                        continue;
+                }
+                const FileNode *sa = top->sa++, *sb = top->sb++;
+                if(!diff_node_(d, sa, sb))
+                        continue;
+                if(n == alloc) {
+                        stack = realloc(stack, (alloc *= 2) * sizeof *stack);
+                        if(!stack)
+                                PANIC_NOMEM();
+                }
+                stack[n++] = (DiffFrame_){
+                        sa->subv, sa->subv + sa->nsub,
+                        sb->subv, sb->subv + sb->nsub,
+                };
+        }
+        free(stack);
+}
+
+// -- Public -----------------------------------------------------------
+
+// See read_tree.h?diff_trees
+unsigned diff_trees(
+        const FileTree *a,
+        const FileTree *b,
+        void (*fun)(TreeDiff diff, const FileNode *na, const FileNode *nb,
+                void *arg),
+        void *arg)
+{
+        if(!a || !b)
+                PANIC("'a' or 'b' is null");
+        Diff_ d = {
+                .ta = a,
+                .tb = b,
+                .hashed = a->conf.hash_content && b->conf.hash_content,
+                .fun = fun,
+                .arg = arg,
+        };
+        diff_tree_(&d, &a->root, &b->root);
+        return d.n;
+}
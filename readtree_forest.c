@@ -0,0 +1,289 @@
+// read_forest(): reading many independent roots concurrently.
+#define _GNU_SOURCE
+#include <assert.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "readtree.h"
+
+// -- Sharing nested roots ---------------------------------------------
+
+// True if reading with `a` and `b` gives the same nodes for the same paths.
+// A max_depth or depth_limit counts from each root, so roots with either are
+// never shared.
+static bool confs_compatible_(const ReadTreeConf *a, const ReadTreeConf *b)
+{
+        bool (*all)(const void*, const char*, const char*) =
+                read_tree_accept_all_;
+        return (a->accept_dir.fun ? a->accept_dir.fun : all) ==
+               (b->accept_dir.fun ? b->accept_dir.fun : all) &&
+               (a->accept_file.fun ? a->accept_file.fun : all) ==
+               (b->accept_file.fun ? b->accept_file.fun : all) &&
+               a->accept_dir.arg == b->accept_dir.arg &&
+               a->accept_file.arg == b->accept_file.arg &&
+               a->chunk_size == b->chunk_size &&
+               a->keep_going == b->keep_going &&
+               a->symlinks == b->symlinks &&
+               a->one_file_system == b->one_file_system &&
+               a->share_hardlinks == b->share_hardlinks &&
+               a->index_lines == b->index_lines &&
+               a->classify == b->classify &&
+               a->binary == b->binary &&
+               a->decompress == b->decompress &&
+               a->pack_content == b->pack_content &&
+               a->content_budget == b->content_budget &&
+               a->hash_content == b->hash_content &&
+               !a->max_depth && !b->max_depth &&
+               !a->depth_limit && !b->depth_limit;
+}
+
+// True if the canonical path `inner` is `outer` or lies beneath it.
+static bool path_contains_(const char *outer, const char *inner)
+{
+        size_t n = strlen(outer);
+        if(strncmp(outer, inner, n))
+                return false;
+        return !inner[n] || inner[n] == '/' || outer[n - 1] == '/';
+}
+
+// The sub-node of `dir` called `name` (of `n` bytes), or NULL.
+static const FileNode *find_sub_(
+        const FileNode *dir,
+        const char *name,
+        size_t n)
+{
+        // Sub-nodes are sorted by name, see read_tree.c?qsort_stub_cmp_.
+        unsigned lo = 0, hi = dir->nsub;
+        while(lo < hi) {
+                unsigned mid = lo + (hi - lo) / 2;
+                const FileNode *sub = dir->subv + mid;
+                const char *sname = strrchr(sub->path, '/');
+                sname = sname ? sname + 1 : sub->path;
+
+                int cmp = strncmp(name, sname, n);
+                if(!cmp && sname[n])
+                        cmp = -1;
+                if(!cmp)
+                        return sub;
+                if(cmp < 0)
+                        hi = mid;
+                else
+                        lo = mid + 1;
+        }
+        return NULL;
+}
+
+// Follows the relative path `rel` down from `node`; NULL if it isn't there.
+static const FileNode *find_node_(const FileNode *node, const char *rel)
+{
+        for(;;) {
+                while(*rel == '/')
+                        rel++;
+                if(!*rel || !node)
+                        return node;
+                size_t n = strcspn(rel, "/");
+                node = find_sub_(node, rel, n);
+                rel += n;
+        }
+}
+
+// Sets .shared_with for every root that lies within another compatible root.
+// Each is shared with the outermost such root, or the first of several equal
+// ones, so that it is never itself shared.
+static void find_shared_roots_(
+        FileForest *forest,
+        const ReadTreeConf *confv,
+        char **realv)
+{
+        for(unsigned k = 0; k < forest->nroot; k++) {
+                int best = -1;
+                size_t best_len = SIZE_MAX;
+                size_t my_len = realv[k] ? strlen(realv[k]) : 0;
+                for(unsigned j = 0; realv[k] && j < forest->nroot; j++) {
+                        if(j == k || !realv[j])
+                                continue;
+                        // Of equal roots, the first is read for the others.
+                        size_t len = strlen(realv[j]);
+                        if(len >= best_len || (len == my_len && j > k))
+                                continue;
+                        if(!path_contains_(realv[j], realv[k]) ||
+                           !confs_compatible_(confv + j, confv + k))
+                                continue;
+                        best = j;
+                        best_len = len;
+                }
+                forest->rootv[k].shared_with = best;
+        }
+}
+
+// -- Reading ----------------------------------------------------------
+
+// A panic caught while reading a root.  The out-of-memory Error belongs to
+// the thread that raised it, and is gone once that thread exits, so it is
+// only noted, and raised again on the calling thread.
+typedef struct {
+        Error *err;
+        bool nomem;
+} Caught_;
+
+typedef struct {
+        FileForest *forest;
+        const unsigned *todo; // indices in forest->rootv, one per task
+        Caught_ *caughtv;     // panics caught while reading, by root
+} ForestJob_;
+
+static void read_root_task_(void *vjob, unsigned k)
+{
+        ForestJob_ *job = vjob;
+        unsigned idx = job->todo[k];
+        ForestRoot *fr = job->forest->rootv + idx;
+
+        PanicReturn ret;
+        Error *err;
+        if((err = TRY(ret))) {
+                if(err->type == nomem_error_type)
+                        job->caughtv[idx].nomem = true;
+                else
+                        job->caughtv[idx].err = err;
+                return;
+        }
+        fr->error = read_tree(&fr->tree);
+        NO_WORRIES(ret);
+        fr->root = fr->error ? NULL : &fr->tree.root;
+}
+
+// Reads the `ntodo` roots listed in `todo`, and returns the first panic any of
+// them had (out of memory first of all), for the caller to re-raise; or NULL.
+static Error *read_roots_(
+        FileForest *forest,
+        const unsigned *todo,
+        unsigned ntodo,
+        Caught_ *caughtv)
+{
+        ForestJob_ job = {
+                .forest = forest,
+                .todo = todo,
+                .caughtv = caughtv,
+        };
+        read_tree_run_batch_(forest->nthreads, ntodo, read_root_task_,
+                &job);
+
+        Error *first = NULL;
+        bool nomem = false;
+        for(unsigned k = 0; k < forest->nroot; k++) {
+                first = keep_first_error(first, caughtv[k].err);
+                nomem |= caughtv[k].nomem;
+                caughtv[k] = (Caught_){0};
+        }
+        if(nomem) {
+                destroy_error(first);
+                return ERROR_NOMEM();
+        }
+        return first;
+}
+
+// -- Public -----------------------------------------------------------
+
+// See read_tree.h?read_forest
+Error *read_forest(
+        FileForest *forest,
+        const ReadTreeConf *confv,
+        unsigned nconf)
+{
+        if(!forest)
+                PANIC("'forest' is null");
+        if(nconf && !confv)
+                PANIC("'confv' is null");
+        for(unsigned k = 0; k < nconf; k++) {
+                if(!confv[k].root_path)
+                        PANIC("Configured root_path %u of forest is null", k);
+        }
+
+        forest->nthreads = read_tree_nthreads_(forest->nthreads);
+        forest->nroot = nconf;
+        forest->rootv = MALLOC((nconf + 1) * sizeof *forest->rootv);
+
+        char **realv = MALLOC((nconf + 1) * sizeof *realv);
+        for(unsigned k = 0; k < nconf; k++) {
+                forest->rootv[k] = (ForestRoot){
+                        .tree = { .conf = confv[k] },
+                        .shared_with = -1,
+                };
+                // If this fails, read_tree() will find out why.
+                realv[k] = realpath(confv[k].root_path, NULL);
+        }
+        find_shared_roots_(forest, confv, realv);
+
+        // First read the roots that aren't shared, ...
+        unsigned *todo = MALLOC((nconf + 1) * sizeof *todo);
+        Caught_ *caughtv = calloc(nconf + 1, sizeof *caughtv);
+        if(!caughtv)
+                PANIC_NOMEM();
+        unsigned ntodo = 0;
+        for(unsigned k = 0; k < nconf; k++) {
+                if(forest->rootv[k].shared_with < 0)
+                        todo[ntodo++] = k;
+        }
+        Error *panicked = read_roots_(forest, todo, ntodo, caughtv);
+
+        // ... then look up the shared ones in them.  If a root is not in the
+        // tree it was meant to share (e.g. it was dropped), read it anyway.
+        ntodo = 0;
+        for(unsigned k = 0; !panicked && k < nconf; k++) {
+                ForestRoot *fr = forest->rootv + k;
+                if(fr->shared_with < 0)
+                        continue;
+                const ForestRoot *owner = forest->rootv + fr->shared_with;
+                const char *rel = realv[k] + strlen(realv[fr->shared_with]);
+                if(owner->root)
+                        fr->root = find_node_(owner->root, rel);
+                if(fr->root && (fr->root->unexpanded || fr->root->alias)) {
+                        // E.g. a mount point with one_file_system, or a
+                        // directory the owner met first through a symlink.
+                        fr->root = NULL;
+                }
+                if(!fr->root) {
+                        fr->shared_with = -1;
+                        todo[ntodo++] = k;
+                }
+        }
+        if(!panicked)
+                panicked = read_roots_(forest, todo, ntodo, caughtv);
+
+        unsigned nfailed = 0;
+        for(unsigned k = 0; k < nconf; k++) {
+                free(realv[k]);
+                nfailed += !forest->rootv[k].root;
+        }
+        free(realv);
+        free(todo);
+        free(caughtv);
+        if(panicked) {
+                destroy_forest(forest);
+                panic(panicked);
+        }
+
+        if(nfailed)
+                return ERROR("%u of %u roots in forest could not be read",
+                        nfailed, nconf);
+        return NULL;
+}
+
+// See read_tree.h?destroy_forest
+void destroy_forest(FileForest *forest)
+{
+        if(!forest)
+                return;
+        for(unsigned k = 0; k < forest->nroot; k++) {
+                ForestRoot *fr = forest->rootv + k;
+                if(fr->shared_with < 0)
+                        destroy_tree(&fr->tree);
+                destroy_error(fr->error);
+        }
+        free(forest->rootv);
+        forest->rootv = NULL;
+        forest->nroot = 0;
+}
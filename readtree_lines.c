@@ -0,0 +1,140 @@
+// Line indices: random access to the lines of a file read with .index_lines.
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "readtree.h"
+
+// Every LINE_BLOCK'th line has its offset stored in full; the others are
+// found by adding up the deltas from the one before.
+#define LINE_BLOCK 64
+
+typedef struct {
+        unsigned offset; // of line b * LINE_BLOCK
+        unsigned delta;  // index in the deltas of the next line's delta
+} LineBlock_;
+
+// The distance from each line to the next, i.e. the length of each line but
+// the last plus its newline, as LEB128 varints: 7 bits a byte, low bits
+// first, the top bit set on all but the last byte.  So lines shorter than 127
+// bytes cost a byte each, plus 8 bytes per LINE_BLOCK lines.
+struct LineIndex {
+        unsigned nline;
+        unsigned nblock;
+        LineBlock_ blockv[];
+        // Followed by the deltas.
+};
+
+static unsigned char *deltas_(const struct LineIndex *li)
+{
+        return (unsigned char*)(li->blockv + li->nblock);
+}
+
+static unsigned varint_len_(unsigned x)
+{
+        unsigned n = 1;
+        while(x >>= 7)
+                n++;
+        return n;
+}
+
+static unsigned char *put_varint_(unsigned char *p, unsigned x)
+{
+        for(; x >= 0x80; x >>= 7)
+                *p++ = x | 0x80;
+        *p++ = x;
+        return p;
+}
+
+static const unsigned char *get_varint_(const unsigned char *p, unsigned *px)
+{
+        unsigned x = 0;
+        for(unsigned shift = 0; ; shift += 7) {
+                x |= (unsigned)(*p & 0x7f) << shift;
+                if(!(*p++ & 0x80))
+                        break;
+        }
+        *px = x;
+        return p;
+}
+
+// See read_tree.h?read_tree_index_lines_
+struct LineIndex *read_tree_index_lines_(const char *content, unsigned size)
+{
+        assert(content);
+        if(!size)
+                return NULL;
+
+        // Count first, to allocate the index in one piece.  memchr() is as
+        // vectorised as the C library can make it.
+        const char *end = content + size, *p = content, *nl;
+        unsigned nline = 1;
+        size_t ndelta = 0;
+        while((nl = memchr(p, '\n', end - p)) && nl + 1 < end) {
+                ndelta += varint_len_(nl + 1 - p);
+                nline++;
+                p = nl + 1;
+        }
+
+        unsigned nblock = (nline + LINE_BLOCK - 1) / LINE_BLOCK;
+        struct LineIndex *li = MALLOC(sizeof *li +
+                nblock * sizeof *li->blockv + ndelta);
+        li->nline = nline;
+        li->nblock = nblock;
+        unsigned char *d = deltas_(li), *d0 = d;
+        p = content;
+        for(unsigned k = 0; k < nline; k++) {
+                if(k % LINE_BLOCK == 0) {
+                        li->blockv[k / LINE_BLOCK] = (LineBlock_){
+                                .offset = p - content,
+                                .delta = d - d0,
+                        };
+                }
+                if(k + 1 == nline)
+                        break;
+                nl = memchr(p, '\n', end - p);
+                d = put_varint_(d, nl + 1 - p);
+                p = nl + 1;
+        }
+        assert((size_t)(d - d0) == ndelta);
+        return li;
+}
+
+// See read_tree.h?file_node_nlines
+unsigned file_node_nlines(const FileNode *node)
+{
+        assert(node);
+        if(node->alias)
+                node = node->alias;
+        return node->lines ? node->lines->nline : 0;
+}
+
+// See read_tree.h?file_node_line
+const char *file_node_line(const FileNode *node, unsigned n, unsigned *plen)
+{
+        assert(node && plen);
+        if(node->alias)
+                node = node->alias;
+        const struct LineIndex *li = node->lines;
+        if(!li || !node->content || n >= li->nline)
+                return NULL;
+
+        const LineBlock_ *b = li->blockv + n / LINE_BLOCK;
+        const unsigned char *d = deltas_(li) + b->delta;
+        unsigned offset = b->offset, delta;
+        for(unsigned k = n % LINE_BLOCK; k; k--) {
+                d = get_varint_(d, &delta);
+                offset += delta;
+        }
+
+        if(n + 1 < li->nline) {
+                get_varint_(d, &delta);
+                *plen = delta - 1;
+        } else {
+                *plen = node->size - offset;
+                if(*plen && node->content[node->size - 1] == '\n')
+                        --*plen;
+        }
+        return node->content + offset;
+}
@@ -0,0 +1,74 @@
+// Packed content: file content kept compressed in memory (.pack_content).
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Packing needs zlib, like .decompress (see READTREE_ZLIB in readtree.c).
+#ifndef READTREE_ZLIB
+# ifdef __has_include
+#  if __has_include(<zlib.h>)
+#   define READTREE_ZLIB 1
+#  endif
+# endif
+#endif
+
+#if READTREE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "readtree.h"
+
+// Files smaller than this aren't worth packing.
+#define MIN_PACK 64
+
+struct PackedContent {
+        unsigned zsize;
+        unsigned char zdata[];
+};
+
+// See read_tree.h?read_tree_pack_
+struct PackedContent *read_tree_pack_(
+        const char *content,
+        unsigned size,
+        unsigned *pzsize)
+{
+#if READTREE_ZLIB
+        assert(content);
+        if(size < MIN_PACK)
+                return NULL;
+        uLongf zsize = compressBound(size);
+        struct PackedContent *pc = MALLOC(sizeof *pc + zsize);
+        int ret = compress2(pc->zdata, &zsize, (const Bytef*)content, size,
+                Z_BEST_SPEED);
+        if(ret == Z_MEM_ERROR)
+                PANIC_NOMEM();
+        if(ret != Z_OK || zsize > size - size / 8) {
+                free(pc);
+                return NULL;
+        }
+        pc->zsize = *pzsize = zsize;
+        struct PackedContent *shrunk = realloc(pc, sizeof *pc + zsize);
+        return shrunk ? shrunk : pc;
+#else
+        return NULL;
+#endif
+}
+
+// See read_tree.h?read_tree_unpack_
+void read_tree_unpack_(const FileNode *node, char *dest)
+{
+        assert(node && node->packed && dest);
+#if READTREE_ZLIB
+        uLongf size = node->size;
+        int ret = uncompress((Bytef*)dest, &size, node->packed->zdata,
+                node->packed->zsize);
+        if(ret == Z_MEM_ERROR)
+                PANIC_NOMEM();
+        if(ret != Z_OK || size != node->size)
+                PANIC("Packed content of %s is corrupt", node->full_path);
+        dest[size] = 0;
+#else
+        PANIC("Packed content without zlib");
+#endif
+}
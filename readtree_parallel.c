@@ -0,0 +1,239 @@
+// tree_parallel_for_each() and tree_reduce(): per-file work on many threads.
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "readtree.h"
+
+// What a file costs on top of its bytes, so that many small files don't all
+// end up in one chunk.
+#define FILE_WEIGHT 4096
+// How many chunks to aim for per thread, so that there is something to steal.
+#define CHUNKS_PER_THREAD 8
+
+// A range lo .. hi-1 of chunks, packed as hi << 32 | lo so that it can be
+// updated with one compare-and-swap.  Padded to keep workers' ranges in
+// separate cache lines.
+typedef struct {
+        uint64_t range;
+        char pad[56];
+} Worker_;
+
+typedef struct {
+        const TreeView *view;
+        unsigned *filev;     // indices in `view` of the files, in order
+        unsigned *chunkv;    // chunk k is filev[chunkv[k] .. chunkv[k+1]-1]
+        unsigned nchunk;
+        Worker_ *workerv;
+        unsigned nworker;
+        void (*run)(void *job, unsigned chunk, const FileNode *node);
+        void *job;
+} Sched_;
+
+static uint64_t pack_(uint32_t lo, uint32_t hi)
+{
+        return (uint64_t)hi << 32 | lo;
+}
+
+// Takes the first chunk of `w`'s own range; false if it is empty.
+static bool pop_(Worker_ *w, unsigned *pchunk)
+{
+        uint64_t r = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+        for(;;) {
+                uint32_t lo = r, hi = r >> 32;
+                if(lo >= hi)
+                        return false;
+                if(__atomic_compare_exchange_n(&w->range, &r,
+                                pack_(lo + 1, hi), false,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                        *pchunk = lo;
+                        return true;
+                }
+        }
+}
+
+// Takes the last half of the chunks of some other worker than `self` into
+// its own range; false if there are none left anywhere.
+static bool steal_(Sched_ *s, unsigned self)
+{
+        for(unsigned k = 1; k < s->nworker; k++) {
+                Worker_ *victim = s->workerv + (self + k) % s->nworker;
+                uint64_t r = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+                for(;;) {
+                        uint32_t lo = r, hi = r >> 32;
+                        if(lo >= hi)
+                                break;
+                        uint32_t mid = hi - (hi - lo + 1) / 2;
+                        if(!__atomic_compare_exchange_n(&victim->range, &r,
+                                        pack_(lo, mid), false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                                continue;
+                        // Only this thread adds to its own range, which is
+                        // empty, so thieves can't have changed it.
+                        __atomic_store_n(&s->workerv[self].range,
+                                pack_(mid, hi), __ATOMIC_RELEASE);
+                        return true;
+                }
+        }
+        return false;
+}
+
+static void worker_task_(void *vs, unsigned self)
+{
+        Sched_ *s = vs;
+        unsigned chunk;
+        do {
+                while(pop_(s->workerv + self, &chunk)) {
+                        for(unsigned j = s->chunkv[chunk];
+                            j < s->chunkv[chunk + 1]; j++) {
+                                const FileNode *node =
+                                        s->view->node[s->filev[j]];
+                                s->run(s->job, chunk, node);
+                        }
+                }
+        } while(steal_(s, self));
+}
+
+// Splits the files of `tree` into chunks, calls prepare(job, nchunk) if it is
+// set, then calls run(job, chunk, node) for each file on `nthreads` threads.
+// Returns the number of chunks.
+static unsigned schedule_(
+        const FileTree *tree,
+        unsigned nthreads,
+        void (*run)(void *job, unsigned chunk, const FileNode *node),
+        void *job,
+        void (*prepare)(void *job, unsigned nchunk))
+{
+        Sched_ s = {
+                .view = new_tree_view(tree),
+                .nworker = read_tree_nthreads_(nthreads),
+                .run = run,
+                .job = job,
+        };
+        const TreeView *v = s.view;
+
+        unsigned nfile = 0;
+        unsigned long long total = 0;
+        s.filev = MALLOC((v->n + 1) * sizeof *s.filev);
+        for(unsigned k = 0; k < v->n; k++) {
+                if(v->flags[k] & TREE_VIEW_DIR)
+                        continue;
+                s.filev[nfile++] = k;
+                total += v->size[k] + FILE_WEIGHT;
+        }
+
+        // Cut a chunk wherever the running total passes a multiple of the
+        // target, so a big file is a chunk to itself.
+        unsigned long long target =
+                total / ((unsigned long long)s.nworker * CHUNKS_PER_THREAD) + 1;
+        s.chunkv = MALLOC((nfile + 1) * sizeof *s.chunkv);
+        unsigned long long sum = 0, cut = target;
+        for(unsigned j = 0; j < nfile; j++) {
+                if(!j || sum >= cut) {
+                        s.chunkv[s.nchunk++] = j;
+                        while(cut <= sum)
+                                cut += target;
+                }
+                sum += v->size[s.filev[j]] + FILE_WEIGHT;
+        }
+        s.chunkv[s.nchunk] = nfile;
+
+        if(prepare)
+                prepare(job, s.nchunk);
+        if(s.nworker > s.nchunk)
+                s.nworker = s.nchunk ? s.nchunk : 1;
+        s.workerv = MALLOC(s.nworker * sizeof *s.workerv);
+        for(unsigned k = 0; k < s.nworker; k++) {
+                s.workerv[k].range = pack_(
+                        (unsigned long long)s.nchunk * k / s.nworker,
+                        (unsigned long long)s.nchunk * (k + 1) / s.nworker);
+        }
+        read_tree_run_batch_(s.nworker, s.nworker, worker_task_, &s);
+
+        free(s.workerv);
+        free(s.chunkv);
+        free(s.filev);
+        destroy_tree_view((TreeView*)s.view);
+        return s.nchunk;
+}
+
+// -- For each ---------------------------------------------------------
+
+typedef struct {
+        void (*fun)(const FileNode *node, void *arg);
+        void *arg;
+} ForEach_;
+
+static void for_each_run_(void *vjob, unsigned chunk, const FileNode *node)
+{
+        ForEach_ *job = vjob;
+        job->fun(node, job->arg);
+}
+
+// See read_tree.h?tree_parallel_for_each
+void tree_parallel_for_each(
+        const FileTree *tree,
+        unsigned nthreads,
+        void (*fun)(const FileNode *node, void *arg),
+        void *arg)
+{
+        if(!tree)
+                PANIC("'tree' is null");
+        if(!fun)
+                PANIC("'fun' is null");
+        ForEach_ job = { .fun = fun, .arg = arg };
+        schedule_(tree, nthreads, for_each_run_, &job, NULL);
+}
+
+// -- Reduce -----------------------------------------------------------
+
+typedef struct {
+        void (*fold)(void *part, const FileNode *node, void *arg);
+        const void *acc;
+        size_t acc_size;
+        char *parts;
+        void *arg;
+} Reduce_;
+
+static void reduce_prepare_(void *vjob, unsigned nchunk)
+{
+        Reduce_ *job = vjob;
+        job->parts = MALLOC(nchunk * job->acc_size + 1);
+        for(unsigned k = 0; k < nchunk; k++)
+                memcpy(job->parts + k * job->acc_size, job->acc, job->acc_size);
+}
+
+static void reduce_run_(void *vjob, unsigned chunk, const FileNode *node)
+{
+        Reduce_ *job = vjob;
+        job->fold(job->parts + chunk * job->acc_size, node, job->arg);
+}
+
+// See read_tree.h?tree_reduce
+void tree_reduce(
+        const FileTree *tree,
+        unsigned nthreads,
+        void (*fold)(void *part, const FileNode *node, void *arg),
+        void (*merge)(void *acc, const void *part, void *arg),
+        void *acc,
+        size_t acc_size,
+        void *arg)
+{
+        if(!tree)
+                PANIC("'tree' is null");
+        if(!fold || !merge || !acc)
+                PANIC("'fold', 'merge' and 'acc' must not be null");
+        Reduce_ job = {
+                .fold = fold,
+                .acc = acc,
+                .acc_size = acc_size,
+                .arg = arg,
+        };
+        unsigned nchunk = schedule_(tree, nthreads, reduce_run_, &job,
+                reduce_prepare_);
+        for(unsigned k = 0; k < nchunk; k++)
+                merge(acc, job.parts + k * acc_size, arg);
+        free(job.parts);
+}
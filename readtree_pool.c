@@ -0,0 +1,65 @@
+// A minimal thread pool shared by the parallel parts of libreadtree.
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "readtree.h"
+
+// The most threads started when asked for one per CPU.
+#define MAX_POOL_THREADS 64
+
+// Tasks are numbered 0..ntask-1 and handed out in order from one shared
+// counter, so whichever thread is free takes the next one.
+typedef struct {
+        void (*fun)(void *arg, unsigned k);
+        void *arg;
+        unsigned ntask;
+        unsigned next; // The next task to hand out.  Accessed atomically.
+} TaskBatch_;
+
+static void *run_tasks_(void *vbatch)
+{
+        TaskBatch_ *b = vbatch;
+        unsigned k;
+        while((k = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED))
+                        < b->ntask)
+                b->fun(b->arg, k);
+        return NULL;
+}
+
+// See read_tree.h?read_tree_nthreads_
+unsigned read_tree_nthreads_(unsigned nthreads)
+{
+        if(nthreads)
+                return nthreads;
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        return ncpu < 1 ? 1 : ncpu > MAX_POOL_THREADS ? MAX_POOL_THREADS : ncpu;
+}
+
+// See read_tree.h?read_tree_run_batch_
+void read_tree_run_batch_(
+        unsigned nthreads,
+        unsigned ntask,
+        void (*fun)(void *arg, unsigned k),
+        void *arg)
+{
+        TaskBatch_ b = { .fun = fun, .arg = arg, .ntask = ntask };
+        nthreads = read_tree_nthreads_(nthreads);
+        if(nthreads > ntask)
+                nthreads = ntask;
+        if(nthreads < 1)
+                nthreads = 1;
+
+        // If we can't start a thread, the ones we have will have to do.
+        pthread_t *threads = MALLOC(nthreads * sizeof *threads);
+        unsigned nstarted = 0;
+        while(nstarted + 1 < nthreads &&
+              !pthread_create(threads + nstarted, NULL, run_tasks_, &b))
+                nstarted++;
+
+        run_tasks_(&b);
+        for(unsigned k = 0; k < nstarted; k++)
+                pthread_join(threads[k], NULL);
+        free(threads);
+}
@@ -0,0 +1,483 @@
+// search_tree(): finding literals in the content of a whole tree.
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+#include "readtree.h"
+
+#define NOT_FOUND SIZE_MAX
+
+// See read_tree.h?read_tree_search_level_
+static unsigned max_level_ = 2;
+
+// Matches found so far, by one chunk of files or altogether.
+typedef struct {
+        unsigned n, alloc;
+        TreeMatch *v;
+} Found_;
+
+static void add_match_(Found_ *f, TreeMatch m)
+{
+        if(f->n == f->alloc) {
+                f->alloc = f->alloc ? 2 * f->alloc : 16;
+                f->v = realloc(f->v, f->alloc * sizeof *f->v);
+                if(!f->v)
+                        PANIC_NOMEM();
+        }
+        f->v[f->n++] = m;
+}
+
+// Returns the offset of the first match of `lit` (of `len` bytes) in the
+// `size` bytes at `s`, starting at or after `from`; or NOT_FOUND.  `s` must be
+// followed by a NUL, as FileNode.content is.
+typedef size_t Find_(const char *s, size_t size, size_t from,
+        const char *lit, size_t len);
+
+// True if `lit` is at `p`.  Since `lit` has no NUL in it, the comparison stops
+// at the NUL after the content if not before, so there is no need to check
+// how much content is left.
+static bool match_at_(const char *p, const char *lit)
+{
+        while(*lit && *p == *lit)
+                p++, lit++;
+        return !*lit;
+}
+
+static size_t find_c_(const char *s, size_t size, size_t from,
+        const char *lit, size_t len)
+{
+        while(from + len <= size) {
+                const char *p = memchr(s + from, lit[0], size - len + 1 - from);
+                if(!p)
+                        break;
+                if(match_at_(p + 1, lit + 1))
+                        return p - s;
+                from = p - s + 1;
+        }
+        return NOT_FOUND;
+}
+
+#if HAVE_X86_KERNELS
+// The vector kernels test a block of starting positions at once, comparing
+// the first and last bytes of the literal at each of them, and only look
+// closer at positions where both match.  A block is loaded only if all of it
+// lies within the content or its trailing NUL; what's left over is done by
+// find_c_().  Since neither end of a literal is a NUL, positions whose last
+// byte would be the NUL never match.
+
+__attribute__((target("sse2")))
+static size_t find_sse2_(const char *s, size_t size, size_t from,
+        const char *lit, size_t len)
+{
+        const __m128i first = _mm_set1_epi8(lit[0]);
+        const __m128i last = _mm_set1_epi8(lit[len - 1]);
+        for(; from + len - 1 + 16 <= size + 1; from += 16) {
+                const char *p = s + from;
+                __m128i a = _mm_loadu_si128((const __m128i*)p);
+                __m128i b = _mm_loadu_si128((const __m128i*)(p + len - 1));
+                unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+                        _mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+                for(; mask; mask &= mask - 1) {
+                        unsigned bit = __builtin_ctz(mask);
+                        if(match_at_(p + bit + 1, lit + 1))
+                                return from + bit;
+                }
+        }
+        return find_c_(s, size, from, lit, len);
+}
+
+__attribute__((target("avx2")))
+static size_t find_avx2_(const char *s, size_t size, size_t from,
+        const char *lit, size_t len)
+{
+        const __m256i first = _mm256_set1_epi8(lit[0]);
+        const __m256i last = _mm256_set1_epi8(lit[len - 1]);
+        for(; from + len - 1 + 32 <= size + 1; from += 32) {
+                const char *p = s + from;
+                __m256i a = _mm256_loadu_si256((const __m256i*)p);
+                __m256i b = _mm256_loadu_si256((const __m256i*)(p + len - 1));
+                unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(
+                        _mm256_cmpeq_epi8(a, first),
+                        _mm256_cmpeq_epi8(b, last)));
+                for(; mask; mask &= mask - 1) {
+                        unsigned bit = __builtin_ctz(mask);
+                        if(match_at_(p + bit + 1, lit + 1))
+                                return from + bit;
+                }
+        }
+        return find_c_(s, size, from, lit, len);
+}
+#endif
+
+// The best kernel this CPU has, within max_level_.
+static Find_ *choose_find_(void)
+{
+        unsigned level = __atomic_load_n(&max_level_, __ATOMIC_RELAXED);
+#if HAVE_X86_KERNELS
+        if(level >= 2 && __builtin_cpu_supports("avx2"))
+                return find_avx2_;
+        if(level >= 1 && __builtin_cpu_supports("sse2"))
+                return find_sse2_;
+#endif
+        (void)level;
+        return find_c_;
+}
+
+// -- Several literals at once -----------------------------------------
+//
+// With more than one literal, each file is scanned once for all of them, in
+// the manner of Teddy: the literals are shared out among 8 buckets, and for
+// each of the first two bytes of a literal, a table gives the buckets having
+// a literal with each byte value there.  A position is a candidate for the
+// buckets found under both of its bytes, and only the literals of those
+// buckets are compared there.  The vector kernels look the bytes up by low and
+// high nibble with PSHUFB, 16 or 32 positions at a time.
+
+#define NBUCKET 8
+
+typedef struct {
+        const char *const *literalv;
+        // How many leading bytes of each position are looked up: 2, or 1 if
+        // any literal is that short.
+        unsigned npos;
+        // The buckets with a literal having each byte value at position 0 and
+        // position 1.
+        uint8_t bytev[2][256];
+        // The same by low and by high nibble, for PSHUFB.  These let through
+        // more positions than bytev[], never fewer.
+        uint8_t lo[2][16], hi[2][16];
+        // Bucket b has the literals litv[startv[b]] .. litv[startv[b+1]-1].
+        unsigned startv[NBUCKET + 1];
+        unsigned *litv;
+} Multi_;
+
+typedef void FindAll_(const Multi_ *m, const char *s, size_t size,
+        size_t from, Found_ *found, const FileNode *node);
+
+static void init_multi_(Multi_ *m, const char *const *literalv,
+        const size_t *lenv, unsigned nliteral)
+{
+        *m = (Multi_){
+                .literalv = literalv,
+                .npos = 2,
+                .litv = MALLOC((nliteral + 1) * sizeof *m->litv),
+        };
+        for(unsigned k = 0; k < nliteral; k++) {
+                if(lenv[k] < 2)
+                        m->npos = 1;
+                m->startv[k % NBUCKET + 1]++;
+        }
+        for(unsigned b = 0; b < NBUCKET; b++)
+                m->startv[b + 1] += m->startv[b];
+        unsigned nextv[NBUCKET];
+        memcpy(nextv, m->startv, sizeof nextv);
+        for(unsigned k = 0; k < nliteral; k++) {
+                unsigned b = k % NBUCKET;
+                m->litv[nextv[b]++] = k;
+                for(unsigned j = 0; j < m->npos; j++) {
+                        uint8_t c = literalv[k][j];
+                        m->bytev[j][c] |= 1 << b;
+                        m->lo[j][c & 15] |= 1 << b;
+                        m->hi[j][c >> 4] |= 1 << b;
+                }
+        }
+}
+
+// Adds the matches at offset `at` of the literals in `buckets`, keeping those
+// at the same offset in order of literal.
+static void check_(const Multi_ *m, const char *s, size_t at, unsigned buckets,
+        Found_ *found, const FileNode *node)
+{
+        unsigned first = found->n;
+        for(; buckets; buckets &= buckets - 1) {
+                unsigned b = __builtin_ctz(buckets);
+                for(unsigned j = m->startv[b]; j < m->startv[b + 1]; j++) {
+                        unsigned k = m->litv[j];
+                        if(!match_at_(s + at, m->literalv[k]))
+                                continue;
+                        TreeMatch match = {
+                                .node = node,
+                                .offset = at,
+                                .literal = k,
+                        };
+                        add_match_(found, match);
+                        unsigned i = found->n - 1;
+                        for(; i > first && found->v[i - 1].literal > k; i--)
+                                found->v[i] = found->v[i - 1];
+                        found->v[i] = match;
+                }
+        }
+}
+
+// Adds every match in the `size` bytes at `s` from `from` on, in order of
+// offset.  Like Find_, `s` must be followed by a NUL: looking up the byte
+// after the last is fine, since no literal has a NUL.
+static void find_all_c_(const Multi_ *m, const char *s, size_t size,
+        size_t from, Found_ *found, const FileNode *node)
+{
+        const uint8_t *u = (const uint8_t*)s;
+        for(size_t at = from; at < size; at++) {
+                unsigned buckets = m->bytev[0][u[at]];
+                if(buckets && m->npos > 1)
+                        buckets &= m->bytev[1][u[at + 1]];
+                if(buckets)
+                        check_(m, s, at, buckets, found, node);
+        }
+}
+
+#if HAVE_X86_KERNELS
+// As with the single literal kernels, a block is loaded only if all of it lies
+// within the content or its trailing NUL.
+
+__attribute__((target("ssse3")))
+static void find_all_ssse3_(const Multi_ *m, const char *s, size_t size,
+        size_t from, Found_ *found, const FileNode *node)
+{
+        const __m128i nibble = _mm_set1_epi8(0x0f);
+        const __m128i zero = _mm_setzero_si128();
+        __m128i lov[2], hiv[2];
+        for(unsigned j = 0; j < 2; j++) {
+                lov[j] = _mm_loadu_si128((const __m128i*)m->lo[j]);
+                hiv[j] = _mm_loadu_si128((const __m128i*)m->hi[j]);
+        }
+        for(; from + m->npos - 1 + 16 <= size + 1; from += 16) {
+                __m128i c = _mm_set1_epi8(-1);
+                for(unsigned j = 0; j < m->npos; j++) {
+                        __m128i v = _mm_loadu_si128(
+                                (const __m128i*)(s + from + j));
+                        __m128i vl = _mm_and_si128(v, nibble);
+                        __m128i vh = _mm_and_si128(_mm_srli_epi16(v, 4),
+                                nibble);
+                        c = _mm_and_si128(c, _mm_and_si128(
+                                _mm_shuffle_epi8(lov[j], vl),
+                                _mm_shuffle_epi8(hiv[j], vh)));
+                }
+                unsigned mask = 0xffff &
+                        ~_mm_movemask_epi8(_mm_cmpeq_epi8(c, zero));
+                if(!mask)
+                        continue;
+                uint8_t bucketv[16];
+                _mm_storeu_si128((__m128i*)bucketv, c);
+                for(; mask; mask &= mask - 1) {
+                        unsigned bit = __builtin_ctz(mask);
+                        check_(m, s, from + bit, bucketv[bit], found, node);
+                }
+        }
+        find_all_c_(m, s, size, from, found, node);
+}
+
+__attribute__((target("avx2")))
+static void find_all_avx2_(const Multi_ *m, const char *s, size_t size,
+        size_t from, Found_ *found, const FileNode *node)
+{
+        const __m256i nibble = _mm256_set1_epi8(0x0f);
+        const __m256i zero = _mm256_setzero_si256();
+        __m256i lov[2], hiv[2];
+        for(unsigned j = 0; j < 2; j++) {
+                // PSHUFB looks up within each 128-bit half.
+                lov[j] = _mm256_broadcastsi128_si256(
+                        _mm_loadu_si128((const __m128i*)m->lo[j]));
+                hiv[j] = _mm256_broadcastsi128_si256(
+                        _mm_loadu_si128((const __m128i*)m->hi[j]));
+        }
+        for(; from + m->npos - 1 + 32 <= size + 1; from += 32) {
+                __m256i c = _mm256_set1_epi8(-1);
+                for(unsigned j = 0; j < m->npos; j++) {
+                        __m256i v = _mm256_loadu_si256(
+                                (const __m256i*)(s + from + j));
+                        __m256i vl = _mm256_and_si256(v, nibble);
+                        __m256i vh = _mm256_and_si256(
+                                _mm256_srli_epi16(v, 4), nibble);
+                        c = _mm256_and_si256(c, _mm256_and_si256(
+                                _mm256_shuffle_epi8(lov[j], vl),
+                                _mm256_shuffle_epi8(hiv[j], vh)));
+                }
+                unsigned mask = ~(unsigned)_mm256_movemask_epi8(
+                        _mm256_cmpeq_epi8(c, zero));
+                if(!mask)
+                        continue;
+                uint8_t bucketv[32];
+                _mm256_storeu_si256((__m256i*)bucketv, c);
+                for(; mask; mask &= mask - 1) {
+                        unsigned bit = __builtin_ctz(mask);
+                        check_(m, s, from + bit, bucketv[bit], found, node);
+                }
+        }
+        find_all_c_(m, s, size, from, found, node);
+}
+#endif
+
+// The best kernel for several literals this CPU has, within max_level_.
+static FindAll_ *choose_find_all_(void)
+{
+        unsigned level = __atomic_load_n(&max_level_, __ATOMIC_RELAXED);
+#if HAVE_X86_KERNELS
+        if(level >= 2 && __builtin_cpu_supports("avx2"))
+                return find_all_avx2_;
+        if(level >= 1 && __builtin_cpu_supports("ssse3"))
+                return find_all_ssse3_;
+#endif
+        (void)level;
+        return find_all_c_;
+}
+
+// -- Searching files --------------------------------------------------
+
+typedef struct {
+        const FileTree *tree;
+        const char *const *literalv;
+        size_t *lenv;
+        unsigned nliteral;
+        // For one literal.
+        Find_ *find;
+        // For more than one.
+        Multi_ multi;
+        FindAll_ *find_all;
+} Search_;
+
+// The content of `node` as one NUL-terminated buffer: its own if it has one,
+// else a copy of its chunks or its unpacked or loaded content (which the
+// caller frees), or NULL if released.
+static const char *whole_content_(const FileTree *tree, const FileNode *node,
+        size_t *psize, char **pcopy)
+{
+        const char *data;
+        unsigned size;
+        *pcopy = NULL;
+        if(node->alias)
+                node = node->alias;
+        // Packed and cached files are unpacked or loaded privately, so as not
+        // to fight over the tree's cache from every thread.
+        if(node->packed) {
+                *pcopy = MALLOC(node->size + 1);
+                read_tree_unpack_(node, *pcopy);
+                *psize = node->size;
+                return *pcopy;
+        }
+        if(node->cached) {
+                *psize = node->size;
+                return *pcopy = read_tree_load_(tree, node);
+        }
+
+        FileChunkIter it = file_chunks(node);
+        if(!file_chunk_next(&it, &data, &size))
+                return NULL;
+        *psize = size;
+        if(!it.next)
+                return data;
+
+        // Chunks: join them so that matches can span their boundaries.
+        size_t total = node->size;
+        char *copy = *pcopy = MALLOC(total + 1);
+        memcpy(copy, data, size);
+        for(total = size; file_chunk_next(&it, &data, &size); total += size)
+                memcpy(copy + total, data, size);
+        copy[total] = 0;
+        *psize = total;
+        return copy;
+}
+
+static void search_file_(void *vpart, const FileNode *node, void *vsearch)
+{
+        const Search_ *search = vsearch;
+        Found_ *found = vpart;
+        size_t size;
+        char *copy;
+        const char *s = whole_content_(search->tree, node, &size, &copy);
+        if(!s)
+                return;
+
+        if(search->nliteral == 1) {
+                const char *lit = search->literalv[0];
+                size_t len = search->lenv[0], at = 0;
+                while(NOT_FOUND != (at = search->find(s, size, at, lit, len))) {
+                        add_match_(found, (TreeMatch){
+                                .node = node,
+                                .offset = at++,
+                        });
+                }
+        } else {
+                search->find_all(&search->multi, s, size, 0, found, node);
+        }
+        free(copy);
+}
+
+static void merge_found_(void *vacc, const void *vpart, void *arg)
+{
+        Found_ *acc = vacc;
+        const Found_ *part = vpart;
+        if(!part->n)
+                return;
+        if(acc->n + part->n > acc->alloc) {
+                acc->alloc = acc->n + part->n;
+                acc->v = realloc(acc->v, acc->alloc * sizeof *acc->v);
+                if(!acc->v)
+                        PANIC_NOMEM();
+        }
+        memcpy(acc->v + acc->n, part->v, part->n * sizeof *part->v);
+        acc->n += part->n;
+        free(part->v);
+}
+
+// -- Public -----------------------------------------------------------
+
+// See read_tree.h?search_tree
+TreeMatches search_tree(
+        const FileTree *tree,
+        const char *const *literalv,
+        unsigned nliteral,
+        unsigned nthreads)
+{
+        if(!tree)
+                PANIC("'tree' is null");
+        if(nliteral && !literalv)
+                PANIC("'literalv' is null");
+
+        Search_ search = {
+                .tree = tree,
+                .literalv = literalv,
+                .lenv = MALLOC((nliteral + 1) * sizeof *search.lenv),
+                .nliteral = nliteral,
+                .find = choose_find_(),
+                .find_all = choose_find_all_(),
+        };
+        for(unsigned k = 0; k < nliteral; k++) {
+                if(!literalv[k] || !*literalv[k])
+                        PANIC("Literal %u to search for is null or empty", k);
+                search.lenv[k] = strlen(literalv[k]);
+        }
+        init_multi_(&search.multi, literalv, search.lenv, nliteral);
+
+        Found_ found = {0};
+        if(nliteral) {
+                tree_reduce(tree, nthreads, search_file_, merge_found_,
+                        &found, sizeof found, &search);
+        }
+        free(search.lenv);
+        free(search.multi.litv);
+        return (TreeMatches){ .n = found.n, .v = found.v };
+}
+
+// See read_tree.h?destroy_tree_matches
+void destroy_tree_matches(TreeMatches *matches)
+{
+        if(!matches)
+                return;
+        free(matches->v);
+        *matches = (TreeMatches){0};
+}
+
+// See read_tree.h?read_tree_search_level_
+unsigned read_tree_search_level_(unsigned level)
+{
+        return __atomic_exchange_n(&max_level_, level, __ATOMIC_RELAXED);
+}
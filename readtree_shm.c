@@ -0,0 +1,517 @@
+// Shared trees: a FileTree published in shared memory, with offsets for
+// pointers, for other processes to map read-only (see publish_tree()).
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "readtree.h"
+
+#define SHM_MAGIC "rtshm1"
+#define SHM_CONTROL_MAGIC "rtctl1"
+// How often attach_tree() follows a generation that is superseded before it
+// can open it.
+#define ATTACH_TRIES 16
+
+// The start of every segment holding a tree.  The nodes follow it.
+typedef struct {
+        char magic[8];
+        unsigned long long generation;
+        unsigned long long size;
+        unsigned nnode;
+        unsigned pad_;
+} ShmHeader_;
+
+// The segment called by the name a tree is published as, saying which
+// generation is current.  The tree itself is in "<name>.<generation>".
+struct SharedControl {
+        char magic[8];
+        unsigned long long generation;
+};
+
+// Where each part of the tree goes in the segment.
+typedef struct {
+        const FileTree *tree;
+        // The nodes in breadth-first order, so that the sub-nodes of each
+        // directory are together, and their number.
+        const FileNode **order;
+        unsigned n;
+        size_t size;
+} Layout_;
+
+static bool has_content_(const FileNode *node)
+{
+        return node->content || node->chunks || node->packed || node->cached;
+}
+
+// True if `node` is a directory, whether read, unexpanded or an alias.
+static bool is_dir_(const FileNode *node)
+{
+        if(node->alias)
+                node = node->alias;
+        return node->subv || node->unexpanded;
+}
+
+// The bytes fill_() puts after the nodes for `node`: its path, then the path
+// of its alias if it is a directory, or else its content.  The content of
+// files with several hard links is copied for each.
+static size_t strings_size_(const FileNode *node)
+{
+        size_t size = strlen(node->path) + 1;
+        const FileNode *data = node->alias ? node->alias : node;
+        if(node->alias && is_dir_(node))
+                size += strlen(node->alias->path) + 1;
+        else if(!is_dir_(node) && has_content_(data))
+                size += data->size + 1;
+        return size;
+}
+
+// Puts the nodes of l->tree in order, and works out the size of the segment.
+static void lay_out_(Layout_ *l)
+{
+        unsigned alloc = 64;
+        l->order = MALLOC(alloc * sizeof *l->order);
+        l->order[0] = &l->tree->root;
+        l->n = 1;
+        size_t strings = 0;
+        for(unsigned k = 0; k < l->n; k++) {
+                const FileNode *node = l->order[k];
+                strings += strings_size_(node);
+                if(l->n + node->nsub > alloc) {
+                        while(l->n + node->nsub > alloc)
+                                alloc *= 2;
+                        l->order = realloc(l->order, alloc * sizeof *l->order);
+                        if(!l->order)
+                                PANIC_NOMEM();
+                }
+                for(unsigned j = 0; j < node->nsub; j++)
+                        l->order[l->n++] = node->subv + j;
+        }
+        l->size = sizeof(ShmHeader_) + l->n * sizeof(SharedNode) + strings;
+}
+
+// Copies `len` bytes of `s` to *pat in `base`, returning their offset.
+static unsigned long long put_(char *base, size_t *pat, const void *s,
+        size_t len)
+{
+        unsigned long long off = *pat;
+        memcpy(base + off, s, len);
+        *pat += len;
+        return off;
+}
+
+// Copies the content of the file `node` (not an alias) to *pat in `base`,
+// setting *poff to its offset, or 0 if there is none.  Returns false if it
+// had to be loaded from disk again and couldn't be.
+static bool put_content_(const FileTree *tree, char *base, size_t *pat,
+        const FileNode *node, unsigned long long *poff)
+{
+        *poff = 0;
+        if(!has_content_(node))
+                return true;
+        char *dest = base + *pat;
+        if(node->packed) {
+                read_tree_unpack_(node, dest);
+        } else if(node->cached) {
+                // Loaded straight into the segment, leaving the cache be.
+                char *data = read_tree_load_(tree, node);
+                if(!data)
+                        return false;
+                memcpy(dest, data, node->size + 1);
+                free(data);
+        } else {
+                const char *data;
+                unsigned size;
+                FileChunkIter it = file_chunks(node);
+                for(char *d = dest; file_chunk_next(&it, &data, &size);
+                    d += size)
+                        memcpy(d, data, size);
+                dest[node->size] = 0;
+        }
+        *pat += node->size + 1;
+        *poff = dest - base;
+        return true;
+}
+
+// Writes the tree laid out by `l` into `base`, which is l->size bytes.
+// Returns NULL, or the file whose content couldn't be loaded again.
+static const FileNode *fill_(const Layout_ *l, char *base,
+        unsigned long long generation)
+{
+        ShmHeader_ *h = (ShmHeader_*)base;
+        *h = (ShmHeader_){
+                .magic = SHM_MAGIC,
+                .generation = generation,
+                .size = l->size,
+                .nnode = l->n,
+        };
+        SharedNode *nodev = (SharedNode*)(h + 1);
+        size_t at = sizeof *h + l->n * sizeof *nodev;
+        unsigned next = 1;
+        for(unsigned k = 0; k < l->n; k++) {
+                const FileNode *node = l->order[k];
+                const FileNode *data = node->alias ? node->alias : node;
+                bool dir = is_dir_(node);
+                SharedNode *s = nodev + k;
+                *s = (SharedNode){
+                        .size = node->size,
+                        .nsub = node->nsub,
+                        .subv = node->nsub ? next : 0,
+                        .hash = node->hash,
+                        .kind = node->kind,
+                        .flags = (dir ? TREE_VIEW_DIR : 0) |
+                                 (node->alias ? TREE_VIEW_ALIAS : 0) |
+                                 (node->unexpanded ?
+                                        TREE_VIEW_UNEXPANDED : 0),
+                };
+                next += node->nsub;
+                s->path = put_(base, &at, node->path, strlen(node->path) + 1);
+                if(node->alias && dir) {
+                        s->alias = put_(base, &at, node->alias->path,
+                                strlen(node->alias->path) + 1);
+                } else if(!dir &&
+                          !put_content_(l->tree, base, &at, data,
+                                        &s->content)) {
+                        return data;
+                }
+        }
+        assert(next == l->n);
+        assert(at <= l->size);
+        return NULL;
+}
+
+// Lays out `tree` and writes it into the new, empty segment `fd`.
+static Error *build_(const FileTree *tree, int fd, const char *name,
+        unsigned long long generation)
+{
+        Layout_ l = { .tree = tree };
+        lay_out_(&l);
+        Error *err = NULL;
+        char *base = MAP_FAILED;
+        if(ftruncate(fd, l.size) ||
+           (base = mmap(NULL, l.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        fd, 0)) == MAP_FAILED) {
+                err = IO_ERROR(name, errno, "Sizing shared tree");
+        } else {
+                const FileNode *stale = fill_(&l, base, generation);
+                if(stale) {
+                        err = IO_ERROR(stale->full_path, ESTALE,
+                                "Loading content for shared tree");
+                }
+                munmap(base, l.size);
+        }
+        free(l.order);
+        return err;
+}
+
+// The name of the segment holding generation `generation` of `name`.  Free
+// it with free().
+static char *segment_name_(const char *name, unsigned long long generation)
+{
+        char *seg;
+        if(0 > asprintf(&seg, "%s.%llu", name, generation))
+                PANIC_NOMEM();
+        return seg;
+}
+
+// Opens the control segment of `name`, creating it if need be and `create`,
+// and locks it against other publishers, setting *pst.  Returns -1 (with
+// errno set) if it can't.
+static int lock_control_(const char *name, bool create, struct stat *pst)
+{
+        for(;;) {
+                int fd = shm_open(name,
+                                  O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0),
+                                  0644);
+                if(fd < 0)
+                        return -1;
+                int ret;
+                do ret = flock(fd, LOCK_EX);
+                while(ret && errno == EINTR);
+                if(ret || fstat(fd, pst)) {
+                        int ern = errno;
+                        close(fd);
+                        errno = ern;
+                        return -1;
+                }
+                // Unless it was unpublished while waiting for the lock.
+                if(pst->st_nlink)
+                        return fd;
+                close(fd);
+        }
+}
+
+// Maps the control segment of `name` for writing, creating it if need be and
+// `create`, and locks it against other publishers: *pfd holds the lock until
+// it is closed.
+static Error *open_control_(const char *name, bool create,
+        struct SharedControl **pctl, int *pfd)
+{
+        struct stat st;
+        int fd = lock_control_(name, create, &st);
+        if(fd < 0)
+                return IO_ERROR(name, errno, "Opening shared tree");
+        Error *err = NULL;
+        void *p = MAP_FAILED;
+        if((st.st_size < (off_t)sizeof **pctl &&
+            ftruncate(fd, sizeof **pctl)) ||
+           (p = mmap(NULL, sizeof **pctl, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0)) == MAP_FAILED) {
+                err = IO_ERROR(name, errno, "Mapping shared tree");
+        } else if(!*(char*)p) {
+                // Just created, and all zeros.
+                memcpy(p, SHM_CONTROL_MAGIC, sizeof SHM_CONTROL_MAGIC);
+        } else if(memcmp(p, SHM_CONTROL_MAGIC, sizeof SHM_CONTROL_MAGIC)) {
+                err = ERROR("%s is not a shared tree", name);
+                munmap(p, sizeof **pctl);
+        }
+        if(err) {
+                close(fd);
+                return err;
+        }
+        *pctl = p;
+        *pfd = fd;
+        return NULL;
+}
+
+// Maps the tree segment `fd` into *shared, checking it is whole.
+static Error *map_(SharedTree *shared, int fd, const char *name)
+{
+        struct stat st;
+        if(fstat(fd, &st))
+                return IO_ERROR(name, errno, "Attaching shared tree");
+        size_t size = st.st_size;
+        if(size < sizeof(ShmHeader_))
+                return ERROR("%s is not a shared tree", name);
+        const char *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if(base == MAP_FAILED)
+                return IO_ERROR(name, errno, "Attaching shared tree");
+
+        const ShmHeader_ *h = (const ShmHeader_*)base;
+        const SharedNode *nodev = (const SharedNode*)(h + 1);
+        bool ok = !memcmp(h->magic, SHM_MAGIC, sizeof SHM_MAGIC) &&
+                  h->size == size && h->nnode &&
+                  h->nnode <= (size - sizeof *h) / sizeof *nodev;
+        // Check every offset, so that a reader can trust them.
+        for(unsigned k = 0; ok && k < h->nnode; k++) {
+                const SharedNode *s = nodev + k;
+                // Without sums, which could wrap around.
+                ok = s->path && s->path < size && s->alias < size &&
+                     (!s->content || (s->content < size &&
+                                      s->size < size - s->content)) &&
+                     (!s->nsub || (s->subv > k && s->subv <= h->nnode &&
+                                   s->nsub <= h->nnode - s->subv));
+        }
+        if(!ok || base[size - 1]) {
+                munmap((void*)base, size);
+                return ERROR("%s is not a whole shared tree", name);
+        }
+        *shared = (SharedTree){
+                .base = base,
+                .size = size,
+                .generation = h->generation,
+                .nnode = h->nnode,
+                .nodev = nodev,
+        };
+        return NULL;
+}
+
+// -- Public -----------------------------------------------------------
+
+// See read_tree.h?publish_tree
+Error *publish_tree(
+        const FileTree *tree,
+        const char *name,
+        unsigned long long *pgeneration)
+{
+        if(!tree || !name)
+                PANIC("'tree' or 'name' is null");
+        struct SharedControl *ctl;
+        int ctl_fd;
+        Error *err = open_control_(name, true, &ctl, &ctl_fd);
+        if(err)
+                return err;
+
+        unsigned long long old = __atomic_load_n(&ctl->generation,
+                                                  __ATOMIC_ACQUIRE);
+        unsigned long long generation = old + 1;
+        char *seg = segment_name_(name, generation);
+        // Read-only for everyone once it is made; this descriptor can still
+        // write.
+        int fd = shm_open(seg, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+        if(fd < 0 && errno == EEXIST) {
+                // Left by a publisher that died part way, since this one
+                // holds the lock.
+                shm_unlink(seg);
+                fd = shm_open(seg, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                              0444);
+        }
+        if(fd < 0) {
+                err = IO_ERROR(seg, errno, "Creating shared tree");
+        } else {
+                err = build_(tree, fd, seg, generation);
+                close(fd);
+        }
+
+        if(err) {
+                shm_unlink(seg);
+        } else {
+                // Only now can readers find the new generation; those
+                // still on the old one keep it until they detach.
+                __atomic_store_n(&ctl->generation, generation,
+                                 __ATOMIC_RELEASE);
+                if(old) {
+                        char *old_seg = segment_name_(name, old);
+                        shm_unlink(old_seg);
+                        free(old_seg);
+                }
+                if(pgeneration)
+                        *pgeneration = generation;
+        }
+        free(seg);
+        munmap(ctl, sizeof *ctl);
+        close(ctl_fd);
+        return err;
+}
+
+// See read_tree.h?publish_tree_fd
+Error *publish_tree_fd(const FileTree *tree, int *pfd)
+{
+        if(!tree || !pfd)
+                PANIC("'tree' or 'pfd' is null");
+        const char *name = tree->conf.root_path;
+        int fd = memfd_create("readtree", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if(fd < 0)
+                return IO_ERROR(name, errno, "Creating shared tree");
+        Error *err = build_(tree, fd, name, 0);
+        if(!err && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+                                          F_SEAL_WRITE | F_SEAL_SEAL))
+                err = IO_ERROR(name, errno, "Sealing shared tree");
+        if(err) {
+                close(fd);
+                return err;
+        }
+        *pfd = fd;
+        return NULL;
+}
+
+// See read_tree.h?unpublish_tree
+Error *unpublish_tree(const char *name)
+{
+        if(!name)
+                PANIC("'name' is null");
+        struct SharedControl *ctl;
+        int ctl_fd;
+        Error *err = open_control_(name, false, &ctl, &ctl_fd);
+        if(err)
+                return err;
+        unsigned long long generation =
+                __atomic_exchange_n(&ctl->generation, 0, __ATOMIC_ACQ_REL);
+        munmap(ctl, sizeof *ctl);
+        if(generation) {
+                char *seg = segment_name_(name, generation);
+                shm_unlink(seg);
+                free(seg);
+        }
+        if(shm_unlink(name))
+                err = IO_ERROR(name, errno, "Unpublishing shared tree");
+        close(ctl_fd);
+        return err;
+}
+
+// See read_tree.h?attach_tree
+Error *attach_tree(SharedTree *shared, const char *name)
+{
+        if(!shared || !name)
+                PANIC("'shared' or 'name' is null");
+        int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+        if(fd < 0)
+                return IO_ERROR(name, errno, "Attaching shared tree");
+        struct stat st;
+        const struct SharedControl *ctl = MAP_FAILED;
+        if(!fstat(fd, &st) && st.st_size >= (off_t)sizeof *ctl)
+                ctl = mmap(NULL, sizeof *ctl, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if(ctl == MAP_FAILED)
+                return ERROR("%s is not a shared tree", name);
+        if(memcmp(ctl->magic, SHM_CONTROL_MAGIC, sizeof SHM_CONTROL_MAGIC)) {
+                munmap((void*)ctl, sizeof *ctl);
+                return ERROR("%s is not a shared tree", name);
+        }
+
+        Error *err = NULL;
+        unsigned long long generation = 0;
+        for(unsigned tries = 0; ; tries++) {
+                generation = __atomic_load_n(&ctl->generation,
+                                             __ATOMIC_ACQUIRE);
+                if(!generation) {
+                        err = IO_ERROR(name, ENOENT, "Attaching shared tree");
+                        break;
+                }
+                char *seg = segment_name_(name, generation);
+                fd = shm_open(seg, O_RDONLY | O_CLOEXEC, 0);
+                if(fd >= 0) {
+                        err = map_(shared, fd, seg);
+                        close(fd);
+                        free(seg);
+                        break;
+                }
+                // Unlinked since, if a newer generation was published.
+                int ern = errno;
+                if(ern != ENOENT || tries == ATTACH_TRIES ||
+                   generation == __atomic_load_n(&ctl->generation,
+                                                 __ATOMIC_ACQUIRE)) {
+                        err = IO_ERROR(seg, ern, "Attaching shared tree");
+                        free(seg);
+                        break;
+                }
+                free(seg);
+        }
+        if(!err && shared->generation != generation) {
+                detach_tree(shared);
+                err = ERROR("%s: generation %llu holds the wrong tree", name,
+                        generation);
+        }
+        if(err) {
+                munmap((void*)ctl, sizeof *ctl);
+                return err;
+        }
+        shared->control = ctl;
+        return NULL;
+}
+
+// See read_tree.h?attach_tree_fd
+Error *attach_tree_fd(SharedTree *shared, int fd)
+{
+        if(!shared)
+                PANIC("'shared' is null");
+        return map_(shared, fd, "shared tree");
+}
+
+// See read_tree.h?shared_tree_stale
+bool shared_tree_stale(const SharedTree *shared)
+{
+        assert(shared);
+        return shared->control &&
+               __atomic_load_n(&shared->control->generation,
+                               __ATOMIC_ACQUIRE) != shared->generation;
+}
+
+// See read_tree.h?detach_tree
+void detach_tree(SharedTree *shared)
+{
+        if(!shared)
+                return;
+        if(shared->base)
+                munmap((void*)shared->base, shared->size);
+        if(shared->control)
+                munmap((void*)shared->control, sizeof *shared->control);
+        *shared = (SharedTree){0};
+}
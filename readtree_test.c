@@ -1,12 +1,18 @@
 #define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/mman.h>
 #include <sys/sysmacros.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <zlib.h>
 
 #include "elm0/0unit.h"
 #include "readtree.h"
@@ -305,6 +311,23 @@ fail:
         return 0;
 }
 
+// Checks that the content of `node`, however it is stored, equals `xcontent`.
+static int chk_content_equal(const char *xcontent, const FileNode *node)
+{
+        const char *data;
+        unsigned size, total = 0;
+        FileChunkIter it = file_chunks(node);
+        while(file_chunk_next(&it, &data, &size)) {
+                CHK(!memcmp(xcontent + total, data, size));
+                total += size;
+                CHK(total <= strlen(xcontent));
+        }
+        CHKV(total == strlen(xcontent) && total == node->size,
+                "Content of %s has %u bytes, expected %u",
+                node->path, total, (unsigned)strlen(xcontent));
+        PASS_QUIETLY();
+}
+
 // Integrity tests for a FileTree, i.e. is it valid, not is it right.
 static int chk_tree_ok(const ReadTreeConf *conf, const FileNode *tree)
 {
@@ -318,6 +341,36 @@ static int chk_tree_ok(const ReadTreeConf *conf, const FileNode *tree)
                 CHKV(tree->content[tree->size] == '\0',
                         "File content for %s was not nul-terminated",
                         tree->path);
+                CHK(!tree->chunks);
+        } else if(tree->chunks) {
+                CHK(conf->chunk_size);
+                CHK(!tree->subv);
+                unsigned total = 0;
+                for(const FileChunk *c = tree->chunks; c; c = c->next) {
+                        CHK(c->size == conf->chunk_size || !c->next);
+                        CHK(c->size);
+                        CHK(c->data[c->size] == '\0');
+                        total += c->size;
+                }
+                CHK(total == tree->size);
+                CHK(total > conf->chunk_size);
+        } else if(tree->cached) {
+                CHK(conf->content_budget);
+                CHK(!tree->subv && !tree->nsub && !tree->lines);
+        } else if(tree->packed) {
+                CHK(conf->pack_content);
+                CHK(!tree->subv && !tree->nsub && !tree->lines);
+        } else if(tree->alias) {
+                CHK(conf->symlinks == READ_TREE_SYMLINKS_SHARE ||
+                    conf->share_hardlinks);
+                CHK(!tree->subv && !tree->nsub && !tree->chunks);
+                CHK(tree->size == tree->alias->size);
+        } else if(tree->kind == FILE_KIND_BINARY) {
+                CHK(conf->binary == READ_TREE_BINARY_SKIP);
+                CHK(!tree->subv && !tree->nsub);
+        } else if(tree->unexpanded) {
+                CHK(conf->max_depth);
+                CHK(!tree->subv && !tree->nsub && !tree->size);
         } else {
                 //LOG_F(dbg_log, "'%s' is not a file", tree->path);
                 CHKV(tree->subv, "Node is neither a file or directory!");
@@ -328,6 +381,13 @@ static int chk_tree_ok(const ReadTreeConf *conf, const FileNode *tree)
                 CHK(!sentry.content);
         }
 
+        if(!conf->hash_content)
+                CHK(!tree->hash);
+        if(tree->subv || tree->unexpanded || tree->alias)
+                CHK(!tree->kind);
+        else
+                CHK(!tree->kind == !(conf->classify || conf->binary));
+
         for(unsigned k = 0; k < tree->nsub; k++) {
                 CHK(chk_tree_ok(conf, tree->subv + k));
         }
@@ -358,9 +418,9 @@ static TestFile *chk_tree_equal(const char *root, TestFile *tfp, FileNode *tree)
                 CHK_STR_EQ(tree->path, tf.path);
         }
         if(tf.content) {
-                CHK_STR_EQ(tf.content, tree->content);
+                CHK(chk_content_equal(tf.content, tree));
         } else {
-                CHK(!tree->content);
+                CHK(!tree->content && !tree->chunks);
         }
 
         FileNode *sub0 = tree->subv, *subE = sub0 + tree->nsub;
@@ -533,6 +593,27 @@ static TestCase tc_main_test_tree_ = {
         }
 };
 
+static TestCase tc_happy_chunked_ = {
+        .conf = {
+                .root_path ="test_chunked_tree",
+                .chunk_size = 64,
+        },
+        .files = (TestFile[]){
+                {"", NULL},
+                {"dir", NULL},
+                {"dir/more_bigger", more_bigger_text},
+                {"empty", ""},
+                {"exactly_one_chunk", "0123456789abcdef0123456789abcdef"
+                                      "0123456789abcdef0123456789abcdef"},
+                {"exactly_two_chunks", "0123456789abcdef0123456789abcdef"
+                                       "0123456789abcdef0123456789abcdef"
+                                       "0123456789abcdef0123456789abcdef"
+                                       "0123456789abcdef0123456789abcdef"},
+                {"small", "less than one chunk"},
+                {0},
+        }
+};
+
 static TestCase tc_drop_files_without_suffix_ = {
         .conf = (ReadTreeConf){
                 .root_path ="test_endings_filter",
@@ -606,6 +687,44 @@ static TestCase tc_sad_cyclic_link_ = {
         }
 };
 
+static TestCase tc_keep_going_ = {
+        .conf = (ReadTreeConf){
+                .root_path ="keep_going",
+                .keep_going = true,
+        },
+        .files = (TestFile[]){
+                {"", NULL},
+                {"a_file", "a"},
+                {"bad_broken_link", .symlink="non_existent_target",
+                        .expect_dropped = true},
+                {"bad_fifo", .explicit_mode = true, .mode = 0666 | S_IFIFO,
+                        .expect_dropped = true},
+                {"dir", NULL},
+                {"dir/bad_cyclic_link", .symlink="bad_cyclic_link",
+                        .expect_dropped = true},
+                {"dir/file", "f"},
+                {"z_file", "z"},
+                {0},
+        }
+};
+
+static TestCase tc_symlink_farm_ = {
+        .conf = (ReadTreeConf){
+                .root_path ="symlink_farm",
+                .symlinks = READ_TREE_SYMLINKS_SHARE,
+        },
+        .files = (TestFile[]){
+                {"", NULL},
+                {"a", NULL},
+                {"a/file", "in a"},
+                {"a/self", NULL, "."},
+                {"a/up", NULL, ".."},
+                {"b", NULL, "a"},
+                {"c_file_link", "in a", "a/file"},
+                {0},
+        }
+};
+
 static TestCase tc_happy_root_is_file_ = {
         .conf = (ReadTreeConf){ .root_path ="root_is_file", },
         .files = (TestFile[]){
@@ -641,6 +760,1960 @@ static TestCase tc_happy_root_untrimmed_root_ = {
 };
 
 
+// Releasing content leaves the node's size, and destroy_tree() still works.
+static int test_release_chunks(void)
+{
+        FileTree tree = {.conf = tc_happy_chunked_.conf};
+        CHK(make_test_tree(tree.conf.root_path, tc_happy_chunked_.files));
+        CHK(noerror(read_tree(&tree)));
+
+        FileNode *dir = tree.root.subv;
+        CHK_STR_EQ(dir->path, "dir");
+        FileNode *big = dir->subv;
+        CHK(big->chunks && !big->content);
+        CHK(big->size == strlen(more_bigger_text));
+
+        release_file_content(&tree, big);
+        CHK(!big->chunks && !big->content);
+        CHK(big->size == strlen(more_bigger_text));
+
+        FileNode *small = tree.root.subv + 4;
+        CHK_STR_EQ(small->path, "small");
+        CHK(small->content && !small->chunks);
+        release_file_content(&tree, small);
+        CHK(!small->chunks && !small->content);
+
+        destroy_tree(&tree);
+        PASS();
+}
+
+// Counts the directories, files and file-bytes in a tree.  The bytes of files
+// that are aliases of others aren't counted again.
+static void count_nodes(const FileNode *node, unsigned *pndir, unsigned *pnfile,
+        unsigned long long *pbytes)
+{
+        if(!node->subv) {
+                ++*pnfile;
+                if(!node->alias)
+                        *pbytes += node->size;
+                return;
+        }
+        ++*pndir;
+        for(unsigned k = 0; k < node->nsub; k++)
+                count_nodes(node->subv + k, pndir, pnfile, pbytes);
+}
+
+// read_tree() fills out ReadTreeStats consistently with what it read.
+static int test_stats(void)
+{
+        ReadTreeStats stats = { .opendir_count = 12345 };
+        FileTree tree = {
+                .conf = tc_main_test_tree_.conf,
+                .stats = &stats,
+        };
+        CHK(make_test_tree(tree.conf.root_path, tc_main_test_tree_.files));
+        CHK(noerror(read_tree(&tree)));
+
+        if(!stats.opendir_count) {
+                // libreadtree was built with READTREE_STATS=0.
+                CHK(!stats.open_count && !stats.accepted && !stats.max_depth);
+                destroy_tree(&tree);
+                return pass("%s (compiled out)", __func__);
+        }
+
+        unsigned ndir = 0, nfile = 0;
+        unsigned long long bytes = 0;
+        count_nodes(&tree.root, &ndir, &nfile, &bytes);
+
+        CHK(stats.opendir_count == ndir);
+        CHK(stats.open_count == nfile);
+        CHK(stats.bytes_read == bytes);
+        CHK(stats.read_count >= nfile);
+        CHK(stats.accepted == ndir + nfile);
+        CHK(stats.rejected == 2 * ndir); // '.' and '..'
+        CHK(stats.accept_count == stats.accepted);
+        CHK(stats.readdir_count == ndir + stats.accepted - 1 + stats.rejected);
+        CHK(stats.sort_count == ndir);
+        // The root, and at least the 5 symlinks.
+        CHK(stats.stat_count >= 6);
+        CHK(stats.max_depth == 3);
+        CHK(stats.read_ns && stats.opendir_ns && stats.stat_ns);
+
+        destroy_tree(&tree);
+        PASS();
+}
+
+#define CONCURRENT_THREADS 8
+#define CONCURRENT_ROUNDS 20
+
+// One reader thread for test_concurrent_read_tree().  Alternates reading the
+// main test tree with a misconfigured read_tree() that panics, each inside its
+// own TRY block.  Returns `parg` if every round did what it should.
+static void *concurrent_reader(void *parg)
+{
+        for(int k = 0; k < CONCURRENT_ROUNDS; k++) {
+                FileTree tree = {.conf = tc_main_test_tree_.conf};
+                bool want_panic = k % 2;
+                if(want_panic)
+                        tree.conf.root_path = NULL;
+
+                PanicReturn ret;
+                Error *err;
+                if((err = TRY(ret))) {
+                        destroy_error(err);
+                        if(!want_panic || panic_is_caught())
+                                return NULL;
+                        continue;
+                }
+                Error *rerr = read_tree(&tree);
+                NO_WORRIES(ret);
+                if(want_panic || panic_is_caught() || !noerror(rerr))
+                        return NULL;
+
+                TestFile *tf = tc_main_test_tree_.files;
+                int ok = chk_tree_ok(&tree.conf, &tree.root) &&
+                         chk_tree_equal(tree.conf.root_path, tf, &tree.root);
+                destroy_tree(&tree);
+                if(!ok)
+                        return NULL;
+        }
+        return parg;
+}
+
+// Concurrent read_tree() calls, some of which panic, don't disturb each other.
+static int test_concurrent_read_tree(void)
+{
+        CHK(make_test_tree(tc_main_test_tree_.conf.root_path,
+                tc_main_test_tree_.files));
+
+        pthread_t threads[CONCURRENT_THREADS];
+        int ids[CONCURRENT_THREADS];
+        for(int k = 0; k < CONCURRENT_THREADS; k++)
+                CHK(!pthread_create(threads + k, NULL, concurrent_reader,
+                        ids + k));
+        for(int k = 0; k < CONCURRENT_THREADS; k++) {
+                void *ret;
+                CHK(!pthread_join(threads[k], &ret));
+                CHKV(ret == ids + k, "reader thread %d failed", k);
+        }
+        CHK(!panic_is_caught());
+        PASS();
+}
+
+// In keep_going mode, bad nodes are left out and their errors are kept.
+static int test_keep_going(void)
+{
+        CHK(make_test_tree(tc_keep_going_.conf.root_path,
+                tc_keep_going_.files));
+
+        FileTree tree = {.conf = tc_keep_going_.conf};
+        CHK(noerror(read_tree(&tree)));
+        CHK(tree.nerror == 3);
+        // In any order: entries of one directory come in readdir() order.
+        const char *xpaths[] = {
+                "keep_going/bad_broken_link",
+                "keep_going/bad_fifo",
+                "keep_going/dir/bad_cyclic_link",
+        };
+        bool seen[3] = {0};
+        for(unsigned k = 0; k < tree.nerror; k++) {
+                char *zname = NULL;
+                CHK(sys_error(tree.errorv[k], &zname, NULL));
+                unsigned j = 0;
+                while(j < 3 && (seen[j] || strcmp(zname, xpaths[j])))
+                        j++;
+                CHKV(j < 3, "unexpected error for %s", zname);
+                seen[j] = true;
+                free(zname);
+        }
+        destroy_tree(&tree);
+        CHK(!tree.errorv && !tree.nerror);
+
+        // Without keep_going the same tree fails.
+        tree = (FileTree){.conf = tc_keep_going_.conf};
+        tree.conf.keep_going = false;
+        Error *err = read_tree(&tree);
+        CHK(err);
+        destroy_error(err);
+        CHK(!tree.errorv && !tree.nerror);
+        PASS();
+}
+
+// depth_limit fails trees that are too deep, or prunes them in keep_going mode.
+static int test_depth_limit(void)
+{
+        ReadTreeConf conf = tc_main_test_tree_.conf;
+        CHK(make_test_tree(conf.root_path, tc_main_test_tree_.files));
+
+        // The deepest files are dir0/dir01/deeper_file etc.
+        conf.depth_limit = 3;
+        CHK(chk_test_tree(tc_main_test_tree_.files, &conf));
+
+        conf.depth_limit = 2;
+        FileTree tree = {.conf = conf};
+        Error *err = read_tree(&tree);
+        CHK(err);
+        destroy_error(err);
+        CHK(!tree.root.subv);
+
+        conf.keep_going = true;
+        tree = (FileTree){.conf = conf};
+        CHK(noerror(read_tree(&tree)));
+        // dir0/dir01, link_to_dir0/dir01 and link_to_link/dir01.
+        CHK(tree.nerror == 3);
+        CHK_STR_EQ(tree.root.subv[0].path, "dir0");
+        CHK_STR_EQ(tree.root.subv[0].subv[0].path, "dir0/file0");
+        destroy_tree(&tree);
+        PASS();
+}
+
+#define DEEP_TREE_DEPTH 1000
+
+// Reads a very deep tree, also hashed, diffs the two and writes one as a
+// tar stream; run on a thread with a small stack.
+static void *read_deep_tree(void *parg)
+{
+        FileTree tree = {.conf = {.root_path = "deep_tree"}};
+        Error *err = read_tree(&tree);
+        if(!noerror(err))
+                return NULL;
+        FileTree hashed = {.conf = {
+                .root_path = "deep_tree",
+                .hash_content = true,
+        }};
+        err = read_tree(&hashed);
+        if(!noerror(err)) {
+                destroy_tree(&tree);
+                return NULL;
+        }
+
+        unsigned depth = 0;
+        const FileNode *node = &tree.root;
+        while(node->nsub == 1) {
+                node = node->subv;
+                depth++;
+        }
+        bool ok = depth == DEEP_TREE_DEPTH && !node->subv &&
+                  !strcmp(node->content, "bottom") &&
+                  hashed.root.hash && !diff_trees(&tree, &hashed, NULL, NULL);
+        int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        ok = ok && fd >= 0 && noerror(write_tree_tar(&tree, fd));
+        if(fd >= 0)
+                close(fd);
+        destroy_tree(&tree);
+        destroy_tree(&hashed);
+        return ok ? parg : NULL;
+}
+
+// Reading, hashing, diffing, writing and destroying a deep tree needs little
+// stack.
+static int test_deep_tree(void)
+{
+        char path[2 * DEEP_TREE_DEPTH + 32] = "deep_tree";
+        size_t len = strlen(path);
+        CHK(noerror(make_dir_(path)));
+        for(unsigned k = 1; k < DEEP_TREE_DEPTH; k++) {
+                memcpy(path + len, "/d", 3);
+                len += 2;
+                CHK(noerror(make_dir_(path)));
+        }
+        memcpy(path + len, "/bottom", 8);
+        TestFile bottom = {path + strlen("deep_tree/"), "bottom"};
+        CHK(noerror(make_test_file_("deep_tree", &bottom)));
+
+        pthread_attr_t attr;
+        pthread_t thread;
+        void *ret;
+        CHK(!pthread_attr_init(&attr));
+        CHK(!pthread_attr_setstacksize(&attr, 64 << 10));
+        CHK(!pthread_create(&thread, &attr, read_deep_tree, path));
+        CHK(!pthread_join(thread, &ret));
+        pthread_attr_destroy(&attr);
+        CHK(ret == path);
+        PASS();
+}
+
+// Breadth-first reading gives the same tree, and the same stats.
+static int test_breadth_first(void)
+{
+        ReadTreeConf conf = tc_main_test_tree_.conf;
+        CHK(make_test_tree(conf.root_path, tc_main_test_tree_.files));
+        conf.breadth_first = true;
+        CHK(chk_test_tree(tc_main_test_tree_.files, &conf));
+
+        ReadTreeStats dfs, bfs;
+        FileTree tree = {.conf = tc_main_test_tree_.conf, .stats = &dfs};
+        CHK(noerror(read_tree(&tree)));
+        destroy_tree(&tree);
+        tree = (FileTree){.conf = conf, .stats = &bfs};
+        CHK(noerror(read_tree(&tree)));
+        destroy_tree(&tree);
+        CHK(dfs.opendir_count == bfs.opendir_count);
+        CHK(dfs.bytes_read == bfs.bytes_read);
+        CHK(dfs.max_depth == bfs.max_depth);
+
+        // With aliases, the node met first is the one read: depth-first that
+        // is a/b/c, breadth-first the symlink to it nearer the root.
+        TestFile share_files[] = {
+                {"", NULL},
+                {"a", NULL},
+                {"a/b", NULL},
+                {"a/b/c", NULL},
+                {"a/b/c/f", "f"},
+                {"z_link", NULL, "a/b/c"},
+                {0},
+        };
+        CHK(make_test_tree("bfs_share", share_files));
+        FileTree dtree = {.conf = {
+                .root_path = "bfs_share",
+                .symlinks = READ_TREE_SYMLINKS_SHARE,
+        }};
+        FileTree btree = dtree;
+        btree.conf.breadth_first = true;
+        CHK(noerror(read_tree(&dtree)));
+        CHK(noerror(read_tree(&btree)));
+        CHK(chk_tree_ok(&dtree.conf, &dtree.root));
+        CHK(chk_tree_ok(&btree.conf, &btree.root));
+        const FileNode *dc = dtree.root.subv[0].subv[0].subv;
+        const FileNode *dz = dtree.root.subv + 1;
+        const FileNode *bc = btree.root.subv[0].subv[0].subv;
+        const FileNode *bz = btree.root.subv + 1;
+        CHK_STR_EQ(dc->path, "a/b/c");
+        CHK_STR_EQ(bz->path, "z_link");
+        CHK(!dc->alias && dc->nsub == 1 && dz->alias == dc);
+        CHK(!bz->alias && bz->nsub == 1 && bc->alias == bz);
+        CHK_STR_EQ(bz->subv[0].content, "f");
+        destroy_tree(&dtree);
+        destroy_tree(&btree);
+        PASS();
+}
+
+// Expands every unexpanded directory under `node`, one level at a time.
+static int chk_expand_all(FileTree *tree, FileNode *node)
+{
+        CHK(noerror(expand_node(tree, node, 1)));
+        CHK(!node->unexpanded);
+        for(unsigned k = 0; k < node->nsub; k++)
+                CHK(chk_expand_all(tree, node->subv + k));
+        PASS_QUIETLY();
+}
+
+// max_depth leaves deep directories unexpanded, until expand_node().
+static int test_max_depth(void)
+{
+        TestFile *tf = tc_main_test_tree_.files;
+        FileTree tree = {.conf = tc_main_test_tree_.conf};
+        CHK(make_test_tree(tree.conf.root_path, tf));
+        tree.conf.max_depth = 1;
+        tree.conf.breadth_first = true;
+        CHK(noerror(read_tree(&tree)));
+        CHK(chk_tree_ok(&tree.conf, &tree.root));
+
+        FileNode *dir0 = tree.root.subv;
+        CHK_STR_EQ(dir0->path, "dir0");
+        CHK(dir0->unexpanded);
+        FileNode *file0 = tree.root.subv + 3;
+        CHK_STR_EQ(file0->path, "file0");
+        CHK_STR_EQ(file0->content, "content of file 0");
+
+        CHK(noerror(expand_node(&tree, dir0, 1)));
+        CHK(!dir0->unexpanded && dir0->nsub == 4);
+        CHK_STR_EQ(dir0->subv[0].path, "dir0/dir01");
+        CHK(dir0->subv[0].unexpanded);
+        CHK_STR_EQ(dir0->subv[1].content, "content of file 0.0");
+        CHK(chk_tree_ok(&tree.conf, &tree.root));
+
+        CHK(noerror(expand_node(&tree, dir0->subv, 0)));
+        CHK(chk_expand_all(&tree, &tree.root));
+        CHK(chk_tree_ok(&tree.conf, &tree.root));
+        CHK(chk_tree_equal(tree.conf.root_path, tf, &tree.root));
+        destroy_tree(&tree);
+
+        // A directory that is gone by the time it is expanded is an error,
+        // and stays as it was.
+        TestFile gone_files[] = {
+                {"", NULL},
+                {"gone", NULL},
+                {"gone/f", "f"},
+                {0},
+        };
+        CHK(make_test_tree("expand_gone", gone_files));
+        tree = (FileTree){ .conf = {
+                .root_path = "expand_gone",
+                .max_depth = 1,
+        } };
+        CHK(noerror(read_tree(&tree)));
+        FileNode *gone = tree.root.subv;
+        CHK(gone->unexpanded);
+        CHK(!unlink("expand_gone/gone/f") && !rmdir("expand_gone/gone"));
+        Error *err = expand_node(&tree, gone, 0);
+        CHK(err);
+        destroy_error(err);
+        CHK(gone->unexpanded && !gone->subv);
+        CHK_STR_EQ(gone->full_path, "expand_gone/gone");
+        destroy_tree(&tree);
+        PASS();
+}
+
+// Reads the symlink farm with `links` into *tree and checks the basics.
+static int chk_read_symlink_farm(FileTree *tree, ReadTreeSymlinks links)
+{
+        *tree = (FileTree){.conf = tc_symlink_farm_.conf};
+        tree->conf.symlinks = links;
+        CHK(noerror(read_tree(tree)));
+        CHK(chk_tree_ok(&tree->conf, &tree->root));
+        CHK_STR_EQ(tree->root.subv[0].path, "a");
+        CHK_STR_EQ(tree->root.subv[0].subv[0].content, "in a");
+        PASS_QUIETLY();
+}
+
+// Each ReadTreeSymlinks policy, and that SHARE makes aliases, even for cycles.
+static int test_symlink_policies(void)
+{
+        CHK(make_test_tree(tc_symlink_farm_.conf.root_path,
+                tc_symlink_farm_.files));
+        FileTree tree;
+
+        CHK(chk_read_symlink_farm(&tree, READ_TREE_SYMLINKS_SKIP));
+        CHK(tree.root.nsub == 1 && tree.root.subv[0].nsub == 1);
+        destroy_tree(&tree);
+
+        CHK(chk_read_symlink_farm(&tree, READ_TREE_SYMLINKS_FILES));
+        CHK(tree.root.nsub == 2 && tree.root.subv[0].nsub == 1);
+        CHK_STR_EQ(tree.root.subv[1].content, "in a");
+        destroy_tree(&tree);
+
+        CHK(chk_read_symlink_farm(&tree, READ_TREE_SYMLINKS_SHARE));
+        FileNode *root = &tree.root, *a = root->subv;
+        CHK(root->nsub == 3 && a->nsub == 3);
+        CHK_STR_EQ(a->subv[1].path, "a/self");
+        CHK(a->subv[1].alias == a);
+        CHK_STR_EQ(a->subv[2].path, "a/up");
+        CHK(a->subv[2].alias == root);
+        CHK_STR_EQ(root->subv[1].path, "b");
+        CHK(root->subv[1].alias == a);
+        CHK_STR_EQ(root->subv[2].content, "in a");
+        destroy_tree(&tree);
+
+        // Aliases still work across expand_node().
+        tree = (FileTree){.conf = tc_symlink_farm_.conf};
+        tree.conf.max_depth = 1;
+        CHK(noerror(read_tree(&tree)));
+        root = &tree.root;
+        a = root->subv;
+        CHK(a->unexpanded && root->subv[1].alias == a);
+        CHK(noerror(expand_node(&tree, a, 0)));
+        CHK(a->nsub == 3 && a->subv[1].alias == a);
+        CHK(a->subv[2].alias == root);
+        destroy_tree(&tree);
+
+        // Directories reached through several links are read once.
+        tree = (FileTree){.conf = tc_main_test_tree_.conf};
+        tree.conf.symlinks = READ_TREE_SYMLINKS_SHARE;
+        CHK(noerror(read_tree(&tree)));
+        CHK(chk_tree_ok(&tree.conf, &tree.root));
+        FileNode *subv = tree.root.subv;
+        CHK_STR_EQ(subv[6].path, "link_to_dir0");
+        CHK(subv[6].alias == subv);
+        CHK_STR_EQ(subv[7].path, "link_to_dir01");
+        CHK(subv[7].alias == subv[0].subv);
+        CHK_STR_EQ(subv[9].path, "link_to_link");
+        CHK(subv[9].alias == subv);
+        destroy_tree(&tree);
+        PASS();
+}
+
+// Makes `link` a hard link to `target`, unless it already is one.
+static Error *make_hardlink_(const char *target, const char *link)
+{
+        if(!linkat(AT_FDCWD, target, AT_FDCWD, link, 0) || errno == EEXIST)
+                return NULL;
+        return IO_ERROR(link, errno, "Creating readtree test-case hard link");
+}
+
+// Makes the "hardlinks" tree: "a", "b" and "sub/c" are one file, "d" another.
+static int make_hardlink_tree(void)
+{
+        TestFile files[] = {
+                {"", NULL},
+                {"a", "linked content"},
+                {"d", "different content"},
+                {"sub", NULL},
+                {0},
+        };
+        CHK(make_test_tree("hardlinks", files));
+        CHK(noerror(make_hardlink_("hardlinks/a", "hardlinks/b")));
+        CHK(noerror(make_hardlink_("hardlinks/a", "hardlinks/sub/c")));
+        PASS_QUIETLY();
+}
+
+// share_hardlinks reads each hard-linked file once.
+static int test_share_hardlinks(void)
+{
+        CHK(make_hardlink_tree());
+
+        ReadTreeStats stats;
+        FileTree tree = {
+                .conf = {
+                        .root_path = "hardlinks",
+                        .share_hardlinks = true,
+                },
+                .stats = &stats,
+        };
+        CHK(noerror(read_tree(&tree)));
+        CHK(chk_tree_ok(&tree.conf, &tree.root));
+        FileNode *a = tree.root.subv, *b = a + 1, *c = a[3].subv;
+        CHK_STR_EQ(b->path, "b");
+        CHK_STR_EQ(c->path, "sub/c");
+        CHK(!a->alias && b->alias == a && c->alias == a);
+        CHK(!b->content && b->size == a->size);
+        CHK(chk_content_equal("linked content", c));
+        CHK(!a[2].alias);
+        if(stats.open_count) {
+                CHK(stats.bytes_read == strlen("linked content") +
+                        strlen("different content"));
+        }
+        destroy_tree(&tree);
+
+        tree = (FileTree){.conf = {.root_path = "hardlinks"}};
+        CHK(noerror(read_tree(&tree)));
+        CHK(!tree.root.subv[1].alias);
+        CHK_STR_EQ(tree.root.subv[1].content, "linked content");
+        destroy_tree(&tree);
+        PASS();
+}
+
+// one_file_system leaves directories on other file-systems unexpanded.
+static int test_one_file_system(void)
+{
+        TestFile files[] = {
+                {"", NULL},
+                {"dir", NULL},
+                {"dir/file", "f"},
+                {"proc_sys", NULL, "/proc/sys"},
+                {0},
+        };
+        struct stat here, there;
+        CHK(!stat(".", &here));
+        if(stat("/proc/sys", &there) || here.st_dev == there.st_dev)
+                return pass("%s (no /proc/sys to test with)", __func__);
+        CHK(make_test_tree("one_file_system", files));
+
+        FileTree tree = {
+                .conf = {
+                        .root_path = "one_file_system",
+                        .one_file_system = true,
+                },
+        };
+        CHK(noerror(read_tree(&tree)));
+        FileNode *dir = tree.root.subv, *proc_sys = dir + 1;
+        CHK(!dir->unexpanded && dir->nsub == 1);
+        CHK_STR_EQ(proc_sys->path, "proc_sys");
+        CHK(proc_sys->unexpanded && !proc_sys->subv);
+        destroy_tree(&tree);
+        PASS();
+}
+
+// Runs out of memory instead of accepting anything.
+static bool accept_nomem_(const void *arg, const char *path, const char *name)
+{
+        PANIC_NOMEM();
+        return false;
+}
+
+// read_forest() reads every root, and shares those inside others.
+static int test_forest(void)
+{
+        CHK(make_test_tree(tc_main_test_tree_.conf.root_path,
+                tc_main_test_tree_.files));
+        CHK(make_test_tree(tc_happy_chunked_.conf.root_path,
+                tc_happy_chunked_.files));
+
+        ReadTreeConf confv[] = {
+                tc_main_test_tree_.conf,
+                { .root_path = "test_dir_tree/dir0/dir01" },
+                { .root_path = "test_dir_tree/" },
+                tc_happy_chunked_.conf,
+                // Not shared, because the configuration is different.
+                { .root_path = "test_dir_tree/later_dir", .chunk_size = 64 },
+                tc_sad_root_does_not_exist_.conf,
+                // Shared via the real path, i.e. as "dir0".
+                { .root_path = "test_dir_tree/link_to_dir0" },
+        };
+        unsigned nconf = sizeof confv / sizeof confv[0];
+
+        FileForest forest = { .nthreads = 3 };
+        Error *err = read_forest(&forest, confv, nconf);
+        CHK(err);
+        destroy_error(err);
+        CHK(forest.nroot == nconf);
+        ForestRoot *rv = forest.rootv;
+
+        CHK(rv[0].shared_with < 0 && rv[0].root == &rv[0].tree.root);
+        CHK(chk_tree_ok(&rv[0].tree.conf, rv[0].root));
+        CHK(chk_tree_equal(confv[0].root_path, tc_main_test_tree_.files,
+                &rv[0].tree.root));
+
+        CHK(rv[1].shared_with == 0);
+        CHK_STR_EQ(rv[1].root->path, "dir0/dir01");
+        CHK(rv[1].root->nsub == 1);
+
+        CHK(rv[2].shared_with == 0 && rv[2].root == rv[0].root);
+
+        CHK(rv[3].shared_with < 0 && !rv[3].error);
+        CHK(chk_tree_equal(confv[3].root_path, tc_happy_chunked_.files,
+                &rv[3].tree.root));
+
+        CHK(rv[4].shared_with < 0 && rv[4].root == &rv[4].tree.root);
+        CHK_STR_EQ(rv[4].root->path, "");
+        CHK(rv[4].root->nsub == 3);
+
+        CHK(rv[5].shared_with < 0 && rv[5].error && !rv[5].root);
+
+        CHK(rv[6].shared_with == 0);
+        CHK_STR_EQ(rv[6].root->path, "dir0");
+
+        destroy_forest(&forest);
+        CHK(!forest.rootv && !forest.nroot);
+
+        // A depth_limit counts from each root, so nested roots with one
+        // are read by themselves.
+        ReadTreeConf limitv[] = {
+                { .root_path = "test_dir_tree", .depth_limit = 20 },
+                { .root_path = "test_dir_tree/dir0", .depth_limit = 20 },
+        };
+        forest = (FileForest){ .nthreads = 2 };
+        CHK(noerror(read_forest(&forest, limitv, 2)));
+        CHK(forest.rootv[1].shared_with < 0);
+        CHK(forest.rootv[1].root == &forest.rootv[1].tree.root);
+        destroy_forest(&forest);
+
+        // A root that is an alias in the other tree, since that met it first
+        // through a symlink, is read by itself.
+        TestFile alias_files[] = {
+                {"", NULL},
+                {"a_link", NULL, "z_real"},
+                {"z_real", NULL},
+                {"z_real/f", "f"},
+                {0},
+        };
+        CHK(make_test_tree("forest_alias", alias_files));
+        ReadTreeConf aliasv[] = {
+                { .root_path = "forest_alias",
+                  .symlinks = READ_TREE_SYMLINKS_SHARE },
+                { .root_path = "forest_alias/z_real",
+                  .symlinks = READ_TREE_SYMLINKS_SHARE },
+        };
+        forest = (FileForest){ .nthreads = 2 };
+        CHK(noerror(read_forest(&forest, aliasv, 2)));
+        rv = forest.rootv;
+        CHK(rv[0].root->subv[1].alias);
+        CHK(rv[1].shared_with < 0 && rv[1].root == &rv[1].tree.root);
+        CHK(rv[1].root->nsub == 1 && !rv[1].root->alias);
+        CHK_STR_EQ(rv[1].root->subv[0].content, "f");
+        destroy_forest(&forest);
+
+        // Running out of memory on a reading thread panics on this one, even
+        // though the Error belonged to a thread that is gone.
+        ReadTreeConf nomemv[] = {
+                { .root_path = confv[0].root_path,
+                  .accept_file = { accept_nomem_ } },
+                { .root_path = confv[3].root_path,
+                  .accept_file = { accept_nomem_ } },
+        };
+        forest = (FileForest){ .nthreads = 2 };
+        bool nomem = false;
+        PanicReturn ret;
+        if((err = TRY(ret))) {
+                nomem = err->type == nomem_error_type;
+                destroy_error(err);
+        } else {
+                destroy_error(read_forest(&forest, nomemv, 2));
+                NO_WORRIES(ret);
+        }
+        CHK(nomem);
+        CHK(!panic_is_caught());
+        PASS();
+}
+
+// A TreeView has the same shape as its tree.
+static int chk_view_matches(const TreeView *v, const FileTree *tree)
+{
+        unsigned ndir = 0, nfile = 0;
+        unsigned long long bytes = 0;
+        count_nodes(&tree->root, &ndir, &nfile, &bytes);
+        CHK(v->n == ndir + nfile);
+        CHK(v->node[0] == &tree->root && v->end[0] == v->n);
+        CHK_STR_EQ(v->names + v->name[0], "");
+        for(unsigned k = 1; k < v->n; k++) {
+                unsigned p = v->parent[k];
+                CHK(p < k && k < v->end[k] && v->end[k] <= v->end[p]);
+                CHK(v->node[k] >= v->node[p]->subv &&
+                    v->node[k] < v->node[p]->subv + v->node[p]->nsub);
+                CHK(v->size[k] == v->node[k]->size);
+                const FileNode *data = v->node[k]->alias ?
+                        v->node[k]->alias : v->node[k];
+                CHK(v->content[k] == data->content);
+                CHK(!(v->flags[k] & TREE_VIEW_DIR) == !v->node[k]->subv);
+        }
+
+        unsigned j = 0;
+        TREE_VIEW_FOR_CHILDREN(v, 0, k) {
+                const FileNode *sub = tree->root.subv + j++;
+                CHK(v->node[k] == sub);
+                CHK_STR_EQ(v->names + v->name[k], strrchr(sub->path, '/') ?
+                        strrchr(sub->path, '/') + 1 : sub->path);
+        }
+        CHK(j == tree->root.nsub);
+
+        for(unsigned nthreads = 1; nthreads <= 4; nthreads += 3) {
+                TreeViewTotals t = tree_view_totals(v, nthreads);
+                CHK(t.files == nfile && t.dirs == ndir && t.bytes == bytes);
+                for(unsigned k = 0; k < v->n; k++)
+                        CHK(v->size[k] <= v->size[t.largest]);
+                for(unsigned k = 0; k < t.largest; k++)
+                        CHK(v->size[k] < v->size[t.largest]);
+        }
+        PASS_QUIETLY();
+}
+
+#define WIDE_TREE_FILES 3000
+
+// Makes "wide_tree", a directory of WIDE_TREE_FILES files of 0 to 12 bytes.
+static int make_wide_tree(void)
+{
+        CHK(noerror(make_dir_("wide_tree")));
+        const char *xs = "xxxxxxxxxxxx";
+        for(unsigned k = 0; k < WIDE_TREE_FILES; k++) {
+                char name[16];
+                snprintf(name, sizeof name, "f%04u", k);
+                TestFile tf = {name, xs + (k * 7) % 13};
+                CHK(noerror(make_test_file_("wide_tree", &tf)));
+        }
+        PASS_QUIETLY();
+}
+
+// new_tree_view() flattens a tree, and tree_view_totals() adds it up.
+static int test_tree_view(void)
+{
+        FileTree tree = { .conf = tc_main_test_tree_.conf };
+        CHK(make_test_tree(tree.conf.root_path, tc_main_test_tree_.files));
+        CHK(noerror(read_tree(&tree)));
+        TreeView *v = new_tree_view(&tree);
+        CHK(chk_view_matches(v, &tree));
+        destroy_tree_view(v);
+        destroy_tree(&tree);
+
+        // Enough nodes to split into several ranges.
+        CHK(make_wide_tree());
+        tree = (FileTree){ .conf = { .root_path = "wide_tree" } };
+        CHK(noerror(read_tree(&tree)));
+        v = new_tree_view(&tree);
+        CHK(v->n == WIDE_TREE_FILES + 1);
+        CHK(chk_view_matches(v, &tree));
+        destroy_tree_view(v);
+        destroy_tree(&tree);
+
+        // Hard links have their bytes counted once.
+        CHK(make_hardlink_tree());
+        tree = (FileTree){ .conf = {
+                .root_path = "hardlinks",
+                .share_hardlinks = true,
+        } };
+        CHK(noerror(read_tree(&tree)));
+        v = new_tree_view(&tree);
+        CHK(chk_view_matches(v, &tree));
+        TreeViewTotals t = tree_view_totals(v, 1);
+        CHK(t.files == 4);
+        CHK(t.bytes == strlen("linked content") + strlen("different content"));
+        destroy_tree_view(v);
+        destroy_tree(&tree);
+        PASS();
+}
+
+// What test_tree_reduce() folds up: files in tree order, and their bytes.
+typedef struct {
+        unsigned nfile;
+        unsigned long long bytes, xs;
+        const char *first, *last;
+        bool in_order;
+} FoldTest_;
+
+static void fold_test_(void *vpart, const FileNode *node, void *arg)
+{
+        FoldTest_ *part = vpart;
+        const char *data;
+        unsigned size;
+        FileChunkIter it = file_chunks(node);
+        while(file_chunk_next(&it, &data, &size)) {
+                for(unsigned k = 0; k < size; k++)
+                        part->xs += data[k] == 'x';
+        }
+        if(part->last && strcmp(part->last, node->path) >= 0)
+                part->in_order = false;
+        if(!part->first)
+                part->first = node->path;
+        part->last = node->path;
+        part->nfile++;
+        part->bytes += node->size;
+}
+
+static void merge_fold_test_(void *vacc, const void *vpart, void *arg)
+{
+        FoldTest_ *acc = vacc;
+        const FoldTest_ *part = vpart;
+        if(!part->nfile)
+                return;
+        if(!part->in_order ||
+           (acc->last && strcmp(acc->last, part->first) >= 0))
+                acc->in_order = false;
+        if(!acc->first)
+                acc->first = part->first;
+        acc->last = part->last;
+        acc->nfile += part->nfile;
+        acc->bytes += part->bytes;
+        acc->xs += part->xs;
+}
+
+static void count_file_(const FileNode *node, void *arg)
+{
+        unsigned long long *bytes = arg;
+        __atomic_fetch_add(bytes, node->size + (1ULL << 32),
+                __ATOMIC_RELAXED);
+}
+
+// tree_reduce() and tree_parallel_for_each() visit each file once.
+static int test_tree_reduce(void)
+{
+        CHK(make_wide_tree());
+        FileTree tree = { .conf = { .root_path = "wide_tree" } };
+        CHK(noerror(read_tree(&tree)));
+        unsigned long long xbytes = 0;
+        for(unsigned k = 0; k < WIDE_TREE_FILES; k++)
+                xbytes += 12 - (k * 7) % 13;
+
+        for(unsigned nthreads = 0; nthreads <= 5; nthreads++) {
+                FoldTest_ acc = { .in_order = true };
+                tree_reduce(&tree, nthreads, fold_test_, merge_fold_test_,
+                        &acc, sizeof acc, NULL);
+                CHK(acc.nfile == WIDE_TREE_FILES);
+                CHK(acc.in_order);
+                CHK(acc.bytes == xbytes && acc.xs == xbytes);
+                CHK_STR_EQ(acc.first, "f0000");
+
+                unsigned long long counts = 0;
+                tree_parallel_for_each(&tree, nthreads, count_file_, &counts);
+                CHK(counts >> 32 == WIDE_TREE_FILES);
+                CHK((counts & 0xffffffff) == xbytes);
+        }
+        destroy_tree(&tree);
+
+        // A tree that is just a file.
+        tree = (FileTree){ .conf = tc_happy_root_is_file_.conf };
+        CHK(make_test_tree(tree.conf.root_path, tc_happy_root_is_file_.files));
+        CHK(noerror(read_tree(&tree)));
+        FoldTest_ acc = { .in_order = true };
+        tree_reduce(&tree, 3, fold_test_, merge_fold_test_, &acc, sizeof acc,
+                NULL);
+        CHK(acc.nfile == 1 && acc.bytes == tree.root.size);
+        destroy_tree(&tree);
+        PASS();
+}
+
+// Appends to `m` every match of `literalv` in `node` and below, the slow way.
+static void naive_search(const FileNode *node, const char *const *literalv,
+        unsigned nliteral, TreeMatches *m)
+{
+        for(unsigned k = 0; node->subv && k < node->nsub; k++)
+                naive_search(node->subv + k, literalv, nliteral, m);
+        if(node->subv || node->unexpanded)
+                return;
+
+        char *s = malloc(node->size + 1);
+        size_t n = 0;
+        const char *data;
+        unsigned size;
+        FileChunkIter it = file_chunks(node);
+        while(file_chunk_next(&it, &data, &size)) {
+                memcpy(s + n, data, size);
+                n += size;
+        }
+        for(size_t off = 0; off < n; off++) {
+                for(unsigned k = 0; k < nliteral; k++) {
+                        size_t len = strlen(literalv[k]);
+                        if(off + len > n || memcmp(s + off, literalv[k], len))
+                                continue;
+                        m->v = realloc(m->v, (m->n + 1) * sizeof *m->v);
+                        m->v[m->n++] = (TreeMatch){ node, off, k };
+                }
+        }
+        free(s);
+}
+
+#define SEARCH_TREE_FILES 60
+
+// search_tree() finds what a naive search does, with every kernel.
+static int test_search_tree(void)
+{
+        // One with a 1-byte literal, one with more literals than buckets,
+        // and one literal alone.
+        static const char *const literalvv[][11] = {
+                { "abba", "a", "bbbbb", "ba",
+                  "abababababababababababababababababababab" },
+                { "ab", "bc", "ca", "abc", "cab", "bca", "aa", "bb", "cc",
+                  "abab", "cbacb" },
+                { "abc" },
+        };
+        const unsigned nliteralv[] = { 5, 11, 1 };
+
+        CHK(noerror(make_dir_("search_tree")));
+        unsigned seed = 42;
+        for(unsigned k = 0; k < SEARCH_TREE_FILES; k++) {
+                char name[16], content[400];
+                unsigned len = rand_r(&seed) % sizeof content;
+                for(unsigned j = 0; j < len; j++) {
+                        // Runs of "ab" now and then, for the long literal.
+                        content[j] = k % 7 == 3 ? "ab"[j % 2] :
+                                     "abc"[rand_r(&seed) % 3];
+                }
+                content[len] = 0;
+                snprintf(name, sizeof name, "f%02u", k);
+                TestFile tf = {name, content};
+                CHK(noerror(make_test_file_("search_tree", &tf)));
+        }
+
+        for(unsigned run = 0; run < 6; run++) {
+                const char *const *literalv = literalvv[run / 2];
+                unsigned nliteral = nliteralv[run / 2];
+                FileTree tree = { .conf = {
+                        .root_path = "search_tree",
+                        .chunk_size = run % 2 ? 64 : 0,
+                } };
+                CHK(noerror(read_tree(&tree)));
+                TreeMatches expect = {0};
+                naive_search(&tree.root, literalv, nliteral, &expect);
+                CHK(expect.n > 100);
+
+                for(unsigned level = 0; level <= 2; level++) {
+                        unsigned old = read_tree_search_level_(level);
+                        TreeMatches got = search_tree(&tree, literalv,
+                                nliteral, 1 + 3 * (level & 1));
+                        read_tree_search_level_(old);
+                        CHK(got.n == expect.n);
+                        for(unsigned k = 0; k < got.n; k++) {
+                                const TreeMatch *g = got.v + k;
+                                const TreeMatch *x = expect.v + k;
+                                CHK(g->node == x->node);
+                                CHK(g->offset == x->offset);
+                                CHK(g->literal == x->literal);
+                        }
+                        destroy_tree_matches(&got);
+                        CHK(!got.v && !got.n);
+                }
+                free(expect.v);
+                destroy_tree(&tree);
+        }
+        PASS();
+}
+
+// The lines of `node` from file_node_line() are those of its content.
+static int chk_lines(const FileNode *node)
+{
+        const char *p = node->content, *end = p + node->size;
+        unsigned n = 0, len;
+        const char *line;
+        for(; p < end; n++) {
+                const char *nl = memchr(p, '\n', end - p);
+                size_t xlen = (nl ? nl : end) - p;
+                CHK(line = file_node_line(node, n, &len));
+                CHKV(line == p && len == xlen, "%s line %u", node->path, n);
+                p += xlen + 1;
+        }
+        CHK(file_node_nlines(node) == n);
+        CHK(!file_node_line(node, n, &len));
+        PASS_QUIETLY();
+}
+
+// .index_lines gives random access to lines.
+static int test_line_index(void)
+{
+        char many[20000];
+        size_t n = 0;
+        for(unsigned k = 0; n + 400 < sizeof many; k++) {
+                // Mostly short lines, some empty, some needing 2-byte deltas.
+                unsigned len = k % 17 == 5 ? 300 : k % 11 == 3 ? 0 : k % 50;
+                memset(many + n, 'a' + k % 26, len);
+                n += len;
+                many[n++] = '\n';
+        }
+        many[n] = 0;
+        TestFile files[] = {
+                {"", NULL},
+                {"empty", ""},
+                {"just_newline", "\n"},
+                {"many", many},
+                {"one_line", "one line"},
+                {"two_lines", "a\nb"},
+                {"two_terminated", "a\n\n"},
+                {0},
+        };
+        CHK(make_test_tree("line_index", files));
+
+        FileTree tree = { .conf = {
+                .root_path = "line_index",
+                .index_lines = true,
+        } };
+        CHK(noerror(read_tree(&tree)));
+        const FileNode *sub = tree.root.subv;
+        for(unsigned k = 0; k < tree.root.nsub; k++)
+                CHK(chk_lines(sub + k));
+        CHK(file_node_nlines(sub + 0) == 0);
+        CHK(file_node_nlines(sub + 1) == 1);
+        CHK(file_node_nlines(sub + 2) > 100);
+        CHK(file_node_nlines(sub + 3) == 1);
+        CHK(file_node_nlines(sub + 4) == 2);
+        CHK(file_node_nlines(sub + 5) == 2);
+        unsigned len;
+        CHK_STR_EQ(file_node_line(sub + 4, 1, &len), "b");
+        release_file_content(&tree, tree.root.subv + 2);
+        CHK(!file_node_line(sub + 2, 0, &len) && !file_node_nlines(sub + 2));
+        destroy_tree(&tree);
+
+        // Only files that fit in one chunk have an index.
+        tree.conf = (ReadTreeConf){
+                .root_path = "line_index",
+                .index_lines = true,
+                .chunk_size = 1024,
+        };
+        CHK(noerror(read_tree(&tree)));
+        sub = tree.root.subv;
+        CHK(!file_node_nlines(sub + 2) && sub[2].chunks);
+        CHK(chk_lines(sub + 4));
+        destroy_tree(&tree);
+
+        // And without .index_lines, none do.
+        tree.conf = (ReadTreeConf){ .root_path = "line_index" };
+        CHK(noerror(read_tree(&tree)));
+        CHK(!file_node_nlines(tree.root.subv + 4));
+        destroy_tree(&tree);
+        PASS();
+}
+
+// Writes `size` bytes of `data` to `path`, which may contain NULs.
+static Error *write_bytes_(const char *path, const char *data, size_t size)
+{
+        FILE *f = fopen(path, "w");
+        if(!f)
+                return IO_ERROR(path, errno, "Creating readtree test file");
+        if(size != fwrite(data, 1, size, f)) {
+                fclose(f);
+                return IO_ERROR(path, errno, "Writing readtree test file");
+        }
+        if(fclose(f))
+                return IO_ERROR(path, errno, "Closing readtree test file");
+        return NULL;
+}
+
+#define BIG_TEXT_SIZE 100000
+
+// .classify tells text, bad UTF-8 and binary files apart, and .binary drops or
+// skips the binary ones.
+static int test_classify(void)
+{
+        static char big[BIG_TEXT_SIZE + 1];
+        // "a☃" over and over, so that reads and chunks split characters.
+        for(unsigned k = 0; k + 4 <= BIG_TEXT_SIZE; k += 4)
+                memcpy(big + k, "a\xe2\x98\x83", 4);
+        TestFile files[] = {
+                {"", NULL},
+                {"ascii", "plain old text\n"},
+                {"big_utf8", big},
+                {"controls", "\x01\x02\x03 not really text \x04\x05\x06"},
+                {"empty", ""},
+                {"latin1", "caf\xe9"},
+                {"overlong", "\xc0\xaf"},
+                {"surrogate", "\xed\xa0\x80"},
+                {"truncated", "ok \xe2\x98"},
+                {"utf8", "h\xc3\xa9llo \xe2\x98\x83 \xf0\x9f\x98\x80\t\x1b[0m"},
+                {0},
+        };
+        CHK(make_test_tree("classify", files));
+        static char nul[BIG_TEXT_SIZE];
+        memcpy(nul, "\x7f" "ELF", 4);
+        CHK(noerror(write_bytes_("classify/binary", nul, sizeof nul)));
+        const FileKind xkind[] = {
+                FILE_KIND_TEXT, FILE_KIND_TEXT, FILE_KIND_BINARY,
+                FILE_KIND_BINARY, FILE_KIND_TEXT, FILE_KIND_BAD_UTF8,
+                FILE_KIND_BAD_UTF8, FILE_KIND_BAD_UTF8, FILE_KIND_BAD_UTF8,
+                FILE_KIND_TEXT,
+        };
+        unsigned nfile = sizeof xkind / sizeof xkind[0];
+
+        for(unsigned chunk_size = 0; chunk_size <= 7; chunk_size += 7) {
+                FileTree tree = { .conf = {
+                        .root_path = "classify",
+                        .classify = true,
+                        .chunk_size = chunk_size,
+                } };
+                CHK(noerror(read_tree(&tree)));
+                CHK(chk_tree_ok(&tree.conf, &tree.root));
+                CHK(tree.root.nsub == nfile);
+                for(unsigned k = 0; k < nfile; k++) {
+                        CHKV(tree.root.subv[k].kind == xkind[k], "%s is %d",
+                                tree.root.subv[k].path,
+                                tree.root.subv[k].kind);
+                }
+                destroy_tree(&tree);
+        }
+
+        ReadTreeStats stats;
+        FileTree tree = {
+                .conf = {
+                        .root_path = "classify",
+                        .binary = READ_TREE_BINARY_SKIP,
+                },
+                .stats = &stats,
+        };
+        CHK(noerror(read_tree(&tree)));
+        CHK(chk_tree_ok(&tree.conf, &tree.root));
+        const FileNode *bin = tree.root.subv + 2;
+        CHK_STR_EQ(bin->path, "binary");
+        CHK(bin->kind == FILE_KIND_BINARY && !bin->content);
+        CHK(bin->size == BIG_TEXT_SIZE);
+        if(stats.open_count)
+                CHK(stats.bytes_read < 2 * BIG_TEXT_SIZE);
+        destroy_tree(&tree);
+
+        tree.conf = (ReadTreeConf){
+                .root_path = "classify",
+                .binary = READ_TREE_BINARY_DROP,
+        };
+        CHK(noerror(read_tree(&tree)));
+        CHK(chk_tree_ok(&tree.conf, &tree.root));
+        CHK(tree.root.nsub == nfile - 2);
+        for(unsigned k = 0; k < tree.root.nsub; k++)
+                CHK(tree.root.subv[k].kind != FILE_KIND_BINARY);
+        if(stats.open_count)
+                CHK(stats.rejected >= 2);
+        destroy_tree(&tree);
+
+        // A binary root is skipped rather than dropped.
+        tree.conf = (ReadTreeConf){
+                .root_path = "classify/binary",
+                .binary = READ_TREE_BINARY_DROP,
+        };
+        CHK(noerror(read_tree(&tree)));
+        CHK(tree.root.kind == FILE_KIND_BINARY && !tree.root.content);
+        destroy_tree(&tree);
+        PASS();
+}
+
+// Writes `content` gzipped to `path`, or appends it as another gzip member.
+static Error *write_gzip_(const char *path, const char *content, bool append)
+{
+        gzFile gz = gzopen(path, append ? "ab" : "wb");
+        if(!gz)
+                return IO_ERROR(path, errno, "Creating readtree test gzip");
+        size_t n = strlen(content);
+        if(n && (int)n != gzwrite(gz, content, n)) {
+                gzclose(gz);
+                return ERROR("Writing readtree test gzip %s", path);
+        }
+        if(Z_OK != gzclose(gz))
+                return ERROR("Closing readtree test gzip %s", path);
+        return NULL;
+}
+
+static unsigned disk_size_(const char *path)
+{
+        struct stat st;
+        return stat(path, &st) ? 0 : st.st_size;
+}
+
+// .decompress inflates gzipped files as they are read.
+static int test_decompress(void)
+{
+        static char big[BIG_TEXT_SIZE * 3 + 1];
+        for(unsigned k = 0; k < sizeof big - 1; k++)
+                big[k] = "line of text\n"[k % 13] + (k / 1000) % 5;
+        TestFile files[] = {
+                {"", NULL},
+                {"plain", "not compressed"},
+                {0},
+        };
+        CHK(make_test_tree("decompress", files));
+        CHK(noerror(write_gzip_("decompress/big.gz", big, false)));
+        CHK(noerror(write_gzip_("decompress/empty.gz", "", false)));
+        CHK(noerror(write_gzip_("decompress/multi.gz", "hello ", false)));
+        CHK(noerror(write_gzip_("decompress/multi.gz", "world", true)));
+        CHK(noerror(write_bytes_("decompress/zbad.gz", "\x1f\x8b junk", 7)));
+
+        for(unsigned chunk_size = 0; chunk_size <= 4096; chunk_size += 4096) {
+                FileTree tree = { .conf = {
+                        .root_path = "decompress",
+                        .decompress = true,
+                        .keep_going = true,
+                        .classify = true,
+                        .chunk_size = chunk_size,
+                } };
+                CHK(noerror(read_tree(&tree)));
+                CHK(chk_tree_ok(&tree.conf, &tree.root));
+                CHK(tree.nerror == 1);
+                CHK(tree.root.nsub == 4);
+                const FileNode *sub = tree.root.subv;
+                CHK_STR_EQ(sub[0].path, "big.gz");
+                CHK(chk_content_equal(big, sub + 0));
+                CHK(sub[0].disk_size == disk_size_("decompress/big.gz"));
+                CHK(sub[0].disk_size < sub[0].size);
+                CHK(sub[0].kind == FILE_KIND_TEXT);
+                CHK(chk_content_equal("", sub + 1));
+                CHK(sub[1].disk_size);
+                CHK(chk_content_equal("hello world", sub + 2));
+                CHK(chk_content_equal("not compressed", sub + 3));
+                CHK(!sub[3].disk_size);
+                destroy_tree(&tree);
+        }
+
+        FileTree tree = { .conf = { .root_path = "decompress/multi.gz" } };
+        CHK(noerror(read_tree(&tree)));
+        CHK(tree.root.size == disk_size_("decompress/multi.gz"));
+        CHK(!tree.root.disk_size);
+        destroy_tree(&tree);
+
+        tree.conf = (ReadTreeConf){
+                .root_path = "decompress/zbad.gz",
+                .decompress = true,
+        };
+        Error *err = read_tree(&tree);
+        CHK(err);
+        destroy_error(err);
+        PASS();
+}
+
+#define PACK_TREE_FILES 12
+
+static int test_pack_content(void)
+{
+        static char big[BIG_TEXT_SIZE + 1], noise[1000];
+        for(unsigned k = 0; k < BIG_TEXT_SIZE; k++)
+                big[k] = "line of text\n"[k % 13] + (k / 1000) % 5;
+        unsigned seed = 7;
+        for(unsigned k = 0; k < sizeof noise - 1; k++)
+                noise[k] = 1 + rand_r(&seed) % 255;
+        TestFile files[] = {
+                {"", NULL},
+                {"big", big},
+                {"noise", noise},
+                {"tiny", "too small to pack"},
+                {0},
+        };
+        CHK(make_test_tree("pack", files));
+        char content[PACK_TREE_FILES][200];
+        for(unsigned k = 0; k < PACK_TREE_FILES; k++) {
+                char name[16];
+                snprintf(name, sizeof name, "f%02u", k);
+                for(unsigned j = 0; j < sizeof content[k] - 1; j++)
+                        content[k][j] = "abcd"[(j / 10 + k) % 4];
+                content[k][sizeof content[k] - 1] = 0;
+                TestFile tf = {name, content[k]};
+                CHK(noerror(make_test_file_("pack", &tf)));
+        }
+
+        ReadTreeStats stats = {0};
+        FileTree tree = {
+                .conf = {
+                        .root_path = "pack",
+                        .pack_content = true,
+                        .unpacked_cache = 2,
+                        .index_lines = true,
+                },
+                .stats = &stats,
+        };
+        CHK(noerror(read_tree(&tree)));
+        CHK(chk_tree_ok(&tree.conf, &tree.root));
+        CHK(tree.root.nsub == 3 + PACK_TREE_FILES);
+        const FileNode *sub = tree.root.subv;
+        CHK_STR_EQ(sub[0].path, "big");
+        CHK(sub[0].packed && !sub[0].content && !sub[0].lines);
+        const char *unpacked = file_content(&tree, sub + 0);
+        CHK(unpacked && !strcmp(unpacked, big));
+        CHK(file_content(&tree, sub + 0) == unpacked);
+        file_content_done(&tree, sub + 0);
+        file_content_done(&tree, sub + 0);
+
+        const FileNode *noise_node = sub + 1 + PACK_TREE_FILES;
+        const FileNode *tiny = noise_node + 1;
+        CHK_STR_EQ(noise_node->path, "noise");
+        CHK(!noise_node->packed && noise_node->lines);
+        CHK(file_content(&tree, noise_node) == noise_node->content);
+        file_content_done(&tree, noise_node);
+        CHK(!tiny->packed);
+        CHK_STR_EQ(file_content(&tree, tiny), "too small to pack");
+
+        // Many more files than the cache holds, twice over.
+        for(unsigned k = 0; k < 2 * PACK_TREE_FILES; k++) {
+                const char *xcontent = content[k % PACK_TREE_FILES];
+                const FileNode *f = sub + 1 + k % PACK_TREE_FILES;
+                CHK(f->packed);
+                unpacked = file_content(&tree, f);
+                CHK_STR_EQ(unpacked, xcontent);
+                file_content_done(&tree, f);
+        }
+
+        CHK(stats.pack_count == 3 + PACK_TREE_FILES);
+        CHK(stats.pack_in_bytes == BIG_TEXT_SIZE +
+                PACK_TREE_FILES * (sizeof content[0] - 1));
+        CHK(stats.pack_out_bytes * 3 < stats.pack_in_bytes);
+
+        // search_tree() looks through packed files too.
+        const char *literalv[] = {"text", "aab"};
+        TreeMatches matches = search_tree(&tree, literalv, 2, 0);
+        unsigned nbig = 0, nsmall = 0;
+        for(unsigned k = 0; k < matches.n; k++) {
+                if(matches.v[k].node == sub + 0)
+                        nbig += matches.v[k].literal == 0;
+                else
+                        nsmall += matches.v[k].literal == 1;
+        }
+        unsigned xbig = 0, xsmall = 0;
+        for(const char *p = big; (p = strstr(p, "text")); p++)
+                xbig++;
+        for(unsigned k = 0; k < PACK_TREE_FILES; k++) {
+                for(const char *p = content[k]; (p = strstr(p, "aab")); p++)
+                        xsmall++;
+        }
+        CHK(xbig && nbig == xbig);
+        CHK(xsmall && nsmall == xsmall);
+        destroy_tree_matches(&matches);
+
+        release_file_content(&tree, (FileNode*)sub);
+        CHK(!sub[0].packed && !file_content(&tree, sub + 0));
+        destroy_tree(&tree);
+        CHK(!tree.cache);
+        PASS();
+}
+
+#define BUDGET_TREE_FILES 20
+#define BUDGET_FILE_SIZE 1000
+
+// Reads every file of the "budget" tree through file_content() in order.
+static int chk_budget_pass(const FileTree *tree,
+        char content[][BUDGET_FILE_SIZE + 1])
+{
+        for(unsigned k = 0; k < BUDGET_TREE_FILES; k++) {
+                const FileNode *f = tree->root.subv + k;
+                CHK(f->cached && !f->content);
+                const char *data = file_content(tree, f);
+                CHK(data && !strcmp(data, content[k]));
+                file_content_done(tree, f);
+                CHK(content_cache_stats(tree).bytes <=
+                        tree->conf.content_budget);
+        }
+        PASS_QUIETLY();
+}
+
+typedef struct {
+        const FileTree *tree;
+        char (*content)[BUDGET_FILE_SIZE + 1];
+        unsigned nbad;
+} BudgetCheck;
+
+// Checks the content of a file of the "budget" tree, from several threads.
+static void chk_budget_file_(const FileNode *node, void *arg)
+{
+        BudgetCheck *bc = arg;
+        unsigned k = node - bc->tree->root.subv;
+        for(unsigned n = 0; n < 4; n++) {
+                const char *data = file_content(bc->tree, node);
+                if(!data || strcmp(data, bc->content[k]))
+                        __atomic_add_fetch(&bc->nbad, 1, __ATOMIC_RELAXED);
+                if(data)
+                        file_content_done(bc->tree, node);
+        }
+}
+
+static int test_content_budget(void)
+{
+        static char content[BUDGET_TREE_FILES][BUDGET_FILE_SIZE + 1];
+        CHK(noerror(make_dir_("budget")));
+        for(unsigned k = 0; k < BUDGET_TREE_FILES; k++) {
+                char name[16];
+                snprintf(name, sizeof name, "f%02u", k);
+                for(unsigned j = 0; j < BUDGET_FILE_SIZE; j++)
+                        content[k][j] = 'a' + (j + k) % 26;
+                memcpy(content[k], name, 3);
+                TestFile tf = {name, content[k]};
+                CHK(noerror(make_test_file_("budget", &tf)));
+        }
+
+        FileTree tree = { .conf = {
+                .root_path = "budget",
+                .content_budget = 5 * BUDGET_FILE_SIZE,
+                .chunk_size = 64,
+                .index_lines = true,
+        } };
+        CHK(noerror(read_tree(&tree)));
+        CHK(chk_tree_ok(&tree.conf, &tree.root));
+        CHK(!tree.chunk_pool);
+        CHK(tree.root.nsub == BUDGET_TREE_FILES);
+        CHK(tree.root.subv[0].size == BUDGET_FILE_SIZE);
+
+        // read_tree() leaves the first files it read loaded.
+        ContentCacheStats cs = content_cache_stats(&tree);
+        CHK(cs.files == 5 && cs.bytes == 5 * BUDGET_FILE_SIZE);
+        CHK(!cs.hits && !cs.misses && !cs.evictions);
+
+        // Round and round: the first five are hits, then LRU always misses.
+        CHK(chk_budget_pass(&tree, content));
+        CHK(chk_budget_pass(&tree, content));
+        cs = content_cache_stats(&tree);
+        CHK(cs.hits == 5);
+        CHK(cs.misses == 2 * BUDGET_TREE_FILES - 5);
+        CHK(cs.evictions == cs.misses);
+        CHK(cs.files == 5 && cs.peak_bytes == 5 * BUDGET_FILE_SIZE);
+
+        const FileNode *last = tree.root.subv + BUDGET_TREE_FILES - 1;
+        const char *data = file_content(&tree, last);
+        CHK(file_content(&tree, last) == data);
+        CHK(content_cache_stats(&tree).hits == cs.hits + 2);
+        file_content_done(&tree, last);
+        file_content_done(&tree, last);
+
+        // search_tree() loads what it needs without disturbing the cache.
+        const char *literalv[] = {"f1"};
+        TreeMatches matches = search_tree(&tree, literalv, 1, 0);
+        CHK(matches.n == 10);
+        destroy_tree_matches(&matches);
+        CHK(content_cache_stats(&tree).misses == cs.misses);
+
+        // Threads share the cache, each file's content staying put while
+        // they use it.
+        BudgetCheck bc = { .tree = &tree, .content = content };
+        tree_parallel_for_each(&tree, 4, chk_budget_file_, &bc);
+        CHK(!bc.nbad);
+        cs = content_cache_stats(&tree);
+        CHK(cs.bytes <= tree.conf.content_budget && !cs.failures);
+
+        // A file which has changed size can't be loaded again.
+        for(unsigned k = 0; k < 5; k++) {
+                CHK(file_content(&tree, tree.root.subv + k));
+                file_content_done(&tree, tree.root.subv + k);
+        }
+        CHK(noerror(write_bytes_("budget/f19", "changed", 7)));
+        CHK(!file_content(&tree, last));
+        CHK(content_cache_stats(&tree).failures == 1);
+
+        release_file_content(&tree, tree.root.subv);
+        CHK(content_cache_stats(&tree).files == 4);
+        CHK(!file_content(&tree, tree.root.subv));
+        destroy_tree(&tree);
+
+        // Files bigger than the budget are still loaded, one at a time.
+        tree = (FileTree){ .conf = {
+                .root_path = "budget",
+                .content_budget = 1,
+        } };
+        CHK(noerror(read_tree(&tree)));
+        CHK(!content_cache_stats(&tree).files);
+        data = file_content(&tree, tree.root.subv + 1);
+        CHK(data && !strcmp(data, content[1]));
+        CHK(content_cache_stats(&tree).files == 1);
+
+        // Content in use stays, over the budget, until file_content_done().
+        const char *data2 = file_content(&tree, tree.root.subv + 2);
+        CHK(data2 && !strcmp(data2, content[2]));
+        CHK(!strcmp(data, content[1]));
+        cs = content_cache_stats(&tree);
+        CHK(cs.files == 2 && !cs.evictions);
+        file_content_done(&tree, tree.root.subv + 1);
+        cs = content_cache_stats(&tree);
+        CHK(cs.files == 1 && cs.evictions == 1);
+        file_content_done(&tree, tree.root.subv + 2);
+        CHK(content_cache_stats(&tree).files == 1);
+        destroy_tree(&tree);
+        PASS();
+}
+
+// Collects what diff_trees() reports as "+path", "-path" or "~path" lines.
+static void record_diff_(TreeDiff diff, const FileNode *a, const FileNode *b,
+        void *arg)
+{
+        char *log = arg;
+        const FileNode *node = a ? a : b;
+        if(a && b)
+                CHK(!strcmp(a->path, b->path));
+        size_t n = strlen(log);
+        snprintf(log + n, 1024 - n, "%c%s\n",
+                diff == TREE_DIFF_ADDED ? '+' :
+                diff == TREE_DIFF_REMOVED ? '-' : '~', node->path);
+fail:
+        return;
+}
+
+static int test_diff_trees(void)
+{
+        static char big_a[BIG_TEXT_SIZE + 1], big_b[BIG_TEXT_SIZE + 1];
+        for(unsigned k = 0; k < BIG_TEXT_SIZE; k++)
+                big_a[k] = big_b[k] = 'a' + k % 26;
+        big_b[BIG_TEXT_SIZE - 40] = '!';
+        TestFile files_a[] = {
+                {"", NULL},
+                {"big", big_a},
+                {"d", NULL},
+                {"d/changed", "old"},
+                {"d/same", "same"},
+                {"gone", NULL},
+                {"gone/f", "bye"},
+                {"resized", "abc"},
+                {"same_dir", NULL},
+                {"same_dir/f", "s"},
+                {"was_file", "f"},
+                {0},
+        };
+        TestFile files_b[] = {
+                {"", NULL},
+                {"big", big_b},
+                {"d", NULL},
+                {"d/added", "hi"},
+                {"d/changed", "new"},
+                {"d/same", "same"},
+                {"new_dir", NULL},
+                {"new_dir/x", "x"},
+                {"resized", "abcd"},
+                {"same_dir", NULL},
+                {"same_dir/f", "s"},
+                {"was_file", NULL},
+                {"was_file/g", "g"},
+                {0},
+        };
+        CHK(make_test_tree("diff_a", files_a));
+        CHK(make_test_tree("diff_b", files_b));
+        const char *xlog =
+                "~big\n"
+                "+d/added\n"
+                "~d/changed\n"
+                "-gone\n"
+                "+new_dir\n"
+                "~resized\n"
+                "~was_file\n";
+
+        for(unsigned mode = 0; mode < 4; mode++) {
+                ReadTreeConf conf = {
+                        .hash_content = mode & 1,
+                        .chunk_size = mode & 2 ? 64 : 0,
+                };
+                FileTree a = { .conf = conf }, b = { .conf = conf };
+                a.conf.root_path = "diff_a";
+                b.conf.root_path = "diff_b";
+                // Chunks on one side only, to compare across boundaries.
+                b.conf.chunk_size = 0;
+                CHK(noerror(read_tree(&a)));
+                CHK(noerror(read_tree(&b)));
+                CHK(chk_tree_ok(&a.conf, &a.root));
+                CHK(chk_tree_ok(&b.conf, &b.root));
+
+                char log[1024] = "";
+                CHK(diff_trees(&a, &b, record_diff_, log) == 7);
+                CHKV(!strcmp(log, xlog), "diff gave:\n%s", log);
+                CHK(!diff_trees(&a, &a, NULL, NULL));
+                if(conf.hash_content) {
+                        const FileNode *sa = a.root.subv, *sb = b.root.subv;
+                        CHK(sa[0].hash != sb[0].hash);
+                        CHK(sa[4].hash == sb[4].hash); // same_dir
+                        CHK(a.root.hash != b.root.hash);
+                }
+                destroy_tree(&a);
+                destroy_tree(&b);
+        }
+
+        // Files whose content was released are compared from disk.
+        FileTree a = { .conf = { .root_path = "diff_a" } };
+        FileTree b = { .conf = { .root_path = "diff_b" } };
+        CHK(noerror(read_tree(&a)));
+        CHK(noerror(read_tree(&b)));
+        FileNode *da = a.root.subv + 1, *db = b.root.subv + 1;
+        CHK_STR_EQ(da->subv[0].path, "d/changed");
+        CHK_STR_EQ(db->subv[2].path, "d/same");
+        release_file_content(&a, a.root.subv);
+        release_file_content(&a, da->subv + 0);
+        release_file_content(&b, db->subv + 1);
+        release_file_content(&a, da->subv + 1);
+        release_file_content(&b, db->subv + 2);
+        char log[1024] = "";
+        CHK(diff_trees(&a, &b, record_diff_, log) == 7);
+        CHKV(!strcmp(log, xlog), "diff gave:\n%s", log);
+        CHK(!diff_trees(&a, &a, NULL, NULL));
+        // ... as they are now, and files no longer there count as changed.
+        CHK(noerror(write_bytes_("diff_b/d/same", "SAME", 4)));
+        CHK(diff_trees(&a, &b, NULL, NULL) == 8);
+        CHK(!unlink("diff_a/d/same") && !unlink("diff_b/d/same"));
+        CHK(diff_trees(&a, &b, NULL, NULL) == 8);
+        CHK(noerror(write_bytes_("diff_a/d/same", "same", 4)));
+        CHK(noerror(write_bytes_("diff_b/d/same", "same", 4)));
+        CHK(diff_trees(&a, &b, NULL, NULL) == 7);
+        destroy_tree(&a);
+        destroy_tree(&b);
+
+        // A tree diffs clean against another read of itself, however it is
+        // read.
+        a = (FileTree){ .conf = {
+                .root_path = "diff_b",
+                .hash_content = true,
+                .chunk_size = 7,
+        } };
+        b = (FileTree){ .conf = {
+                .root_path = "diff_b",
+                .hash_content = true,
+                .pack_content = true,
+        } };
+        CHK(noerror(read_tree(&a)));
+        CHK(noerror(read_tree(&b)));
+        CHK(a.root.hash == b.root.hash);
+        CHK(!diff_trees(&a, &b, NULL, NULL));
+        destroy_tree(&a);
+        destroy_tree(&b);
+        PASS();
+}
+
+// Writes `tree` to `dest`, reads it back with `conf` and checks that it is
+// the same.
+static int chk_write_tree(const FileTree *tree, const char *dest,
+        ReadTreeConf conf)
+{
+        CHK(noerror(write_tree(tree, dest, 4)));
+        FileTree back = { .conf = conf };
+        back.conf.root_path = dest;
+        CHK(noerror(read_tree(&back)));
+        CHK(chk_tree_ok(&back.conf, &back.root));
+        unsigned ndiff = diff_trees(tree, &back, NULL, NULL);
+        CHKV(!ndiff, "%u differences writing %s", ndiff, dest);
+        if(tree->conf.hash_content && conf.hash_content)
+                CHK(back.root.hash == tree->root.hash);
+        destroy_tree(&back);
+        PASS_QUIETLY();
+}
+
+static int test_write_tree(void)
+{
+        // The trees from test_diff_trees(), read in all sorts of ways.
+        const ReadTreeConf confv[] = {
+                { .root_path = "diff_b", .hash_content = true },
+                { .root_path = "diff_b", .chunk_size = 7 },
+                { .root_path = "diff_b", .pack_content = true },
+                { .root_path = "diff_a", .content_budget = 1 },
+                { .root_path = "diff_a/big", .hash_content = true },
+        };
+        for(unsigned k = 0; k < sizeof confv / sizeof confv[0]; k++) {
+                FileTree tree = { .conf = confv[k] };
+                CHK(noerror(read_tree(&tree)));
+                char dest[32];
+                snprintf(dest, sizeof dest, "write_tree_%u", k);
+                ReadTreeConf back = { .hash_content = true };
+                CHK(chk_write_tree(&tree, dest, back));
+                destroy_tree(&tree);
+        }
+
+        // Shared directories become symlinks, cycles and all.
+        FileTree tree;
+        CHK(make_test_tree(tc_symlink_farm_.conf.root_path,
+                tc_symlink_farm_.files));
+        CHK(chk_read_symlink_farm(&tree, READ_TREE_SYMLINKS_SHARE));
+        ReadTreeConf back = { .symlinks = READ_TREE_SYMLINKS_SHARE };
+        CHK(chk_write_tree(&tree, "write_tree_farm", back));
+        destroy_tree(&tree);
+
+        tree = (FileTree){ .conf = { .root_path = "diff_b" } };
+        CHK(noerror(read_tree(&tree)));
+        Error *err = write_tree(&tree, "diff_b/big/under_a_file", 0);
+        CHK(err);
+        destroy_error(err);
+        destroy_tree(&tree);
+        PASS();
+}
+
+// Checks the entries of a tar stream from *pat on against `node` and the
+// nodes under it, in tree order; `path` is what `node` should be called.
+static int chk_tar_node(const char *tar, size_t ntar, size_t *pat,
+        const FileNode *node, const char *path)
+{
+        // The root directory has no entry of its own.
+        if(node->subv && !*path)
+                goto subv;
+
+        char name[512] = "";
+        const unsigned char *h;
+        for(;;) {
+                CHK(*pat + 512 <= ntar);
+                h = (const unsigned char*)tar + *pat;
+                unsigned sum = 0;
+                for(unsigned k = 0; k < 512; k++)
+                        sum += k >= 148 && k < 156 ? ' ' : h[k];
+                CHK(sum == strtoul((const char*)h + 148, NULL, 8));
+                CHK(!memcmp(h + 257, "ustar", 6));
+                size_t size = strtoull((const char*)h + 124, NULL, 8);
+                *pat += 512;
+                if(h[156] != 'x')
+                        break;
+                const char *rec = strstr(tar + *pat, " path=");
+                CHK(rec && rec < tar + *pat + size);
+                rec += 6;
+                memcpy(name, rec, strchr(rec, '\n') - rec);
+                *pat += (size + 511) / 512 * 512;
+        }
+        if(!*name) {
+                if(h[345])
+                        snprintf(name, sizeof name, "%.155s/", h + 345);
+                strncat(name, (const char*)h, 100);
+        }
+
+        if(!node->subv) {
+                CHK(h[156] == '0');
+                CHK(!strcmp(name, path));
+                CHK(strtoull((const char*)h + 124, NULL, 8) == node->size);
+                CHK(*pat + node->size <= ntar);
+                CHK(!memcmp(tar + *pat, node->content, node->size));
+                *pat += (node->size + 511) / 512 * 512;
+        } else {
+                CHK(h[156] == '5');
+                CHK(!strncmp(name, path, strlen(path)));
+                CHK(!strcmp(name + strlen(path), "/"));
+        }
+subv:
+        for(unsigned k = 0; k < node->nsub; k++) {
+                CHK(chk_tar_node(tar, ntar, pat, node->subv + k,
+                        node->subv[k].path));
+        }
+        PASS_QUIETLY();
+}
+
+static int test_write_tree_tar(void)
+{
+        // Long enough paths to need a ustar prefix, and a pax header.
+        char dir[64], file[128], path[256];
+        memset(dir, 'd', sizeof dir - 1);
+        memset(file, 'f', sizeof file - 1);
+        dir[sizeof dir - 1] = file[sizeof file - 1] = 0;
+        CHK(noerror(make_dir_("tar_long")));
+        snprintf(path, sizeof path, "tar_long/%s", dir);
+        CHK(noerror(make_dir_(path)));
+        snprintf(path, sizeof path, "%s/%s", dir, dir);
+        TestFile split = {path, "split"};
+        CHK(noerror(make_test_file_("tar_long", &split)));
+        snprintf(path, sizeof path, "%s/%s", dir, file);
+        TestFile pax = {path, "needs pax"};
+        CHK(noerror(make_test_file_("tar_long", &pax)));
+
+        const ReadTreeConf confv[] = {
+                { .root_path = "diff_b" },
+                { .root_path = "diff_b", .chunk_size = 7 },
+                { .root_path = "diff_b", .content_budget = 1 },
+                { .root_path = "diff_a", .pack_content = true },
+                { .root_path = "diff_a/big" },
+                { .root_path = "tar_long" },
+        };
+        for(unsigned k = 0; k < sizeof confv / sizeof confv[0]; k++) {
+                FileTree tree = { .conf = confv[k] };
+                FileTree ref = { .conf = { .root_path = confv[k].root_path } };
+                CHK(noerror(read_tree(&tree)));
+                CHK(noerror(read_tree(&ref)));
+
+                FILE *f = tmpfile();
+                CHK(f);
+                CHK(noerror(write_tree_tar(&tree, fileno(f))));
+                size_t ntar = lseek(fileno(f), 0, SEEK_CUR);
+                CHK(ntar % 512 == 0);
+                char *tar = malloc(ntar + 1);
+                CHK(tar && !fseek(f, 0, SEEK_SET));
+                CHK(fread(tar, 1, ntar, f) == ntar);
+                tar[ntar] = 0;
+                fclose(f);
+
+                size_t at = 0;
+                const char *root_name = ref.root.subv ? "" : "big";
+                CHK(chk_tar_node(tar, ntar, &at, &ref.root, root_name));
+                CHK(at + 1024 == ntar);
+                for(size_t j = at; j < ntar; j++)
+                        CHK(!tar[j]);
+                free(tar);
+                destroy_tree(&tree);
+                destroy_tree(&ref);
+        }
+
+        FileTree tree = { .conf = { .root_path = "diff_b" } };
+        CHK(noerror(read_tree(&tree)));
+        Error *err = write_tree_tar(&tree, -1);
+        CHK(err);
+        destroy_error(err);
+        destroy_tree(&tree);
+        PASS();
+}
+
+// The node `s` of the shared tree `t` is the same as `node`, from a tree
+// with all its content in memory, and so are the nodes under them.
+static int chk_shared_node(const SharedTree *t, const SharedNode *s,
+        const FileNode *node)
+{
+        const FileNode *data = node->alias ? node->alias : node;
+        const char *path = SHARED_TREE_STR(t, s->path);
+        CHK(path && !strcmp(path, node->path));
+        CHK(s->size == node->size && s->nsub == node->nsub);
+        CHK(!(s->flags & TREE_VIEW_ALIAS) == !node->alias);
+        if(data->subv || data->unexpanded) {
+                CHK(s->flags & TREE_VIEW_DIR);
+                const char *alias = SHARED_TREE_STR(t, s->alias);
+                CHK(!node->alias || (alias &&
+                        !strcmp(alias, node->alias->path)));
+        } else {
+                const char *content = SHARED_TREE_STR(t, s->content);
+                CHK(!(s->flags & TREE_VIEW_DIR));
+                CHK(content && !memcmp(content, data->content,
+                        node->size + 1));
+        }
+        for(unsigned k = 0; k < node->nsub; k++) {
+                CHK(chk_shared_node(t, t->nodev + s->subv + k,
+                        node->subv + k));
+        }
+        PASS_QUIETLY();
+}
+
+// Copies the segment of `t` to a memfd with nodev[k] replaced by `bad`, and
+// checks that attach_tree_fd() turns it down.
+static int chk_bad_segment(const SharedTree *t, unsigned k, SharedNode bad)
+{
+        int fd = memfd_create("bad", MFD_CLOEXEC);
+        CHK(fd >= 0);
+        size_t at = (const char*)(t->nodev + k) - t->base;
+        CHK(write(fd, t->base, t->size) == (ssize_t)t->size);
+        CHK(pwrite(fd, &bad, sizeof bad, at) == sizeof bad);
+        SharedTree back;
+        Error *err = attach_tree_fd(&back, fd);
+        close(fd);
+        CHKV(err, "node %u accepted", k);
+        destroy_error(err);
+        PASS_QUIETLY();
+}
+
+static int test_shared_tree(void)
+{
+        char name[64];
+        snprintf(name, sizeof name, "/readtree_test_%d", (int)getpid());
+        FileTree ref = { .conf = { .root_path = "diff_b" } };
+        CHK(noerror(read_tree(&ref)));
+
+        // Each generation has the whole tree, however it was read.
+        const ReadTreeConf confv[] = {
+                { .root_path = "diff_b", .chunk_size = 7 },
+                { .root_path = "diff_b", .pack_content = true },
+                { .root_path = "diff_b", .content_budget = 1 },
+        };
+        SharedTree first = {0}, t;
+        for(unsigned k = 0; k < sizeof confv / sizeof confv[0]; k++) {
+                FileTree tree = { .conf = confv[k] };
+                CHK(noerror(read_tree(&tree)));
+                unsigned long long gen;
+                CHK(noerror(publish_tree(&tree, name, &gen)));
+                CHK(gen == k + 1);
+                destroy_tree(&tree);
+                CHK(noerror(attach_tree(&t, name)));
+                CHK(t.generation == gen && !shared_tree_stale(&t));
+                CHK(chk_shared_node(&t, t.nodev, &ref.root));
+                if(k)
+                        detach_tree(&t);
+                else
+                        first = t;
+        }
+        // Superseded, but still there for those who have it.
+        CHK(shared_tree_stale(&first));
+        CHK(chk_shared_node(&first, first.nodev, &ref.root));
+        detach_tree(&first);
+
+        // Another process sees the same.
+        fflush(stdout);
+        pid_t pid = fork();
+        if(!pid) {
+                bool ok = !attach_tree(&t, name) && t.generation == 3 &&
+                          chk_shared_node(&t, t.nodev, &ref.root);
+                _exit(ok ? 0 : 1);
+        }
+        int status;
+        CHK(pid > 0 && waitpid(pid, &status, 0) == pid);
+        CHK(WIFEXITED(status) && !WEXITSTATUS(status));
+
+        CHK(noerror(attach_tree(&t, name)));
+        CHK(noerror(unpublish_tree(name)));
+        CHK(shared_tree_stale(&t));
+        detach_tree(&t);
+        Error *err = attach_tree(&t, name);
+        CHK(err);
+        destroy_error(err);
+
+        // Publishers of one name take turns.
+        fflush(stdout);
+        pid = fork();
+        if(!pid) {
+                bool ok = true;
+                for(unsigned k = 0; k < 20; k++)
+                        ok = ok && !publish_tree(&ref, name, NULL);
+                _exit(ok ? 0 : 1);
+        }
+        CHK(pid > 0);
+        for(unsigned k = 0; k < 20; k++)
+                CHK(noerror(publish_tree(&ref, name, NULL)));
+        CHK(waitpid(pid, &status, 0) == pid);
+        CHK(WIFEXITED(status) && !WEXITSTATUS(status));
+        CHK(noerror(attach_tree(&t, name)));
+        CHK(t.generation == 40);
+        CHK(chk_shared_node(&t, t.nodev, &ref.root));
+        detach_tree(&t);
+        CHK(noerror(unpublish_tree(name)));
+        destroy_tree(&ref);
+
+        // Content that can't be loaded again fails the publish.
+        FileTree budget = { .conf = {
+                .root_path = "diff_b",
+                .content_budget = 1,
+        } };
+        CHK(noerror(read_tree(&budget)));
+        CHK(noerror(write_bytes_("diff_b/d/same", "longer", 6)));
+        err = publish_tree(&budget, name, NULL);
+        CHK(err && sys_error(err, NULL, NULL) == ESTALE);
+        destroy_error(err);
+        CHK(noerror(write_bytes_("diff_b/d/same", "same", 4)));
+        CHK(noerror(publish_tree(&budget, name, NULL)));
+        CHK(noerror(unpublish_tree(name)));
+        destroy_tree(&budget);
+
+        // A sealed memfd, with aliases.
+        CHK(make_test_tree(tc_symlink_farm_.conf.root_path,
+                tc_symlink_farm_.files));
+        CHK(chk_read_symlink_farm(&ref, READ_TREE_SYMLINKS_SHARE));
+        int fd;
+        CHK(noerror(publish_tree_fd(&ref, &fd)));
+        CHK(fcntl(fd, F_GET_SEALS) & F_SEAL_WRITE);
+        CHK(noerror(attach_tree_fd(&t, fd)));
+        close(fd);
+        CHK(!t.generation && !shared_tree_stale(&t));
+        CHK(chk_shared_node(&t, t.nodev, &ref.root));
+
+        // Offsets that only fit if their sums wrap around are turned down.
+        unsigned file = 0;
+        while(file < t.nnode && !t.nodev[file].content)
+                file++;
+        CHK(file < t.nnode && t.nodev[0].nsub);
+        SharedNode bad = t.nodev[0];
+        bad.subv = 0xffffffff;
+        bad.nsub = 2;
+        CHK(chk_bad_segment(&t, 0, bad));
+        bad = t.nodev[file];
+        bad.content = ~0ull - 5;
+        bad.size = 10;
+        CHK(chk_bad_segment(&t, file, bad));
+        bad.content = t.size - 1;
+        CHK(chk_bad_segment(&t, file, bad));
+        detach_tree(&t);
+        destroy_tree(&ref);
+        PASS();
+}
 
 int main(void)
 {
@@ -650,6 +2723,33 @@ int main(void)
         test_happy_case(tc_drop_dirs_without_suffix_);
         test_happy_case(tc_happy_root_is_file_);
         test_happy_case(tc_happy_root_untrimmed_root_);
+        test_happy_case(tc_happy_chunked_);
+        test_happy_case(tc_keep_going_);
+        test_release_chunks();
+        test_stats();
+        test_concurrent_read_tree();
+        test_keep_going();
+        test_depth_limit();
+        test_deep_tree();
+        test_breadth_first();
+        test_max_depth();
+        test_happy_case(tc_symlink_farm_);
+        test_symlink_policies();
+        test_share_hardlinks();
+        test_one_file_system();
+        test_forest();
+        test_tree_view();
+        test_tree_reduce();
+        test_search_tree();
+        test_line_index();
+        test_classify();
+        test_decompress();
+        test_pack_content();
+        test_content_budget();
+        test_diff_trees();
+        test_write_tree();
+        test_write_tree_tar();
+        test_shared_tree();
 
         test_sad_case(tc_sad_root_does_not_exist_);
         test_sad_case(tc_sad_cyclic_link_);
@@ -0,0 +1,223 @@
+// TreeView: a flat, struct-of-arrays copy of the shape of a FileTree.
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "readtree.h"
+
+// The most ranges tree_view_reduce() splits a view into, and the fewest nodes
+// it puts in each.
+#define MAX_REDUCE_RANGES 256
+#define MIN_REDUCE_RANGE 1024
+
+// A directory part way through being walked.
+typedef struct {
+        const FileNode *node;
+        unsigned index; // in the view
+        unsigned next;  // index in node->subv of the next child to visit
+} Walk_;
+
+static const char *node_name_(const FileNode *node)
+{
+        const char *slash = strrchr(node->path, '/');
+        return slash ? slash + 1 : node->path;
+}
+
+// Adds `node` to the view as node v->n, and returns true if it has children.
+// If the arrays of `v` are NULL, this only counts nodes and name bytes.
+static bool visit_(TreeView *v, size_t *pnames, const FileNode *node,
+        unsigned parent)
+{
+        unsigned k = v->n++;
+        const char *name = node_name_(node);
+        size_t len = strlen(name) + 1;
+        if(v->parent) {
+                const FileNode *data = node->alias ? node->alias : node;
+                v->parent[k] = parent;
+                v->end[k] = k + 1;
+                v->size[k] = node->size;
+                v->name[k] = *pnames;
+                v->flags[k] = (data->subv || data->unexpanded ?
+                                        TREE_VIEW_DIR : 0) |
+                              (node->alias ? TREE_VIEW_ALIAS : 0) |
+                              (node->unexpanded ? TREE_VIEW_UNEXPANDED : 0);
+                v->content[k] = data->content;
+                v->node[k] = node;
+                memcpy(v->names + *pnames, name, len);
+        }
+        *pnames += len;
+        return node->nsub;
+}
+
+// Walks `root` in preorder, adding every node to `v` (see visit_()).
+static void walk_(TreeView *v, size_t *pnames, const FileNode *root)
+{
+        Walk_ *stack = NULL;
+        unsigned nstack = 0, alloc = 0;
+        v->n = 0;
+        *pnames = 0;
+
+        if(visit_(v, pnames, root, 0)) {
+                stack = MALLOC((alloc = 16) * sizeof *stack);
+                stack[nstack++] = (Walk_){ .node = root };
+        }
+        while(nstack) {
+                Walk_ *top = stack + nstack - 1;
+                if(top->next == top->node->nsub) {
+                        if(v->end)
+                                v->end[top->index] = v->n;
+                        nstack--;
+                        continue;
+                }
+                const FileNode *sub = top->node->subv + top->next++;
+                unsigned index = v->n, parent = top->index;
+                if(!visit_(v, pnames, sub, parent))
+                        continue;
+                if(nstack == alloc) {
+                        stack = realloc(stack, (alloc *= 2) * sizeof *stack);
+                        if(!stack)
+                                PANIC_NOMEM();
+                }
+                stack[nstack++] = (Walk_){ .node = sub, .index = index };
+        }
+        free(stack);
+}
+
+// See read_tree.h?new_tree_view
+TreeView *new_tree_view(const FileTree *tree)
+{
+        if(!tree)
+                PANIC("'tree' is null");
+
+        TreeView *v = MALLOC(sizeof *v);
+        *v = (TreeView){0};
+        size_t names;
+        walk_(v, &names, &tree->root);
+
+        unsigned n = v->n;
+        v->parent = MALLOC(n * sizeof *v->parent);
+        v->end = MALLOC(n * sizeof *v->end);
+        v->size = MALLOC(n * sizeof *v->size);
+        v->name = MALLOC(n * sizeof *v->name);
+        v->flags = MALLOC(n * sizeof *v->flags);
+        v->content = MALLOC(n * sizeof *v->content);
+        v->node = MALLOC(n * sizeof *v->node);
+        v->names = MALLOC(names);
+        walk_(v, &names, &tree->root);
+        assert(v->n == n);
+        return v;
+}
+
+// See read_tree.h?destroy_tree_view
+void destroy_tree_view(TreeView *v)
+{
+        if(!v)
+                return;
+        free(v->parent);
+        free(v->end);
+        free(v->size);
+        free(v->name);
+        free(v->flags);
+        free(v->content);
+        free(v->node);
+        free(v->names);
+        free(v);
+}
+
+// -- Reductions -------------------------------------------------------
+
+typedef struct {
+        const TreeView *view;
+        void (*scan)(const TreeView*, unsigned, unsigned, void*, void*);
+        char *parts;
+        size_t acc_size;
+        unsigned nrange;
+        void *arg;
+} Reduce_;
+
+static void reduce_task_(void *vr, unsigned k)
+{
+        Reduce_ *r = vr;
+        unsigned n = r->view->n;
+        unsigned begin = (unsigned long long)n * k / r->nrange;
+        unsigned end = (unsigned long long)n * (k + 1) / r->nrange;
+        r->scan(r->view, begin, end, r->parts + k * r->acc_size, r->arg);
+}
+
+// See read_tree.h?tree_view_reduce
+void tree_view_reduce(
+        const TreeView *view,
+        unsigned nthreads,
+        void (*scan)(const TreeView *view, unsigned begin, unsigned end,
+                void *part, void *arg),
+        void (*merge)(void *acc, const void *part, void *arg),
+        void *acc,
+        size_t acc_size,
+        void *arg)
+{
+        assert(view && scan && merge && acc);
+        unsigned nrange = view->n / MIN_REDUCE_RANGE;
+        if(nrange > MAX_REDUCE_RANGES)
+                nrange = MAX_REDUCE_RANGES;
+        if(!nrange)
+                nrange = 1;
+
+        Reduce_ r = {
+                .view = view,
+                .scan = scan,
+                .parts = MALLOC(nrange * acc_size),
+                .acc_size = acc_size,
+                .nrange = nrange,
+                .arg = arg,
+        };
+        for(unsigned k = 0; k < nrange; k++)
+                memcpy(r.parts + k * acc_size, acc, acc_size);
+
+        read_tree_run_batch_(nthreads, nrange, reduce_task_, &r);
+        for(unsigned k = 0; k < nrange; k++)
+                merge(acc, r.parts + k * acc_size, arg);
+        free(r.parts);
+}
+
+static void totals_scan_(const TreeView *v, unsigned begin, unsigned end,
+        void *vpart, void *arg)
+{
+        TreeViewTotals *t = vpart;
+        unsigned long long bytes = 0, dirs = 0;
+        // Hard links after the first (aliases) have no bytes of their own.
+        for(unsigned k = begin; k < end; k++) {
+                bytes += v->flags[k] & TREE_VIEW_ALIAS ? 0 : v->size[k];
+                dirs += v->flags[k] & TREE_VIEW_DIR;
+        }
+        unsigned largest = t->largest;
+        for(unsigned k = begin; k < end; k++) {
+                if(v->size[k] > v->size[largest])
+                        largest = k;
+        }
+        t->bytes += bytes;
+        t->dirs += dirs;
+        t->files += end - begin - dirs;
+        t->largest = largest;
+}
+
+static void totals_merge_(void *vacc, const void *vpart, void *arg)
+{
+        const TreeView *v = arg;
+        TreeViewTotals *acc = vacc;
+        const TreeViewTotals *part = vpart;
+        acc->files += part->files;
+        acc->dirs += part->dirs;
+        acc->bytes += part->bytes;
+        if(v->size[part->largest] > v->size[acc->largest])
+                acc->largest = part->largest;
+}
+
+// See read_tree.h?tree_view_totals
+TreeViewTotals tree_view_totals(const TreeView *view, unsigned nthreads)
+{
+        TreeViewTotals t = {0};
+        tree_view_reduce(view, nthreads, totals_scan_, totals_merge_,
+                &t, sizeof t, (void*)view);
+        return t;
+}
@@ -0,0 +1,661 @@
+// write_tree() and write_tree_tar(): writing a FileTree back out, to disk or as
+// a tar stream.
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "readtree.h"
+
+// The most chunks written by one writev().
+#define MAX_IOV 64
+// The buffer for copying a file when copy_file_range() can't.
+#define COPY_BUF (64 << 10)
+
+// The first thing that went wrong writing one directory, turned into an
+// Error on the calling thread.
+typedef struct {
+        int ern;
+        char *path;
+        const char *what;
+} Failure_;
+
+// A directory of the tree, and where it goes.
+typedef struct {
+        const FileNode *node;
+        char *path;
+} WriteDir_;
+
+typedef struct {
+        const FileTree *tree;
+        // The directories of one level of the tree, created by the level
+        // before, and how they went.
+        WriteDir_ *dirv;
+        Failure_ *failv;
+        unsigned ndir;
+} Writer_;
+
+static char *join_(const char *dir, const char *name)
+{
+        char *path;
+        if(0 > asprintf(&path, "%s/%s", dir, name))
+                PANIC_NOMEM();
+        return path;
+}
+
+// The last component of `path`.
+static const char *base_name_(const char *path)
+{
+        const char *slash = strrchr(path, '/');
+        return slash ? slash + 1 : path;
+}
+
+static const char *name_(const FileNode *node)
+{
+        return base_name_(node->path);
+}
+
+// Records a failure at `name` in `dir` (or just `name`, if `dir` is NULL),
+// unless there already was one.  Returns false, for callers to return.
+static bool fail_(Failure_ *f, int ern, const char *dir, const char *name,
+        const char *what)
+{
+        if(f->path)
+                return false;
+        f->ern = ern;
+        f->path = dir ? join_(dir, name) : strdup(name);
+        f->what = what;
+        if(!f->path)
+                PANIC_NOMEM();
+        return false;
+}
+
+static Error *failure_error_(Failure_ *f)
+{
+        Error *err = IO_ERROR(f->path, f->ern, "%s", f->what);
+        free(f->path);
+        f->path = NULL;
+        return err;
+}
+
+static bool write_all_(int fd, const char *data, size_t n)
+{
+        while(n) {
+                ssize_t done = write(fd, data, n);
+                if(done < 0 && errno == EINTR)
+                        continue;
+                if(done < 0)
+                        return false;
+                data += done;
+                n -= done;
+        }
+        return true;
+}
+
+// -- Output -----------------------------------------------------------
+//
+// Content in memory is gathered, with anything written around it, into
+// writev() calls of up to MAX_IOV pieces; content on disk is copied by the
+// kernel.
+
+typedef struct {
+        int fd;
+        unsigned n;
+        struct iovec iov[MAX_IOV];
+} Gather_;
+
+// Writes out what has been gathered.
+static bool flush_(Gather_ *g)
+{
+        ssize_t done;
+        do {
+                done = writev(g->fd, g->iov, g->n);
+        } while(done < 0 && errno == EINTR);
+        if(done < 0)
+                return false;
+        // writev() may stop short; finish off piece by piece.
+        unsigned n = g->n;
+        g->n = 0;
+        for(unsigned k = 0; k < n; k++) {
+                size_t len = g->iov[k].iov_len;
+                size_t skip = (size_t)done < len ? done : len;
+                done -= skip;
+                if(!write_all_(g->fd, (char*)g->iov[k].iov_base + skip,
+                        len - skip))
+                        return false;
+        }
+        return true;
+}
+
+// Adds `len` bytes at `data`, which must stay put until the next flush_().
+static bool gather_(Gather_ *g, const void *data, size_t len)
+{
+        if(!len)
+                return true;
+        if(g->n == MAX_IOV && !flush_(g))
+                return false;
+        g->iov[g->n++] = (struct iovec){ (void*)data, len };
+        return true;
+}
+
+// Copies `size` bytes from `in` to `out` through a buffer.
+static bool copy_buffered_(int in, int out, size_t size)
+{
+        char *buf = MALLOC(COPY_BUF);
+        while(size) {
+                ssize_t got = read(in, buf, size < COPY_BUF ? size : COPY_BUF);
+                if(got < 0 && errno == EINTR)
+                        continue;
+                if(got <= 0 || !write_all_(out, buf, got)) {
+                        if(!got)
+                                errno = ESTALE; // the file shrank
+                        free(buf);
+                        return false;
+                }
+                size -= got;
+        }
+        free(buf);
+        return true;
+}
+
+// True for the errors of a kernel copy that just isn't supported here.
+static bool unsupported_(int ern)
+{
+        return ern == EXDEV || ern == ENOSYS || ern == EINVAL ||
+                ern == EOPNOTSUPP;
+}
+
+// Copies `size` bytes from `in` to the file `out` inside the kernel, which lets
+// file systems that can share extents (reflinks) do so.
+static bool copy_range_(int in, int out, size_t size)
+{
+        while(size) {
+                ssize_t done = copy_file_range(in, NULL, out, NULL, size, 0);
+                if(done > 0) {
+                        size -= done;
+                } else if(!done) {
+                        errno = ESTALE;
+                        return false;
+                } else if(errno != EINTR) {
+                        return unsupported_(errno) &&
+                                copy_buffered_(in, out, size);
+                }
+        }
+        return true;
+}
+
+// Copies `size` bytes from `in` to `out`, which may be a pipe or socket,
+// inside the kernel.
+static bool send_(int in, int out, size_t size)
+{
+        while(size) {
+                ssize_t done = sendfile(out, in, NULL, size);
+                if(done > 0) {
+                        size -= done;
+                } else if(!done) {
+                        errno = ESTALE;
+                        return false;
+                } else if(errno != EINTR) {
+                        return unsupported_(errno) &&
+                                copy_buffered_(in, out, size);
+                }
+        }
+        return true;
+}
+
+// Gathers the content of the file `node` of `tree` (not an alias) into `g`.
+// Content in memory may be left gathered for the caller to flush_(); the rest
+// is written straight away, copied by `copy` from where the file was read if
+// it isn't in memory (and is still the same size).
+static bool put_content_(
+        const FileTree *tree,
+        Gather_ *g,
+        const FileNode *node,
+        bool (*copy)(int in, int out, size_t size))
+{
+        assert(!node->alias);
+        char *whole = NULL;
+        if(node->content || node->chunks) {
+                const char *data;
+                unsigned size;
+                FileChunkIter it = file_chunks(node);
+                while(file_chunk_next(&it, &data, &size)) {
+                        if(!gather_(g, data, size))
+                                return false;
+                }
+                return true;
+        } else if(node->packed) {
+                whole = MALLOC(node->size + 1);
+                read_tree_unpack_(node, whole);
+        } else if(node->disk_size) {
+                // Decompressed as it was read, so the disk has the wrong
+                // bytes.
+                whole = node->cached ? read_tree_load_(tree, node) : NULL;
+                if(!whole) {
+                        errno = ESTALE;
+                        return false;
+                }
+        }
+        if(whole) {
+                bool ok = gather_(g, whole, node->size) && flush_(g);
+                int ern = errno;
+                free(whole);
+                errno = ern;
+                return ok;
+        }
+
+        if(!flush_(g))
+                return false;
+        int in = open(node->full_path, O_RDONLY | O_CLOEXEC);
+        if(in < 0)
+                return false;
+        struct stat st;
+        bool ok = !fstat(in, &st);
+        if(ok && st.st_size != node->size) {
+                errno = ESTALE;
+                ok = false;
+        }
+        ok = ok && copy(in, g->fd, node->size);
+        int ern = errno;
+        close(in);
+        errno = ern;
+        return ok;
+}
+
+// The path of the alias of the directory `node`, relative to `node`'s own
+// directory, for a symlink.  Free it with free().
+static char *alias_target_(const FileNode *node)
+{
+        unsigned up = 0;
+        for(const char *c = node->path; *c; c++)
+                up += *c == '/';
+        size_t len = strlen(node->alias->path);
+        char *target = MALLOC(3 * up + len + 2);
+        char *t = target;
+        for(unsigned k = 0; k < up; k++, t += 3)
+                memcpy(t, "../", 3);
+        if(!len && t == target)
+                *t++ = '.';
+        memcpy(t, node->alias->path, len + 1);
+        return target;
+}
+
+// -- Writing to disk --------------------------------------------------
+
+// Writes the file `node` as `name` in the directory `dfd`, which is `dir`.
+static bool write_file_(const Writer_ *w, int dfd, const char *dir,
+        const char *name, const FileNode *node, Failure_ *f)
+{
+        if(node->alias)
+                node = node->alias;
+        int fd = openat(dfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0666);
+        if(fd < 0)
+                return fail_(f, errno, dir, name, "Creating file");
+
+        Gather_ g = { .fd = fd };
+        bool ok = put_content_(w->tree, &g, node, copy_range_) &&
+                flush_(&g);
+        int ern = errno;
+        if(close(fd) && ok) {
+                ok = false;
+                ern = errno;
+        }
+        return ok || fail_(f, ern, dir, name, "Writing file");
+}
+
+// Makes the symlink for a directory `node` which is an alias, pointing to
+// where its alias is written.
+static bool write_alias_(int dfd, const char *dir, const FileNode *node,
+        Failure_ *f)
+{
+        const char *name = name_(node);
+        char *target = alias_target_(node);
+
+        bool ok = !symlinkat(target, dfd, name);
+        if(!ok && errno == EEXIST) {
+                // Written before: replace it, in case it changed.
+                ok = !unlinkat(dfd, name, 0) && !symlinkat(target, dfd, name);
+        }
+        free(target);
+        return ok || fail_(f, errno, dir, name, "Creating symlink");
+}
+
+// Makes the directory `name` in `dfd`, unless it is already there.
+static bool make_dir_(int dfd, const char *dir, const char *name, Failure_ *f)
+{
+        if(!mkdirat(dfd, name, 0777))
+                return true;
+        struct stat st;
+        int ern = errno;
+        if(ern == EEXIST && !fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) &&
+           S_ISDIR(st.st_mode))
+                return true;
+        return fail_(f, ern, dir, name, "Creating directory");
+}
+
+// Writes the sub-nodes of directory k of the current level, creating (but
+// not filling) its sub-directories.
+static void write_dir_(void *arg, unsigned k)
+{
+        const Writer_ *w = arg;
+        const WriteDir_ *wd = w->dirv + k;
+        Failure_ *f = w->failv + k;
+        int dfd = open(wd->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(dfd < 0) {
+                fail_(f, errno, NULL, wd->path, "Opening directory");
+                return;
+        }
+        const FileNode *node = wd->node;
+        for(unsigned j = 0; j < node->nsub; j++) {
+                const FileNode *sub = node->subv + j;
+                const FileNode *real = sub->alias ? sub->alias : sub;
+                if(!real->subv && !real->unexpanded)
+                        write_file_(w, dfd, wd->path, name_(sub), sub, f);
+                else if(sub->alias)
+                        write_alias_(dfd, wd->path, sub, f);
+                else
+                        make_dir_(dfd, wd->path, name_(sub), f);
+        }
+        close(dfd);
+}
+
+// -- Tar streams ------------------------------------------------------
+//
+// POSIX ustar, with pax extended headers for paths that don't fit.  Every
+// entry has mode 0644 or 0755, owner 0 and mtime 0, since the tree doesn't
+// keep them; so the same tree always makes the same stream.
+
+#define TAR_BLOCK 512
+
+typedef struct {
+        char name[100], mode[8], uid[8], gid[8], size[12], mtime[12];
+        char chksum[8], typeflag, linkname[100], magic[6], version[2];
+        char uname[32], gname[32], devmajor[8], devminor[8], prefix[155];
+        char pad[12];
+} TarHeader_;
+
+// Fails to compile unless TarHeader_ is one block.
+typedef char tar_header_size_[sizeof(TarHeader_) == TAR_BLOCK ? 1 : -1];
+
+static const char zeros_[2 * TAR_BLOCK];
+
+typedef struct {
+        const FileTree *tree;
+        Gather_ g;
+        // The headers of the entry being written, which must stay put until
+        // it is flushed.
+        TarHeader_ pax_head, head;
+        char *pax;
+        size_t npax, pax_alloc;
+} Tar_;
+
+static size_t tar_pad_(unsigned long long size)
+{
+        return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+static void octal_(char *field, size_t width, unsigned long long v)
+{
+        snprintf(field, width, "%0*llo", (int)width - 1, v);
+}
+
+// Adds a pax record "LEN KEY=VALUE\n", where LEN counts itself.
+static void pax_record_(Tar_ *t, const char *key, const char *value)
+{
+        size_t len = strlen(key) + strlen(value) + 3, digits = 1;
+        while(snprintf(NULL, 0, "%zu", len + digits) > (int)digits)
+                digits++;
+        size_t need = t->npax + len + digits + 1;
+        if(need > t->pax_alloc) {
+                t->pax_alloc = 2 * need;
+                t->pax = realloc(t->pax, t->pax_alloc);
+                if(!t->pax)
+                        PANIC_NOMEM();
+        }
+        t->npax += sprintf(t->pax + t->npax, "%zu %s=%s\n", len + digits,
+                key, value);
+}
+
+static void fill_header_(TarHeader_ *h, char type, const char *name,
+        size_t nname, const char *prefix, size_t nprefix, const char *link,
+        unsigned long long size, unsigned mode)
+{
+        *h = (TarHeader_){ .typeflag = type };
+        memcpy(h->name, name, nname);
+        memcpy(h->prefix, prefix, nprefix);
+        if(link) {
+                size_t nlink = strlen(link);
+                memcpy(h->linkname, link, nlink < sizeof h->linkname ?
+                        nlink : sizeof h->linkname);
+        }
+        octal_(h->mode, sizeof h->mode, mode);
+        octal_(h->uid, sizeof h->uid, 0);
+        octal_(h->gid, sizeof h->gid, 0);
+        octal_(h->size, sizeof h->size, size);
+        octal_(h->mtime, sizeof h->mtime, 0);
+        memcpy(h->magic, "ustar", 6);
+        memcpy(h->version, "00", 2);
+
+        memset(h->chksum, ' ', sizeof h->chksum);
+        unsigned sum = 0;
+        for(size_t k = 0; k < sizeof *h; k++)
+                sum += ((unsigned char*)h)[k];
+        snprintf(h->chksum, sizeof h->chksum, "%06o", sum);
+}
+
+// Gathers the header of an entry for `path`, preceded by a pax header if the
+// path or `link` doesn't fit in ustar.
+static bool tar_header_(Tar_ *t, char type, const char *path,
+        const char *link, unsigned long long size, unsigned mode)
+{
+        // ustar splits a long path at a slash into a prefix and a name.
+        size_t len = strlen(path), nprefix = 0;
+        if(len > sizeof t->head.name) {
+                const char *slash = strchr(path, '/');
+                while(slash && len - (slash + 1 - path) > sizeof t->head.name)
+                        slash = strchr(slash + 1, '/');
+                if(slash && slash[1] && slash - path <=
+                   (ptrdiff_t)sizeof t->head.prefix)
+                        nprefix = slash - path;
+        }
+        const char *name = nprefix ? path + nprefix + 1 : path;
+        size_t nname = nprefix ? len - nprefix - 1 : len;
+
+        t->npax = 0;
+        if(nname > sizeof t->head.name) {
+                pax_record_(t, "path", path);
+                nname = sizeof t->head.name;
+        }
+        if(link && strlen(link) > sizeof t->head.linkname)
+                pax_record_(t, "linkpath", link);
+        if(t->npax) {
+                fill_header_(&t->pax_head, 'x', "PaxHeader", 9, "", 0, NULL,
+                        t->npax, 0644);
+                if(!gather_(&t->g, &t->pax_head, TAR_BLOCK) ||
+                   !gather_(&t->g, t->pax, t->npax) ||
+                   !gather_(&t->g, zeros_, tar_pad_(t->npax)))
+                        return false;
+        }
+        fill_header_(&t->head, type, name, nname, path, nprefix, link, size,
+                mode);
+        return gather_(&t->g, &t->head, TAR_BLOCK);
+}
+
+// Writes the entry for `node` (called `path`): a file with its content, a
+// symlink for an alias of a directory, or a directory.  Sets *pdir if the
+// entries under it are still to be written.
+static bool tar_entry_(Tar_ *t, const FileNode *node, const char *path,
+        bool *pdir)
+{
+        *pdir = false;
+        const FileNode *real = node->alias ? node->alias : node;
+        if(!real->subv && !real->unexpanded) {
+                return tar_header_(t, '0', path, NULL, real->size, 0644) &&
+                        put_content_(t->tree, &t->g, real, send_) &&
+                        gather_(&t->g, zeros_, tar_pad_(real->size)) &&
+                        flush_(&t->g);
+        }
+        if(node->alias) {
+                char *target = alias_target_(node);
+                bool ok = tar_header_(t, '2', path, target, 0, 0777) &&
+                        flush_(&t->g);
+                free(target);
+                return ok;
+        }
+
+        *pdir = true;
+        if(!*path)
+                return true;
+        char *dir = join_(path, "");
+        bool ok = tar_header_(t, '5', dir, NULL, 0, 0755) && flush_(&t->g);
+        free(dir);
+        return ok;
+}
+
+// A directory being written, and the next of its sub-nodes.
+typedef struct {
+        const FileNode *node;
+        unsigned next;
+} TarFrame_;
+
+// Writes the entries for `root` (called `path`) and everything under it,
+// each directory before what is in it.  The directories on the way down are
+// kept on a stack, not in recursive calls, however deep the tree.
+static bool tar_tree_(Tar_ *t, const FileNode *root, const char *path)
+{
+        bool dir;
+        if(!tar_entry_(t, root, path, &dir))
+                return false;
+        if(!dir)
+                return true;
+        unsigned alloc = 16, n = 0;
+        TarFrame_ *stack = MALLOC(alloc * sizeof *stack);
+        stack[n++] = (TarFrame_){ .node = root };
+        bool ok = true;
+        while(ok && n) {
+                TarFrame_ *top = stack + n - 1;
+                if(top->next == top->node->nsub) {
+                        n--;
+                        continue;
+                }
+                const FileNode *sub = top->node->subv + top->next++;
+                ok = tar_entry_(t, sub, sub->path, &dir);
+                if(!ok || !dir)
+                        continue;
+                if(n == alloc) {
+                        stack = realloc(stack, (alloc *= 2) * sizeof *stack);
+                        if(!stack)
+                                PANIC_NOMEM();
+                }
+                stack[n++] = (TarFrame_){ .node = sub };
+        }
+        free(stack);
+        return ok;
+}
+
+// -- Public -----------------------------------------------------------
+
+// See read_tree.h?write_tree
+Error *write_tree(const FileTree *tree, const char *dest, unsigned nthreads)
+{
+        if(!tree || !dest)
+                PANIC("'tree' or 'dest' is null");
+        const FileNode *root = &tree->root;
+        Writer_ w = { .tree = tree };
+        Failure_ f = {0};
+
+        if(!root->subv && !root->unexpanded) {
+                if(!write_file_(&w, AT_FDCWD, NULL, dest, root, &f))
+                        return failure_error_(&f);
+                return NULL;
+        }
+        if(!make_dir_(AT_FDCWD, NULL, dest, &f))
+                return failure_error_(&f);
+
+        // One level at a time: each directory of a level is written in
+        // parallel, and makes the directories of the next.
+        w.dirv = MALLOC(sizeof *w.dirv);
+        w.dirv[0] = (WriteDir_){ .node = root, .path = strdup(dest) };
+        w.ndir = 1;
+        if(!w.dirv[0].path)
+                PANIC_NOMEM();
+        Error *err = NULL;
+        while(w.ndir) {
+                w.failv = calloc(w.ndir, sizeof *w.failv);
+                if(!w.failv)
+                        PANIC_NOMEM();
+                read_tree_run_batch_(nthreads, w.ndir, write_dir_, &w);
+
+                unsigned nnext = 0, alloc = 0;
+                WriteDir_ *nextv = NULL;
+                for(unsigned k = 0; k < w.ndir; k++) {
+                        const WriteDir_ *wd = w.dirv + k;
+                        Failure_ *fk = w.failv + k;
+                        if(fk->path && !err)
+                                err = failure_error_(fk);
+                        free(fk->path);
+                        for(unsigned j = 0; !err && j < wd->node->nsub; j++) {
+                                const FileNode *sub = wd->node->subv + j;
+                                if(!sub->subv || sub->alias)
+                                        continue;
+                                if(nnext == alloc) {
+                                        alloc = alloc ? 2 * alloc : 16;
+                                        nextv = realloc(nextv,
+                                                alloc * sizeof *nextv);
+                                        if(!nextv)
+                                                PANIC_NOMEM();
+                                }
+                                nextv[nnext++] = (WriteDir_){
+                                        .node = sub,
+                                        .path = join_(wd->path, name_(sub)),
+                                };
+                        }
+                        free(wd->path);
+                }
+                free(w.failv);
+                free(w.dirv);
+                w.dirv = nextv;
+                w.ndir = nnext;
+                if(err) {
+                        for(unsigned k = 0; k < nnext; k++)
+                                free(nextv[k].path);
+                        free(nextv);
+                        break;
+                }
+        }
+        return err;
+}
+
+// See read_tree.h?write_tree_tar
+Error *write_tree_tar(const FileTree *tree, int fd)
+{
+        if(!tree)
+                PANIC("'tree' is null");
+        Tar_ t = {
+                .tree = tree,
+                .g = { .fd = fd },
+        };
+        // A file at the root goes in under its own name.
+        const FileNode *root = &tree->root;
+        const char *path = root->path;
+        if(!root->subv && !root->unexpanded && !root->alias)
+                path = base_name_(tree->conf.root_path);
+
+        Error *err = NULL;
+        if(!tar_tree_(&t, root, path) ||
+           !gather_(&t.g, zeros_, sizeof zeros_) || !flush_(&t.g))
+                err = IO_ERROR(tree->conf.root_path, errno,
+                        "Writing tar stream");
+        free(t.pax);
+        return err;
+}